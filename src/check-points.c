@@ -1,36 +1,61 @@
-#include <stdio.h>
 #include "elgamal.h"
+#include <stdio.h>
+#include <string.h>
 
 int main ( int argc, char *argv[]) {
-  if (argc != 2) {
+  bool ss = (argc == 3) && (strcmp(argv[1], "-ss") == 0);
+  if ((argc != 2) && !ss) {
     printf(
         "Usage:\n"
-        "  %s tobechecked.bin\n", argv[0]);
+        "  %s [-ss] tobechecked.bin\n\n"
+        "Checks that every point in a ciphertext file (or a shared secret\n"
+        "file with -ss) is valid. The readers of combine-arrays,\n"
+        "get_partial_decryption and decrypt_* run the same check as they go,\n"
+        "so this is only needed to check a file on its own.\n\n"
+        "tobechecked.bin may be - to check stdin.\n", argv[0]);
+    return 1;
   }
   if (sodium_init() < 0 ) {
     exit(-1);
   }
-  FILE *fp = fopen(argv[1], "rb");
-  size_t bytes_read = 0;
-  unsigned char *buffer;
-  ssize_t size;
-  if (fp) {
-    fseek (fp, 0, SEEK_END);
-    size = ftell(fp);
-    rewind(fp);
-    if (size < 0) { return -1; }
-    info_print("Reading %li bytes\n", size);
-    buffer = (unsigned char *)malloc((size_t)size);
-    fread(buffer, 1, (size_t)size, fp);
-    fclose(fp);
+  char *fn = argv[argc-1];
+  FILE *fp = (strcmp(fn, "-") == 0) ? stdin : fopen(fn, "rb");
+  if (!fp) {
+    error_print("ERROR: could not open %s for reading.\n", fn);
+    return 1;
   }
-
-  for (int i=0; i<(size / crypto_core_ristretto255_BYTES); i++) {
-    if (crypto_core_ristretto255_is_valid_point(&(buffer[i*crypto_core_ristretto255_BYTES])) != 1) {
-      error_print("ERROR: Item %i is not a valid code point\n", i);
+  // Checked a chunk of buckets at a time, so stdin can be of any length
+  unsigned int points_per_bucket = ss ? BUCKET_MAX : 2*BUCKET_MAX;
+  size_t bucket_size = (size_t)points_per_bucket*crypto_core_ristretto255_BYTES;
+  unsigned char *buffer = malloc(STREAM_CHUNK_BUCKETS*bucket_size);
+  if (buffer == NULL) {
+    error_print("ERROR: could not allocate a buffer.\n");
+    return 1;
+  }
+  int return_val = 0;
+  size_t total = 0;
+  size_t bytes;
+  while ((return_val == 0) && ((bytes = fread(buffer, 1, STREAM_CHUNK_BUCKETS*bucket_size, fp)) > 0)) {
+    if (bytes % crypto_core_ristretto255_BYTES != 0) {
+      error_print("ERROR: %s does not hold a whole number of points.\n", fn);
+      return_val = 1;
+    } else if (validate_points(NULL, buffer, bytes / crypto_core_ristretto255_BYTES, fn, total / crypto_core_ristretto255_BYTES, points_per_bucket) != 0) {
+      return_val = 1;
     }
+    total += bytes;
+  }
+  if (ferror(fp)) {
+    error_print("ERROR: could not read %s.\n", fn);
+    return_val = 1;
+  }
+  if (fp != stdin) {
+    fclose(fp);
   }
   free(buffer);
+  if (return_val != 0) {
+    return 1;
+  }
+  info_print("Checked %lu bytes\n", (unsigned long)total);
   info_print("Nothing went wrong\n");
   return 0;
 
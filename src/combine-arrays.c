@@ -6,12 +6,19 @@
 // Combines together a collection of ElGamal CipherTexts (by adding)
 
 int main( int argc, char *argv[] ) {
+  struct BucketRange range;
+  if (take_range_option(&range, &argc, argv) < 0) {
+    return 1;
+  }
   if (argc < 3) {
     printf(
       "Usage:\n"
-      "  %s combined.bin [node1.bin node2.bin ... nodeN.bin]\n\n"
+      "  %s [--range start:end] combined.bin [node1.bin node2.bin ... nodeN.bin]\n\n"
       "Generates a combined array of ciphertexts by adding together a\n"
-      "list of individual arrays of ciphertexts.\n"
+      "list of individual arrays of ciphertexts.\n\n"
+      "--range start:end only processes buckets [start, end), so that the\n"
+      "outputs for consecutive ranges can be concatenated with cat.\n\n"
+      "One input and the output may be - to read stdin or write stdout.\n"
       , argv[0]);
     return 1;
   }
@@ -24,11 +31,11 @@ int main( int argc, char *argv[] ) {
   char *fns[argc];
   int j = 0;
   for (int i=1; i<argc; i++) {
-    if (argv[i][0]=='-') { 
+    if ((argv[i][0]=='-') && (argv[i][1]!='\0')) {
       num_opts_given++;
     } else {
       fns[j++] = argv[i];
     }
   }
-  return combine_binary_CipherText_files(fns[0], &fns[1], j-1);
+  return combine_binary_CipherText_files_range(fns[0], &fns[1], j-1, range);
 }
@@ -6,12 +6,22 @@
 // Combines together a collection of ElGamal SharedSecrets (by adding)
 
 int main( int argc, char *argv[] ) {
+  struct BucketRange range;
+  if (take_range_option(&range, &argc, argv) < 0) {
+    return 1;
+  }
   if (argc < 3) {
     printf(
       "Usage:\n"
-      "  %s combined.bin [node1.bin node2.bin ... nodeN.bin]\n\n"
+      "  %s [--range start:end] combined.bin [node1.bin node2.bin ... nodeN.bin]\n\n"
       "Generates a combined array of SharedSecrets by adding together a\n"
-      "list of individual arrays of SharedSecrets.\n"
+      "list of individual arrays of SharedSecrets.\n\n"
+      "--range start:end only processes buckets [start, end), so that the\n"
+      "outputs for consecutive ranges can be concatenated with cat.\n\n"
+      "One input and the output may be - to read stdin or write stdout.\n\n"
+      "With threshold keys from threshold-keygen, give each input as\n"
+      "index:node.ss, where index is the node number, to combine any t\n"
+      "of them with their Lagrange coefficients.\n"
       , argv[0]);
     return 1;
   }
@@ -24,11 +34,23 @@ int main( int argc, char *argv[] ) {
   char *fns[argc];
   int j = 0;
   for (int i=1; i<argc; i++) {
-    if (argv[i][0]=='-') { 
+    if ((argv[i][0]=='-') && (argv[i][1]!='\0')) {
       num_opts_given++;
     } else {
       fns[j++] = argv[i];
     }
   }
-  return combine_binary_CipherText_files(fns[0], &fns[1], j-1);
+  // Threshold shares are given as index:file
+  unsigned int indices[argc];
+  int num_shares = 0;
+  for (int i=1; i<j; i++) {
+    num_shares += parse_share_arg(&indices[i-1], &fns[i], fns[i]);
+  }
+  if (num_shares == 0) {
+    return combine_partial_decryptions_range(fns[0], &fns[1], j-1, range);
+  } else if (num_shares != j-1) {
+    error_print("ERROR: either every input or none must be given as index:file\n");
+    return 1;
+  }
+  return combine_threshold_partial_decryptions_range(fns[0], &fns[1], indices, j-1, range);
 }
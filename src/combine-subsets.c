@@ -0,0 +1,25 @@
+#include <stdio.h>
+#include "elgamal.h"
+
+// Combines many subsets of the same collection of ElGamal CipherText arrays
+
+int main( int argc, char *argv[] ) {
+  if (argc < 3) {
+    printf(
+      "Usage:\n"
+      "  %s queries.txt [party0.bin party1.bin ... partyN.bin]\n\n"
+      "Loads the parties' arrays of ciphertexts once and caches partial\n"
+      "sums, then answers every query in queries.txt. Each line of\n"
+      "queries.txt is an output file name followed by the 0-based indices\n"
+      "of the parties to combine into it, e.g.\n"
+      "  region1.bin 0 1 2\n"
+      "  without3.bin 0 1 2 4 5\n"
+      , argv[0]);
+    return 1;
+  }
+  if (sodium_init() < 0) {
+    /* Panic!  library couldn't be initialized */
+    exit(-1);
+  }
+  return combine_subsets_file(argv[1], &argv[2], argc-2);
+}
@@ -0,0 +1,25 @@
+#include <stdio.h>
+#include <string.h>
+#include "elgamal.h"
+
+// Converts arrays of CipherTexts between the AoS and SoA layouts
+
+int main( int argc, char *argv[] ) {
+  if ((argc != 4) || ((strcmp(argv[1], "-soa") != 0) && (strcmp(argv[1], "-aos") != 0))) {
+    printf(
+      "Usage:\n"
+      "  %s -soa|-aos input.bin output.bin\n\n"
+      "Rewrites an array of ciphertexts in the structure-of-arrays layout\n"
+      "(-soa: every c1, then every c2), or back to the default layout of\n"
+      "encrypt_array (-aos).\n\n"
+      "get_partial_decryption -soa only reads the c1 half of an SoA file,\n"
+      "and decrypt_partial -soa only reads its c2 half.\n"
+      , argv[0]);
+    return 1;
+  }
+  if (sodium_init() < 0) {
+    /* Panic!  library couldn't be initialized */
+    exit(-1);
+  }
+  return convert_CipherText_file_layout(argv[2], argv[3], strcmp(argv[1], "-soa") == 0);
+}
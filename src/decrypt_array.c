@@ -3,11 +3,18 @@
 #include <assert.h>
 
 int main( int argc, char *argv[]) {
+  struct BucketRange range;
+  if (take_range_option(&range, &argc, argv) < 0) {
+    return 1;
+  }
   if (argc != 4) {
     printf(
       "Usage:\n"
-      "  %s private.key input.bin output.txt\n\n"
-      "Decrypts to a newline delimited list of integers in [1,64]\n"
+      "  %s [--range start:end] private.key input.bin output.txt\n\n"
+      "Decrypts to a newline delimited list of integers in [1,64]\n\n"
+      "--range start:end only processes buckets [start, end), so that the\n"
+      "outputs for consecutive ranges can be concatenated with cat.\n\n"
+      "One input and the output may be - to read stdin or write stdout.\n"
       , argv[0]);
     return 1;
   }
@@ -15,5 +22,5 @@ int main( int argc, char *argv[]) {
     /* Panic!  library couldn't be initialized */
     exit(-1);
   }
-  return decrypt_bucket_file(argv[1], argv[2], argv[3]);
+  return decrypt_bucket_file_range(argv[1], argv[2], argv[3], range);
 }
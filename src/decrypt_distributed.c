@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include "elgamal.h"
+
+// Decrypts a combined array directly from the nodes' partial decryptions,
+// without writing out a combined shared secrets file first
+
+int main( int argc, char *argv[] ) {
+  struct BucketRange range;
+  int range_given = take_range_option(&range, &argc, argv);
+  if (range_given < 0) {
+    return 1;
+  }
+  if (argc < 4) {
+    printf(
+      "Usage:\n"
+      "  %s [-estimate | --range start:end] input.bin output.txt [node1.ss node2.ss ... nodeN.ss]\n\n"
+      "Decrypts input.bin by streaming it together with the partial\n"
+      "decryptions from every node, summing the shared secrets on the fly.\n\n"
+      "Outputs a newline delimited list of registers, or the cardinality\n"
+      "estimate of the decrypted sketch if -estimate is specified.\n\n"
+      "--range start:end only processes buckets [start, end), so that the\n"
+      "outputs for consecutive ranges can be concatenated with cat.\n\n"
+      "One input and the output may be - to read stdin or write stdout.\n\n"
+      "With threshold keys from threshold-keygen, give each partial\n"
+      "decryption as index:node.ss, where index is the node number, to\n"
+      "decrypt with any t of them.\n"
+      , argv[0]);
+    return 1;
+  }
+  if (sodium_init() < 0) {
+    /* Panic!  library couldn't be initialized */
+    exit(-1);
+  }
+  bool estimate = false;
+  char *fns[argc];
+  int j = 0;
+  for (int i=1; i<argc; i++) {
+    if ((argv[i][0]=='-') && (argv[i][1]!='\0')) {
+      if (strcmp(argv[i], "-estimate")==0) {
+        estimate = true;
+      } else {
+        error_print("ERROR: unknown option: %s\n", argv[i]);
+        return -100;
+      }
+    } else {
+      fns[j++] = argv[i];
+    }
+  }
+  if (j < 3) {
+    error_print("ERROR: need an input, an output and at least one partial decryption\n");
+    return -100;
+  }
+  // Threshold shares are given as index:file
+  unsigned int indices[argc];
+  int num_shares = 0;
+  for (int i=2; i<j; i++) {
+    num_shares += parse_share_arg(&indices[i-2], &fns[i], fns[i]);
+  }
+  if ((num_shares != 0) && (num_shares != j-2)) {
+    error_print("ERROR: either every partial decryption or none must be given as index:file\n");
+    return -100;
+  } else if (num_shares > 0) {
+    if (estimate) {
+      error_print("ERROR: -estimate is not supported with threshold shares\n");
+      return -100;
+    }
+    return decrypt_bucket_file_with_threshold_secs_range(fns[0], &fns[2], indices, j-2, fns[1], range);
+  }
+  if (estimate) {
+    if (range_given) {
+      error_print("ERROR: -estimate needs the whole sketch and cannot be used with --range\n");
+      return -100;
+    }
+    return decrypt_bucket_file_with_secs(fns[0], &fns[2], j-2, fns[1], true);
+  }
+  return decrypt_bucket_file_with_secs_range(fns[0], &fns[2], j-2, fns[1], range);
+}
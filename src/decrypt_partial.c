@@ -1,13 +1,24 @@
 #include <stdio.h>
+#include <string.h>
 #include "elgamal.h"
 #include <assert.h>
 
 int main( int argc, char *argv[]) {
-  if (argc != 4) {
+  struct BucketRange range;
+  if (take_range_option(&range, &argc, argv) < 0) {
+    return 1;
+  }
+  bool soa = (argc == 5) && (strcmp(argv[1], "-soa") == 0);
+  if ((argc != 4) && !soa) {
     printf(
       "Usage:\n"
-      "  %s shared_secrets.ss input.bin output.txt\n\n"
-      "Outputs a partial decryption shared secret binary file\n"
+      "  %s [-soa] [--range start:end] shared_secrets.ss input.bin output.txt\n\n"
+      "Outputs a partial decryption shared secret binary file\n\n"
+      "-soa reads input.bin in the layout written by convert-layout -soa\n"
+      "--range start:end only processes buckets [start, end), so that the\n"
+      "outputs for consecutive ranges can be concatenated with cat.\n\n"
+      "input.bin and the output may be - to read stdin or write stdout,\n"
+      "except with -soa, which needs to seek in input.bin.\n"
       , argv[0]);
     return 1;
   }
@@ -15,5 +26,6 @@ int main( int argc, char *argv[]) {
     /* Panic!  library couldn't be initialized */
     exit(-1);
   }
-  return decrypt_bucket_file_with_sec(argv[1], argv[2], argv[3]);
+  int arg = soa ? 2 : 1;
+  return decrypt_bucket_file_with_sec_range(argv[arg], argv[arg+1], argv[arg+2], range, soa);
 }
@@ -1,5 +1,14 @@
 // ELGAMAL.C
 #include "elgamal.h"
+#include "uring.h"
+#include <unistd.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 int generate_key(struct PrivateKey *a) {
@@ -7,38 +16,57 @@ int generate_key(struct PrivateKey *a) {
   return 0;
 }
 
+/* The by-value functions below are thin wrappers around their *_ref
+ * versions, which take const pointers and so copy nothing. */
 int priv2pub(struct PublicKey *a, const struct PrivateKey priv) {
-  if (crypto_scalarmult_ristretto255_base(a->val, priv.val) != 0) {
+  return priv2pub_ref(a, &priv);
+}
+
+int priv2pub_ref(struct PublicKey *a, const struct PrivateKey *priv) {
+  if (crypto_scalarmult_ristretto255_base(a->val, priv->val) != 0) {
     return -1;
   }
   return 0;
 }
 
 int encrypt(struct CipherText *a, const struct PlainText plain, const struct PublicKey pub) {
-  unsigned char y[crypto_core_ristretto255_SCALARBYTES];
+  return encrypt_ref(a, &plain, &pub);
+}
+
+// As encrypt_ref, keeping the random y behind c1 = y*G
+static int encrypt_with_nonce(struct CipherText *a, unsigned char *y, const struct PlainText *plain, const struct PublicKey *pub) {
   crypto_core_ristretto255_scalar_random(y);
   unsigned char s[crypto_core_ristretto255_BYTES];
-  if (crypto_scalarmult_ristretto255(s, y, pub.val) != 0) {
+  if (crypto_scalarmult_ristretto255(s, y, pub->val) != 0) {
     return -1;
   }
   crypto_scalarmult_ristretto255_base(a->c1, y);
-  if (crypto_core_ristretto255_add(a->c2, plain.val, s) != 0) {
+  if (crypto_core_ristretto255_add(a->c2, plain->val, s) != 0) {
     return -1;
   }
   return 0;
 }
 
+int encrypt_ref(struct CipherText *a, const struct PlainText *plain, const struct PublicKey *pub) {
+  unsigned char y[crypto_core_ristretto255_SCALARBYTES];
+  return encrypt_with_nonce(a, y, plain, pub);
+}
+
 int decrypt(struct PlainText *a, const struct CipherText x, const struct PrivateKey key) {
+  return decrypt_ref(a, &x, &key);
+}
+
+int decrypt_ref(struct PlainText *a, const struct CipherText *x, const struct PrivateKey *key) {
   unsigned char s[crypto_core_ristretto255_BYTES];
-  if (crypto_scalarmult_ristretto255(s, key.val, x.c1) != 0) {
+  if (crypto_scalarmult_ristretto255(s, key->val, x->c1) != 0) {
     char y[128];
-    sodium_bin2hex(y, 128, x.c1, sizeof(x.c1));
+    sodium_bin2hex(y, 128, x->c1, sizeof(x->c1));
     error_print("\nc1: %s\n", y);
     error_print("ERROR: Could not decrypt c1\n");
     return -1;
   }
-  // a->val = x.c2 - s
-  if (crypto_core_ristretto255_sub(a->val, x.c2, s) != 0) {
+  // a->val = x->c2 - s
+  if (crypto_core_ristretto255_sub(a->val, x->c2, s) != 0) {
     error_print("ERROR: Could not decrypt c2\n");
     return -1;
   }
@@ -46,7 +74,11 @@ int decrypt(struct PlainText *a, const struct CipherText x, const struct Private
 }
 
 int decrypt_with_sec(struct PlainText *a, const struct CipherText x, const struct SharedSecret s) {
-  if (crypto_core_ristretto255_sub(a->val, x.c2, s.val) != 0) {
+  return decrypt_with_sec_ref(a, &x, &s);
+}
+
+int decrypt_with_sec_ref(struct PlainText *a, const struct CipherText *x, const struct SharedSecret *s) {
+  if (crypto_core_ristretto255_sub(a->val, x->c2, s->val) != 0) {
     error_print("ERROR: Could not decrypt c2\n");
     return -1;
   }
@@ -54,7 +86,11 @@ int decrypt_with_sec(struct PlainText *a, const struct CipherText x, const struc
 }
 
 int shared_secret(struct SharedSecret *s, const struct CipherText x, const struct PrivateKey key) {
-  if (crypto_scalarmult_ristretto255(s->val, key.val, x.c1) != 0) {
+  return shared_secret_ref(s, &x, &key);
+}
+
+int shared_secret_ref(struct SharedSecret *s, const struct CipherText *x, const struct PrivateKey *key) {
+  if (crypto_scalarmult_ristretto255(s->val, key->val, x->c1) != 0) {
     error_print("ERROR: Could not generate shared secret\n");
     return -1;
   }
@@ -72,12 +108,39 @@ int encode(struct PlainText *a, unsigned int message) {
   return crypto_scalarmult_ristretto255_base(a->val, s);
 }
 
+/* encode(i) for every i that decode can return, built on first use and
+ * shared by every thread, like the default pool. Building it is 255
+ * multiplications of the base point (about 9 ms), so it is only built by
+ * the callers that look up values other than 0, which is the identity and
+ * all zeros. */
+static struct PlainText encoded_values[256];
+static pthread_once_t encoded_values_once = PTHREAD_ONCE_INIT;
+
+static void encoded_values_build(void) {
+  // encoded_values[0] stays all zeros, the identity
+  for (unsigned int i=1; i<256; i++) {
+    encode(&encoded_values[i], i);
+  }
+}
+
+static const struct PlainText *encoded_value(const unsigned int message) {
+  if (message > 0) {
+    pthread_once(&encoded_values_once, encoded_values_build);
+  }
+  return &encoded_values[message];
+}
+
 /* add ciphertexts */
 int add_ciphertext(struct CipherText *a, const struct CipherText x, const struct CipherText y) {
-  if (crypto_core_ristretto255_add(a->c1, x.c1, y.c1) != 0) {
+  return add_ciphertext_ref(a, &x, &y);
+}
+
+// a may be the same as x or y
+int add_ciphertext_ref(struct CipherText *a, const struct CipherText *x, const struct CipherText *y) {
+  if (crypto_core_ristretto255_add(a->c1, x->c1, y->c1) != 0) {
     return -1;
   }
-  if (crypto_core_ristretto255_add(a->c2, x.c2, y.c2) != 0) {
+  if (crypto_core_ristretto255_add(a->c2, x->c2, y->c2) != 0) {
     return -1;
   }
   return 0;
@@ -88,19 +151,17 @@ int add_ciphertext(struct CipherText *a, const struct CipherText x, const struct
 // returns 0 on failure (i.e. not in range [1,255])
 // returns value if within that range
 unsigned char decode(const struct PlainText x) {
-  unsigned char a = 0;
-  unsigned char s[crypto_core_ristretto255_SCALARBYTES];
-  struct PlainText guess;
-  memset(s, 0, sizeof s);
-  for (int i=1; i<256; i++) {
-    s[0]=i;
-    crypto_scalarmult_ristretto255_base(guess.val, s);
-    if (memcmp(guess.val, x.val, crypto_core_ristretto255_BYTES)==0) {
-      a = i % 256;
-      return a;
+  return decode_ref(&x);
+}
+
+unsigned char decode_ref(const struct PlainText *x) {
+  if (sodium_is_zero(x->val, sizeof x->val)) { return 0; }
+  for (unsigned int i=1; i<256; i++) {
+    if (memcmp(encoded_value(i)->val, x->val, crypto_core_ristretto255_BYTES)==0) {
+      return (unsigned char)i;
     }
   }
-  return a;
+  return 0;
 }
 
 /* tests if a Ristretto point message decrypts to a particular integer
@@ -108,12 +169,19 @@ unsigned char decode(const struct PlainText x) {
  * returns 0 on success (i.e. equal)
  * */
 int decode_equal(const struct PlainText x, unsigned int y) {
+  return decode_equal_ref(&x, y);
+}
+
+int decode_equal_ref(const struct PlainText *x, unsigned int y) {
+  if (y < 256) {
+    return (memcmp(encoded_value(y)->val, x->val, crypto_core_ristretto255_BYTES)==0) ? 0 : -1;
+  }
   unsigned char s[crypto_core_ristretto255_SCALARBYTES];
   struct PlainText guess;
   memset(s, 0, sizeof s);
   memcpy(s,(char*)&y, sizeof(unsigned int));
   crypto_scalarmult_ristretto255_base(guess.val, s);
-  if (memcmp(guess.val, x.val, crypto_core_ristretto255_BYTES)==0) {
+  if (memcmp(guess.val, x->val, crypto_core_ristretto255_BYTES)==0) {
     return 0;
   }
   return -1;
@@ -126,14 +194,18 @@ int decode_equal(const struct PlainText x, unsigned int y) {
  * https://crypto.stackexchange.com/questions/9527/how-does-an-oblivious-test-of-plaintext-equality-work
 */
 int private_equality_test(struct CipherText *a, const struct CipherText x, const struct CipherText y) {
+  return private_equality_test_ref(a, &x, &y);
+}
+
+int private_equality_test_ref(struct CipherText *a, const struct CipherText *x, const struct CipherText *y) {
   // t.c1 = x.c1 - y.c1
   // t.c2 = x.c2 - y.c2
   // z = randint(0, L)
   // a->c1 = t.c1 * z
   // a->c2 = t.c2 * z
   struct CipherText t;
-  if (crypto_core_ristretto255_sub(t.c1, x.c1, y.c1) != 0) {return -1; }
-  if (crypto_core_ristretto255_sub(t.c2, x.c2, y.c2) != 0) {return -1; }
+  if (crypto_core_ristretto255_sub(t.c1, x->c1, y->c1) != 0) {return -1; }
+  if (crypto_core_ristretto255_sub(t.c2, x->c2, y->c2) != 0) {return -1; }
   unsigned char z[crypto_core_ristretto255_SCALARBYTES];
   crypto_core_ristretto255_scalar_random(z);
   if (crypto_scalarmult_ristretto255(a->c1, z, t.c1) != 0) {return -1; }
@@ -155,7 +227,7 @@ int unroll(struct UnrolledPlainText *a, const unsigned char x) {
     crypto_core_ristretto255_random(a->arr[i].val);
   }
   for (int i=x; i<BUCKET_MAX; i++) {
-    if (encode(&(a->arr[i]), 0) != -1) {return -1; }
+    a->arr[i] = *encoded_value(0);
   }
   return 0;
 }
@@ -168,18 +240,49 @@ int unroll(struct UnrolledPlainText *a, const unsigned char x) {
  * Puts the result into "a", and returns 0 on success, -1 on failure
  * */
 int unroll_and_encrypt(struct UnrolledCipherText *a, const unsigned char x, const struct PublicKey pub_key) {
+  return unroll_and_encrypt_ref(a, x, &pub_key);
+}
+
+int unroll_and_encrypt_ref(struct UnrolledCipherText *a, const unsigned char x, const struct PublicKey *pub_key) {
   struct UnrolledPlainText upt;
   if (unroll(&upt, x) != 0) {return -1;};
   for (int i=0; i<BUCKET_MAX; i++) {
-    if (encrypt( &(a->arr[i]), upt.arr[i], pub_key) != 0) {return -1; }
+    if (encrypt_ref( &(a->arr[i]), &(upt.arr[i]), pub_key) != 0) {return -1; }
   }
   return 0;
 }
 
+int unroll_and_encrypt_multi(struct UnrolledCipherText *a, const unsigned char x, const struct PublicKey *pubs, const unsigned int npubs) {
+  if (npubs == 0) {return -1; }
+  struct UnrolledPlainText upt;
+  if (unroll(&upt, x) != 0) {return -1;};
+  unsigned char y[crypto_core_ristretto255_SCALARBYTES];
+  unsigned char s[crypto_core_ristretto255_BYTES];
+  int return_val = -1;
+  for (int i=0; i<BUCKET_MAX; i++) {
+    if (encrypt_with_nonce(&(a[0].arr[i]), y, &(upt.arr[i]), &pubs[0]) != 0) { goto cleanup; }
+    // The other keys share c1 = y*G, and only need y*pub
+    for (unsigned int k=1; k<npubs; k++) {
+      memcpy(a[k].arr[i].c1, a[0].arr[i].c1, crypto_core_ristretto255_BYTES);
+      if (crypto_scalarmult_ristretto255(s, y, pubs[k].val) != 0) { goto cleanup; }
+      if (crypto_core_ristretto255_add(a[k].arr[i].c2, upt.arr[i].val, s) != 0) { goto cleanup; }
+    }
+  }
+  return_val = 0;
+
+  cleanup:
+  sodium_memzero(y, sizeof y);
+  return return_val;
+}
+
 /* rerolls and UnrolledPlainText back into an intger from 0 to BUCKET_MAX */
 int reroll(unsigned char *a, const struct UnrolledPlainText upt) {
+  return reroll_ref(a, &upt);
+}
+
+int reroll_ref(unsigned char *a, const struct UnrolledPlainText *upt) {
   for (int i=0; i<BUCKET_MAX; i++) {
-    if (decode_equal(upt.arr[i], 0) == 0) {
+    if (decode_equal_ref(&(upt->arr[i]), 0) == 0) {
       *a = i;
       return 0;
     }
@@ -190,21 +293,127 @@ int reroll(unsigned char *a, const struct UnrolledPlainText upt) {
 
 /* Rerolls and decrypts an UnrolledCipherText back into an integer from 0 to BUCKET_MAX */
 int decrypt_and_reroll(unsigned char *a, const struct UnrolledCipherText uct, const struct PrivateKey priv_key) {
+  return decrypt_and_reroll_ref(a, &uct, &priv_key);
+}
+
+int decrypt_and_reroll_ref(unsigned char *a, const struct UnrolledCipherText *uct, const struct PrivateKey *priv_key) {
   struct UnrolledPlainText upt;
   for (int i=0; i<BUCKET_MAX; i++) {
-    if (decrypt(&(upt.arr[i]), uct.arr[i], priv_key)!=0) {return -1;}
+    if (decrypt_ref(&(upt.arr[i]), &(uct->arr[i]), priv_key)!=0) {return -1;}
   }
-  if (reroll(a, upt) != 0) {return -1;};
+  if (reroll_ref(a, &upt) != 0) {return -1;};
   return 0;
 }
 
 /* Rerolls and decrypts an UnrolledCipherText back into an integer from 0 to BUCKET_MAX */
 int decrypt_and_reroll_with_sec(unsigned char *a, const struct UnrolledCipherText uct, const struct UnrolledSharedSecret uss) {
+  return decrypt_and_reroll_with_sec_ref(a, &uct, &uss);
+}
+
+int decrypt_and_reroll_with_sec_ref(unsigned char *a, const struct UnrolledCipherText *uct, const struct UnrolledSharedSecret *uss) {
   struct UnrolledPlainText upt;
   for (int i=0; i<BUCKET_MAX; i++) {
-    if (decrypt_with_sec(&(upt.arr[i]), uct.arr[i], uss.arr[i])!=0) {return -1;}
+    if (decrypt_with_sec_ref(&(upt.arr[i]), &(uct->arr[i]), &(uss->arr[i]))!=0) {return -1;}
+  }
+  if (reroll_ref(a, &upt) != 0) {return -1;};
+  return 0;
+}
+
+int encrypt_bits(struct BitCipherText *a, const unsigned char x, const struct PublicKey *pub_key) {
+  if (x > BUCKET_MAX) {return -1; }
+  for (int i=0; i<BIT_WIDTH; i++) {
+    if (encrypt_ref(&(a->arr[i]), encoded_value((x >> i) & 1u), pub_key) != 0) {return -1; }
+  }
+  return 0;
+}
+
+int decrypt_bits(unsigned char *x, const struct BitCipherText *a, const struct PrivateKey *priv_key) {
+  struct PlainText bit;
+  unsigned int value = 0;
+  for (int i=0; i<BIT_WIDTH; i++) {
+    if (decrypt_ref(&bit, &(a->arr[i]), priv_key) != 0) {return -1; }
+    if (decode_equal_ref(&bit, 1) == 0) {
+      value |= 1u << i;
+    } else if (!sodium_is_zero(bit.val, sizeof bit.val)) {
+      error_print("ERROR: bit %d is neither 0 nor 1\n", i);
+      return -1;
+    }
+  }
+  if (value > BUCKET_MAX) {return -1; }
+  *x = (unsigned char)value;
+  return 0;
+}
+
+// perm becomes a uniformly random permutation of [0, n)
+static void random_permutation(unsigned char *perm, const unsigned int n) {
+  for (unsigned int i=0; i<n; i++) {
+    perm[i] = (unsigned char)i;
+  }
+  for (unsigned int i=n-1; i>0; i--) {
+    uint32_t j = randombytes_uniform(i+1);
+    unsigned char tmp = perm[i];
+    perm[i] = perm[j];
+    perm[j] = tmp;
+  }
+}
+
+int equality_tests(struct EqualityTests *a, unsigned char *perm, const struct BitCipherText *x) {
+  // Encrypts the value from its bits by doubling, from the top bit down
+  struct CipherText v = x->arr[BIT_WIDTH-1];
+  for (int i=BIT_WIDTH-2; i>=0; i--) {
+    if ((add_ciphertext_ref(&v, &v, &v) != 0) || (add_ciphertext_ref(&v, &v, &(x->arr[i])) != 0)) {return -1; }
+  }
+  // The test against t is z*(v - t) for a fresh random z, where t is
+  // encrypted with no randomness
+  struct CipherText t_enc;
+  memset(t_enc.c1, 0, sizeof t_enc.c1);
+  random_permutation(perm, BUCKET_MAX+1);
+  for (unsigned int t=0; t<=BUCKET_MAX; t++) {
+    memcpy(t_enc.c2, encoded_value(t)->val, sizeof t_enc.c2);
+    if (private_equality_test_ref(&(a->arr[perm[t]]), &v, &t_enc) != 0) {return -1; }
+  }
+  return 0;
+}
+
+int test_shares(struct TestShares *a, const struct EqualityTests *tests, const struct PrivateKey *priv_key) {
+  for (int k=0; k<=BUCKET_MAX; k++) {
+    if (shared_secret_ref(&(a->arr[k]), &(tests->arr[k]), priv_key) != 0) {return -1; }
+  }
+  return 0;
+}
+
+int reencode_tests(struct EqualityTests *a, const struct EqualityTests *tests, const struct PrivateKey *priv_key, const struct PublicKey *pub_key) {
+  struct TestShares secs;
+  if (test_shares(&secs, tests, priv_key) != 0) {return -1; }
+  return reencode_tests_with_secs(a, tests, &secs, pub_key);
+}
+
+int reencode_tests_with_secs(struct EqualityTests *a, const struct EqualityTests *tests, const struct TestShares *secs, const struct PublicKey *pub_key) {
+  struct PlainText m;
+  int num_zeros = 0;
+  for (int k=0; k<=BUCKET_MAX; k++) {
+    if (decrypt_with_sec_ref(&m, &(tests->arr[k]), &(secs->arr[k])) != 0) {return -1; }
+    bool is_zero = sodium_is_zero(m.val, sizeof m.val);
+    num_zeros += is_zero ? 1 : 0;
+    if (encrypt_ref(&(a->arr[k]), encoded_value(is_zero ? 1 : 0), pub_key) != 0) {return -1; }
+  }
+  return (num_zeros == 1) ? 0 : -3;
+}
+
+int add_indicators(struct EqualityTests *sums, const struct EqualityTests *indicators, const unsigned char *perm) {
+  for (int t=0; t<=BUCKET_MAX; t++) {
+    if (perm[t] > BUCKET_MAX) {return -1; }
+    if (add_ciphertext_ref(&(sums->arr[t]), &(sums->arr[t]), &(indicators->arr[perm[t]])) != 0) {return -1; }
+  }
+  return 0;
+}
+
+int indicators_to_unary(struct UnrolledCipherText *a, const struct EqualityTests *sums) {
+  // Slot j counts the parties above j, the sum of sums[j+1..BUCKET_MAX]
+  a->arr[BUCKET_MAX-1] = sums->arr[BUCKET_MAX];
+  for (int j=BUCKET_MAX-2; j>=0; j--) {
+    if (add_ciphertext_ref(&(a->arr[j]), &(a->arr[j+1]), &(sums->arr[j+1])) != 0) {return -1; }
   }
-  if (reroll(a, upt) != 0) {return -1;};
   return 0;
 }
 
@@ -239,10 +448,14 @@ int read_pubkey(struct PublicKey *a, const char *fn) {
 /* Writes Public Key out to a file from a struct.
  */
 int write_pubkey(const struct PublicKey pubkey, const char *fn) {
+  return write_pubkey_ref(&pubkey, fn);
+}
+
+int write_pubkey_ref(const struct PublicKey *pubkey, const char *fn) {
   size_t bytes_written = 0;
   FILE *key_file = fopen(fn, "wb");
   if (key_file) {
-    bytes_written = fwrite(pubkey.val, 1, crypto_core_ristretto255_BYTES, key_file);
+    bytes_written = fwrite(pubkey->val, 1, crypto_core_ristretto255_BYTES, key_file);
     if (bytes_written != crypto_core_ristretto255_BYTES) {
         error_print("ERROR: incorrect number of bytes written to %s.\n", fn);
         return -5;
@@ -286,10 +499,14 @@ int read_privkey(struct PrivateKey *a, const char *fn) {
 /* Writes Private Key out to a file from a struct.
  */
 int write_privkey(const struct PrivateKey privkey, const char *fn) {
+  return write_privkey_ref(&privkey, fn);
+}
+
+int write_privkey_ref(const struct PrivateKey *privkey, const char *fn) {
   size_t bytes_written = 0;
   FILE *key_file = fopen(fn, "wb");
   if (key_file) {
-    bytes_written = fwrite(privkey.val, 1, crypto_core_ristretto255_SCALARBYTES, key_file);
+    bytes_written = fwrite(privkey->val, 1, crypto_core_ristretto255_SCALARBYTES, key_file);
     if (bytes_written != crypto_core_ristretto255_SCALARBYTES) {
         error_print("ERROR: incorrect number of bytes written to %s.\n", fn);
         return -5;
@@ -448,91 +665,405 @@ int combine_private_keys(char *combined_fn, char **node_fns, const int ncount) {
   }
   return 0; }
 
+// Node indices are used as scalars: little endian, and never 0
+static void index_scalar(unsigned char *s, const unsigned int index) {
+  memset(s, 0, crypto_core_ristretto255_SCALARBYTES);
+  for (unsigned int b=0; b<sizeof index; b++) {
+    s[b] = (unsigned char)((index >> (8*b)) & 0xff);
+  }
+}
+
+int threshold_keygen(const int t, const int n, char *pub_fn, char **priv_fns, char **pub_fns) {
+  if ((t < 1) || (t > n)) {
+    error_print("ERROR: the threshold %d must be between 1 and the %d nodes.\n", t, n);
+    return -1;
+  }
+  for (int i=-1; i<n; i++) {
+    char *fns[2] = {(i < 0) ? pub_fn : priv_fns[i], ((i < 0) || (pub_fns == NULL)) ? NULL : pub_fns[i]};
+    for (int k=0; k<2; k++) {
+      FILE *exists = (fns[k] != NULL) ? fopen(fns[k], "rb") : NULL;
+      if (exists) {
+        error_print("ERROR: %s exists.\nAborting so we don't clobber it.\n", fns[k]);
+        fclose(exists);
+        return -2;
+      }
+    }
+  }
+  int return_val = 0;
+  // f(x) = coeffs[0] + coeffs[1] x + ... + coeffs[t-1] x^(t-1), and the
+  // combined private key is f(0)
+  unsigned char *coeffs = malloc((size_t)t*crypto_core_ristretto255_SCALARBYTES);
+  if (coeffs == NULL) {
+    error_print("ERROR: could not allocate the polynomial.\n");
+    return -1;
+  }
+  for (int k=0; k<t; k++) {
+    crypto_core_ristretto255_scalar_random(&coeffs[(size_t)k*crypto_core_ristretto255_SCALARBYTES]);
+  }
+  struct PrivateKey share;
+  struct PublicKey pub;
+  struct PrivateKey secret;
+  memcpy(secret.val, coeffs, crypto_core_ristretto255_SCALARBYTES);
+  if ((priv2pub_ref(&pub, &secret) != 0) || (write_pubkey_ref(&pub, pub_fn) != 0)) {
+    return_val = -1;
+    goto cleanup;
+  }
+  for (int i=0; i<n; i++) {
+    // Horner's rule at x = i+1
+    unsigned char x[crypto_core_ristretto255_SCALARBYTES];
+    index_scalar(x, (unsigned int)i+1);
+    memcpy(share.val, &coeffs[(size_t)(t-1)*crypto_core_ristretto255_SCALARBYTES], crypto_core_ristretto255_SCALARBYTES);
+    for (int k=t-2; k>=0; k--) {
+      crypto_core_ristretto255_scalar_mul(share.val, share.val, x);
+      crypto_core_ristretto255_scalar_add(share.val, share.val, &coeffs[(size_t)k*crypto_core_ristretto255_SCALARBYTES]);
+    }
+    if ((write_privkey_ref(&share, priv_fns[i]) != 0) ||
+        ((pub_fns != NULL) && ((priv2pub_ref(&pub, &share) != 0) || (write_pubkey_ref(&pub, pub_fns[i]) != 0)))) {
+      return_val = -1;
+      goto cleanup;
+    }
+  }
+  info_print("INFO: dealt %d key shares, any %d of which can decrypt.\n", n, t);
+
+  cleanup:
+  sodium_memzero(&share, sizeof share);
+  sodium_memzero(&secret, sizeof secret);
+  sodium_memzero(coeffs, (size_t)t*crypto_core_ristretto255_SCALARBYTES);
+  free(coeffs);
+  return return_val;
+}
+
+int lagrange_coefficients(unsigned char *lambdas, const unsigned int *indices, const int ncount) {
+  unsigned char num[crypto_core_ristretto255_SCALARBYTES];
+  unsigned char den[crypto_core_ristretto255_SCALARBYTES];
+  unsigned char xi[crypto_core_ristretto255_SCALARBYTES];
+  unsigned char xj[crypto_core_ristretto255_SCALARBYTES];
+  for (int i=0; i<ncount; i++) {
+    if (indices[i] == 0) {
+      error_print("ERROR: node indices start at 1.\n");
+      return -1;
+    }
+    index_scalar(xi, indices[i]);
+    index_scalar(num, 1);
+    index_scalar(den, 1);
+    // lambda_i = prod_{j != i} x_j / (x_j - x_i), the weight of share i in f(0)
+    for (int j=0; j<ncount; j++) {
+      if (j == i) { continue; }
+      index_scalar(xj, indices[j]);
+      crypto_core_ristretto255_scalar_mul(num, num, xj);
+      crypto_core_ristretto255_scalar_sub(xj, xj, xi);
+      crypto_core_ristretto255_scalar_mul(den, den, xj);
+    }
+    if (crypto_core_ristretto255_scalar_invert(den, den) != 0) {
+      error_print("ERROR: node index %u is given more than once.\n", indices[i]);
+      return -1;
+    }
+    crypto_core_ristretto255_scalar_mul(&lambdas[(size_t)i*crypto_core_ristretto255_SCALARBYTES], num, den);
+  }
+  return 0;
+}
+
+int parse_share_arg(unsigned int *index, char **fn, char *arg) {
+  char *end;
+  if ((arg[0] < '0') || (arg[0] > '9')) { return 0; }
+  unsigned long x = strtoul(arg, &end, 10);
+  if ((*end != ':') || (end[1] == '\0') || (x == 0) || (x > UINT_MAX)) { return 0; }
+  *index = (unsigned int)x;
+  *fn = end + 1;
+  return 1;
+}
+
+/* The bucket arrays are concatenated UnrolledCipherTexts and
+ * UnrolledSharedSecrets. Those structs only hold unsigned chars, so they
+ * have no alignment needs, and the functions below work on the arrays in
+ * place rather than copying each bucket into a temporary. */
 int encrypt_buckets(unsigned char *out, const unsigned char *in, const struct PublicKey pubkey, const unsigned int max_buckets) {
+  return encrypt_buckets_ref(out, in, &pubkey, max_buckets);
+}
+
+int encrypt_buckets_ref(unsigned char *out, const unsigned char *in, const struct PublicKey *pubkey, const unsigned int max_buckets) {
   unsigned int i = 0;
-  struct UnrolledCipherText uval;
-  //struct CipherText cval;
+  struct UnrolledCipherText *uct = (struct UnrolledCipherText *)out;
   while (in[i] != 255) {
-    if (unroll_and_encrypt(&uval, in[i], pubkey)!=0) { return -1;}
-    memcpy(&out[i*(sizeof uval.arr)], uval.arr, sizeof uval.arr);
-    if (i++>max_buckets) {
-      error_print("ERROR: too many elements for size of array: %i\n", i);
+    if (i >= max_buckets) {
+      error_print("ERROR: too many elements for size of array: %i\n", i+1);
       return -2;
     }
+    if (unroll_and_encrypt_ref(&uct[i], in[i], pubkey)!=0) { return -1;}
+    i++;
   }
   return (int)i;
 }
 
 int decrypt_buckets(unsigned char *plain, const unsigned char *enc, const struct PrivateKey privkey, const unsigned int num_elem) {
-  unsigned int i = 0;
-  //struct PlainText uval;
-  //struct CipherText cval;
-  unsigned char x;
-  struct UnrolledCipherText uval;
-  for (i=0; i<num_elem; i++) {
-    memcpy(uval.arr, &enc[i*(sizeof uval.arr)], sizeof uval.arr);
-    if (decrypt_and_reroll(&x, uval, privkey)!=0) {
-      error_print("ERROR: could not decrypt values\n");
-      return -1;
+  return decrypt_buckets_ref(plain, enc, &privkey, num_elem);
+}
+
+
+/* Arena blocks are anonymous mappings with the ArenaBlock header at the
+ * start. Huge pages are tried first for large blocks when asked for, and
+ * otherwise transparent huge pages are requested with madvise.
+ * */
+#define ARENA_ALIGN 64
+#define ARENA_HUGE_PAGE (2*1024*1024)
+
+static size_t arena_round_up(const size_t x, const size_t to) {
+  return (x + to - 1) / to * to;
+}
+
+static struct ArenaBlock *arena_map_block(struct Arena *a, const size_t capacity) {
+  size_t header = arena_round_up(sizeof (struct ArenaBlock), ARENA_ALIGN);
+  size_t bytes = arena_round_up(header + capacity, (size_t)sysconf(_SC_PAGESIZE));
+  void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (a->huge_pages && (bytes >= ARENA_HUGE_PAGE)) {
+    size_t huge_bytes = arena_round_up(bytes, ARENA_HUGE_PAGE);
+    p = mmap(NULL, huge_bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) { bytes = huge_bytes; }
+  }
+#endif
+  if (p == MAP_FAILED) {
+    p = mmap(NULL, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      error_print("ERROR: could not map %lu bytes for arena.\n", bytes);
+      return NULL;
     }
-    plain[i] = x;
-    //error_print("%i\n", plain[i]);
+#ifdef MADV_HUGEPAGE
+    if (a->huge_pages && (bytes >= ARENA_HUGE_PAGE)) {
+      madvise(p, bytes, MADV_HUGEPAGE);
+    }
+#endif
   }
-  plain[num_elem] = 0;
-  return (int)num_elem;
+  struct ArenaBlock *b = p;
+  b->next = NULL;
+  b->mapped = bytes;
+  b->size = bytes - header;
+  b->used = 0;
+  b->data = (unsigned char *)p + header;
+  return b;
 }
 
-int decrypt_buckets_with_sec(unsigned char *plain, const unsigned char *enc, const unsigned char *shared_sec, const unsigned int num_elem) {
-  unsigned int i = 0;
-  //struct PlainText uval;
-  //struct CipherText cval;
-  unsigned char x;
-  struct UnrolledCipherText uval;
-  struct UnrolledSharedSecret uss;
-  for (i=0; i<num_elem; i++) {
-    memcpy(uval.arr, &enc[i*(sizeof uval.arr)], sizeof uval.arr);
-    memcpy(uss.arr, &shared_sec[i*(sizeof uss.arr)], sizeof uss.arr);
-    if (decrypt_and_reroll_with_sec(&x, uval, uss)!=0) {
-      error_print("ERROR: could not decrypt values\n");
-      return -1;
+void arena_init(struct Arena *a, const bool huge_pages) {
+  a->head = NULL;
+  a->capacity_hint = 0;
+  a->huge_pages = huge_pages;
+}
+
+void *arena_alloc(struct Arena *a, const size_t size) {
+  size_t aligned = arena_round_up((size > 0) ? size : 1, ARENA_ALIGN);
+  if ((a->head == NULL) || (a->head->size - a->head->used < aligned)) {
+    // After a reset the first block is sized for everything the last run used
+    size_t capacity = aligned;
+    if ((a->head == NULL) && (a->capacity_hint > capacity)) {
+      capacity = a->capacity_hint;
     }
-    plain[i] = x;
-    //error_print("%i\n", plain[i]);
+    struct ArenaBlock *b = arena_map_block(a, capacity);
+    if (b == NULL) { return NULL; }
+    b->next = a->head;
+    a->head = b;
+  }
+  void *p = &a->head->data[a->head->used];
+  a->head->used += aligned;
+  return p;
+}
+
+void arena_reset(struct Arena *a) {
+  if ((a->head != NULL) && (a->head->next == NULL)) {
+    a->head->used = 0;
+    return;
+  }
+  // Several blocks: remember the total, and map one block of that size on
+  // the next allocation so that the same run fits in one block next time
+  size_t total = 0;
+  while (a->head != NULL) {
+    struct ArenaBlock *next = a->head->next;
+    total += a->head->used;
+    munmap(a->head, a->head->mapped);
+    a->head = next;
+  }
+  if (total > a->capacity_hint) {
+    a->capacity_hint = total;
   }
-  plain[num_elem] = 0;
-  return (int)num_elem;
 }
 
+void arena_free(struct Arena *a) {
+  while (a->head != NULL) {
+    struct ArenaBlock *next = a->head->next;
+    munmap(a->head, a->head->mapped);
+    a->head = next;
+  }
+  a->capacity_hint = 0;
+}
 
-int read_file_to_array(unsigned char *ans, char *fn, size_t buf_size) {
-  FILE * fp = fopen(fn, "r");
-  char * line = NULL;
-  size_t len = 0;
-  ssize_t read;
-  intmax_t val = 0;
-  if (fp) {
-    int i = 0;
-    while ((read = getline(&line, &len, fp)) != -1) {
-      val = strtoimax(line, NULL, 10);
-      if ((val >= 0) && (val <= BUCKET_MAX)) {
-        ans[i++] = val;
-      } else {
-        error_print("ERROR: value on line %i not a number in [1, BUCKET_MAX].\n", i);
-        return -1;
+// Size of a file in bytes, or negative if it cannot be opened
+static ssize_t file_size(const char *fn) {
+  FILE *fp = fopen(fn, "rb");
+  if (!fp) {
+    error_print("ERROR: problems opening %s for reading.\n", fn);
+    return -1;
+  }
+  fseek(fp, 0, SEEK_END);
+  ssize_t size = ftell(fp);
+  fclose(fp);
+  if (size < 0) {
+    error_print("ERROR: problems seeking end of %s.\n", fn);
+  }
+  return size;
+}
+
+/* A file name of "-" stands for stdin or stdout, so that the tools can be
+ * piped together without temporary files. */
+static bool is_std_stream(const char *fn) {
+  return strcmp(fn, "-") == 0;
+}
+
+static FILE *open_output(const char *fn, const char *mode) {
+  return is_std_stream(fn) ? stdout : fopen(fn, mode);
+}
+
+// Closes fp unless it is stdout, which is only flushed. Returns 0 if
+// everything written to it made it out
+static int close_output(FILE *fp) {
+  return (fp == stdout) ? fflush(fp) : fclose(fp);
+}
+
+/* Register files are parsed straight out of a read-only mapping of the
+ * file. Lines are found 16 bytes at a time with SSE2 where available: a
+ * block of only digits and newlines holds whole lines that need no more
+ * checks than their digits. Any other line goes through register_value,
+ * which gives the same answer as strtoimax(line, NULL, 10) did when lines
+ * were read with getline: leading whitespace and a sign are skipped, and
+ * parsing stops at the first non-digit, so a line without digits is 0.
+ * */
+// Parses [p, end), returning BUCKET_MAX+1 for anything out of range, or
+// BUCKET_MAX for values above it if clamping
+static int register_value(const unsigned char *p, const unsigned char *end) {
+  while ((p < end) && ((*p == ' ') || ((*p >= '\t') && (*p <= '\r')))) { p++; }
+  bool negative = false;
+  if ((p < end) && ((*p == '+') || (*p == '-'))) {
+    negative = (*p == '-');
+    p++;
+  }
+  int val = 0;
+  bool above = false;
+  for (; (p < end) && (*p >= '0') && (*p <= '9'); p++) {
+    val = above ? val : 10*val + (*p - '0');
+    above = above || (val > BUCKET_MAX);
+  }
+  if (negative && (val != 0)) { return BUCKET_MAX+1; }
+  if (above) { return CLAMP_REGISTERS ? BUCKET_MAX : BUCKET_MAX+1; }
+  return val;
+}
+
+// Lines of only digits, where every value below BUCKET_MAX+1 is in range
+static int register_digits(const unsigned char *p, const unsigned char *end) {
+  int val = 0;
+  for (; p < end; p++) {
+    val = 10*val + (*p - '0');
+    if (val > BUCKET_MAX) { return CLAMP_REGISTERS ? BUCKET_MAX : BUCKET_MAX+1; }
+  }
+  return val;
+}
+
+static int parse_registers(unsigned char *ans, const unsigned char *buf, const size_t size, const size_t buf_size) {
+  const unsigned char *p = buf;
+  const unsigned char *end = buf + size;
+  size_t i = 0;
+  int val;
+  while (p < end) {
+#ifdef __SSE2__
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i nine = _mm_set1_epi8(9);
+    while (p + 16 <= end) {
+      __m128i x = _mm_loadu_si128((const __m128i *)p);
+      __m128i nl = _mm_cmpeq_epi8(x, newline);
+      __m128i t = _mm_sub_epi8(x, zero);
+      __m128i digit = _mm_cmpeq_epi8(_mm_max_epu8(t, nine), nine);
+      unsigned int nl_mask = (unsigned int)_mm_movemask_epi8(nl);
+      if (((unsigned int)_mm_movemask_epi8(_mm_or_si128(nl, digit)) != 0xFFFF) || (nl_mask == 0)) {
+        break;
       }
-      if (i > (int)buf_size) {
-        error_print("ERROR: exceeded maximum number of lines: %lu.\n", buf_size);
-        return -1;
+      const unsigned char *block = p;
+      while (nl_mask != 0) {
+        const unsigned char *line_end = block + __builtin_ctz(nl_mask);
+        nl_mask &= nl_mask - 1;
+        val = register_digits(p, line_end);
+        if (val > BUCKET_MAX) { goto bad_value; }
+        if (i >= buf_size) { goto too_many; }
+        ans[i++] = (unsigned char)val;
+        p = line_end + 1;
       }
     }
-    info_print("INFO: Read %i lines.\n", i);
-    fclose(fp);
-    ans[i] = 255;
-    return i;
-  } else {
+    if (p >= end) { break; }
+#endif
+    const unsigned char *nl_pos = memchr(p, '\n', (size_t)(end - p));
+    const unsigned char *line_end = (nl_pos != NULL) ? nl_pos : end;
+    val = register_value(p, line_end);
+    if (val > BUCKET_MAX) { goto bad_value; }
+    if (i >= buf_size) { goto too_many; }
+    ans[i++] = (unsigned char)val;
+    p = line_end + 1;
+  }
+  ans[i] = 255;
+  return (int)i;
+
+  bad_value:
+  error_print("ERROR: value on line %lu not a number in [0, %d].\n", i, BUCKET_MAX);
+  return -1;
+  too_many:
+  error_print("ERROR: exceeded maximum number of lines: %lu.\n", buf_size);
+  return -1;
+}
+
+int read_file_to_array(unsigned char *ans, char *fn, size_t buf_size) {
+  int fd = is_std_stream(fn) ? dup(STDIN_FILENO) : open(fn, O_RDONLY);
+  if (fd < 0) {
     error_print("ERROR: could not open %s for reading.\n", fn);
     return -1;
   }
+  int return_val;
+  struct stat st;
+  if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode)) {
+    size_t size = (size_t)st.st_size;
+    void *buf = (size > 0) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    if (buf == MAP_FAILED) {
+      error_print("ERROR: could not map %s.\n", fn);
+      close(fd);
+      return -1;
+    }
+    if (buf != NULL) { madvise(buf, size, MADV_SEQUENTIAL); }
+    return_val = parse_registers(ans, buf, size, buf_size);
+    if (buf != NULL) { munmap(buf, size); }
+  } else {
+    // Pipes and the like cannot be mapped, so they are read in full first
+    size_t size = 0;
+    size_t capacity = 0;
+    unsigned char *buf = NULL;
+    ssize_t n = 1;
+    while (n > 0) {
+      if (size == capacity) {
+        capacity = (capacity > 0) ? 2*capacity : 65536;
+        unsigned char *tmp = realloc(buf, capacity);
+        if (tmp == NULL) {
+          error_print("ERROR: could not allocate a buffer for %s.\n", fn);
+          free(buf);
+          close(fd);
+          return -1;
+        }
+        buf = tmp;
+      }
+      n = read(fd, &buf[size], capacity - size);
+      if (n > 0) { size += (size_t)n; }
+    }
+    return_val = parse_registers(ans, buf, size, buf_size);
+    free(buf);
+  }
+  close(fd);
+  if (return_val >= 0) {
+    info_print("INFO: Read %i lines.\n", return_val);
+  }
+  return return_val;
 }
 
 int read_partial_decryption_file(unsigned char *ans, char *fn, int buf_size) {
@@ -559,8 +1090,9 @@ int read_partial_decryption_file(unsigned char *ans, char *fn, int buf_size) {
     }
     read = fread(ans, 1, (size_t)size, fp);
     num_ss = read / (crypto_core_ristretto255_BYTES) ;
-    info_print("INFO: successfully read %ld bytes from %s, ~%i SharedSecrets.\n", read, fn, num_ss);
     fclose(fp);
+    if (validate_points(NULL, ans, (size_t)num_ss, fn, 0, BUCKET_MAX) != 0) { return -1; }
+    info_print("INFO: successfully read %ld bytes from %s, ~%i SharedSecrets.\n", read, fn, num_ss);
     return num_ss;
   } else {
     error_print("ERROR: could not open %s for reading.\n", fn);
@@ -595,8 +1127,9 @@ int read_binary_CipherText_file(unsigned char *ans, char *fn, int buf_size) {
     }
     read = fread(ans, 1, (size_t)size, fp);
     num_ciphertexts = read / (2*crypto_core_ristretto255_BYTES) ;
-    info_print("INFO: successfully read %ld bytes from %s, ~%i CipherTexts.\n", read, fn, num_ciphertexts);
     fclose(fp);
+    if (validate_points(NULL, ans, 2*(size_t)num_ciphertexts, fn, 0, 2*BUCKET_MAX) != 0) { return -1; }
+    info_print("INFO: successfully read %ld bytes from %s, ~%i CipherTexts.\n", read, fn, num_ciphertexts);
     return num_ciphertexts;
   } else {
     error_print("ERROR: could not open %s for reading.\n", fn);
@@ -605,16 +1138,21 @@ int read_binary_CipherText_file(unsigned char *ans, char *fn, int buf_size) {
 
 }
 
-// Attention: GOTO used for cleanup
 int encrypt_bucket_file(char *key_fn, char *input_fn, char *output_fn) {
+  return encrypt_bucket_file_range(key_fn, input_fn, output_fn, ALL_BUCKETS);
+}
+
+// Attention: GOTO used for cleanup
+int encrypt_bucket_file_arena(struct Arena *arena, char *key_fn, char *input_fn, char *output_fn) {
   unsigned int uct_size = sizeof (((struct UnrolledCipherText*)0)->arr);
   int return_val = 0;
   struct PublicKey pub_key;
   unsigned int size_of_array = 0;
   if (read_pubkey(&pub_key, key_fn)!=0) {return_val = -1; goto cleanup; }
-  unsigned char byte_array[BUCKET_NUM];
-  memset(byte_array, 0, sizeof byte_array);
-  int tmp = read_file_to_array(byte_array, input_fn, sizeof byte_array);
+  // one extra byte for the 255 delimiter
+  unsigned char *byte_array = arena_alloc(arena, BUCKET_NUM+1);
+  if (byte_array == NULL) {return_val = -1; goto cleanup; }
+  int tmp = read_file_to_array(byte_array, input_fn, BUCKET_NUM);
   if (tmp < 0) {
     error_print("ERROR: could not read file into array.\n");
     return_val = tmp;
@@ -622,11 +1160,11 @@ int encrypt_bucket_file(char *key_fn, char *input_fn, char *output_fn) {
   } else {
     size_of_array = (unsigned int)tmp;
   }
-  unsigned char *out_array;
-  unsigned int size_of_out_array = size_of_array*uct_size;
-  info_print("INFO: allocating %u bytes\n", size_of_out_array);
-  out_array = (unsigned char *)malloc(size_of_out_array);
-  if ((tmp = encrypt_buckets(out_array, byte_array, pub_key, sizeof byte_array) < 0)){
+  size_t size_of_out_array = (size_t)size_of_array*uct_size;
+  info_print("INFO: allocating %lu bytes\n", size_of_out_array);
+  unsigned char *out_array = arena_alloc(arena, size_of_out_array);
+  if (out_array == NULL) {return_val = -1; goto cleanup; }
+  if ((tmp = encrypt_buckets_ref(out_array, byte_array, &pub_key, size_of_array)) < 0){
     error_print("ERROR: could not encrypt array.\n");
     return_val = tmp;
     goto cleanup;
@@ -635,13 +1173,13 @@ int encrypt_bucket_file(char *key_fn, char *input_fn, char *output_fn) {
   size_t bytes_written = 0;
   if (out_file) {
     bytes_written = fwrite(out_array, 1, size_of_out_array, out_file);
+    fclose(out_file);
     if (bytes_written != size_of_out_array) {
       error_print("ERROR: incorrect number of bytes written to %s.\n", output_fn);
       return_val = -5;
       goto cleanup;
     }
     info_print("INFO: Written %lu bytes to %s.\n", bytes_written, output_fn);
-    fclose(out_file);
     return_val = 0;
     goto cleanup;
   } else {
@@ -651,25 +1189,31 @@ int encrypt_bucket_file(char *key_fn, char *input_fn, char *output_fn) {
   }
 
   cleanup:
-  if (out_array != NULL) {
-    free(out_array);
-  }
+  arena_reset(arena);
   return return_val;
 
 }
 
 int decrypt_bucket_file(char *key_fn, char *input_fn, char *output_fn) {
+  return decrypt_bucket_file_range(key_fn, input_fn, output_fn, ALL_BUCKETS);
+}
+
+int decrypt_bucket_file_arena(struct Arena *arena, char *key_fn, char *input_fn, char *output_fn) {
   int return_val = 0;
   unsigned int uct_size = sizeof (((struct UnrolledCipherText*)0)->arr);
   struct PrivateKey priv_key;
   int tmp;
   unsigned int size_of_array = 0;
-  if ((tmp = read_privkey(&priv_key, key_fn)!=0)) {return tmp; }
-  // unsigned char byte_array[BUCKET_NUM*crypto_core_ristretto255_BYTES*2];
-  unsigned int max_byte_array_mem = BUCKET_NUM*uct_size;
-  unsigned char *byte_array = malloc(max_byte_array_mem);
-  memset(byte_array, 0, max_byte_array_mem);
-  tmp = read_binary_CipherText_file(byte_array, input_fn, (int)max_byte_array_mem);
+  if ((tmp = read_privkey(&priv_key, key_fn))!=0) {return tmp; }
+  ssize_t size = file_size(input_fn);
+  if ((size < 0) || (size > (ssize_t)BUCKET_NUM*uct_size)) {
+    error_print("ERROR: could not read %s, or it is larger than %i buckets.\n", input_fn, BUCKET_NUM);
+    return_val = -1;
+    goto cleanup;
+  }
+  unsigned char *byte_array = arena_alloc(arena, (size_t)size);
+  if (byte_array == NULL) {return_val = -1; goto cleanup; }
+  tmp = read_binary_CipherText_file(byte_array, input_fn, (int)size);
   if (tmp < 0) {
     error_print("ERROR: could not read file into array.\n");
     return_val = tmp;
@@ -679,12 +1223,14 @@ int decrypt_bucket_file(char *key_fn, char *input_fn, char *output_fn) {
   }
   if (size_of_array % BUCKET_MAX != 0) {
     error_print("ERROR: size of array (%u) doesn't divide BUCKET_MAX (%u)\n", size_of_array, BUCKET_MAX);
-    return -1;
+    return_val = -1;
+    goto cleanup;
   }
   unsigned int num_elem = size_of_array / BUCKET_MAX;
   info_print("INFO: decrypting %u ciphertexts\n", num_elem);
-  unsigned char out_array[BUCKET_NUM];
-  if ((tmp = decrypt_buckets(out_array, byte_array, priv_key, num_elem))<0){
+  unsigned char *out_array = arena_alloc(arena, (size_t)num_elem+1);
+  if (out_array == NULL) {return_val = -1; goto cleanup; }
+  if ((tmp = decrypt_buckets_ref(out_array, byte_array, &priv_key, num_elem))<0){
     return_val = tmp; 
     goto cleanup;
   }
@@ -704,25 +1250,34 @@ int decrypt_bucket_file(char *key_fn, char *input_fn, char *output_fn) {
   }
 
   cleanup:
-  if (byte_array != NULL) {
-    free(byte_array);
-  }
+  sodium_memzero(&priv_key, sizeof priv_key);
+  arena_reset(arena);
   return return_val;
 }
 
 int decrypt_bucket_file_with_sec(char *shared_sec_fn, char *input_fn, char *output_fn) {
+  return decrypt_bucket_file_with_sec_range(shared_sec_fn, input_fn, output_fn, ALL_BUCKETS, false);
+}
+
+int decrypt_bucket_file_with_sec_arena(struct Arena *arena, char *shared_sec_fn, char *input_fn, char *output_fn) {
   int return_val = 0;
   unsigned int uct_size = sizeof (((struct UnrolledCipherText*)0)->arr);
   unsigned int uss_size = sizeof (((struct UnrolledSharedSecret*)0)->arr);
   int tmp;
   unsigned int size_of_array = 0;
 
-  unsigned int max_byte_array_mem = BUCKET_NUM*uct_size;
-  unsigned char *byte_array = malloc(max_byte_array_mem);
-  unsigned char *sec_array = malloc(max_byte_array_mem);
+  ssize_t size = file_size(input_fn);
+  if ((size < 0) || (size > (ssize_t)BUCKET_NUM*uct_size)) {
+    error_print("ERROR: could not read %s, or it is larger than %i buckets.\n", input_fn, BUCKET_NUM);
+    return_val = -1;
+    goto cleanup;
+  }
+  // Exactly one SharedSecret per CipherText
+  unsigned char *byte_array = arena_alloc(arena, (size_t)size);
+  unsigned char *sec_array = arena_alloc(arena, (size_t)size/2);
+  if ((byte_array == NULL) || (sec_array == NULL)) {return_val = -1; goto cleanup; }
 
-  memset(byte_array, 0, max_byte_array_mem);
-  tmp = read_binary_CipherText_file(byte_array, input_fn, (int)max_byte_array_mem);
+  tmp = read_binary_CipherText_file(byte_array, input_fn, (int)size);
   if (tmp < 0) {
     error_print("ERROR: could not read file into array.\n");
     return_val = tmp;
@@ -738,7 +1293,7 @@ int decrypt_bucket_file_with_sec(char *shared_sec_fn, char *input_fn, char *outp
   unsigned int num_elem = size_of_array / BUCKET_MAX;
   info_print("INFO: decrypting %u ciphertexts\n", num_elem);
 
-  tmp = read_partial_decryption_file(sec_array, shared_sec_fn, (int)max_byte_array_mem);
+  tmp = read_partial_decryption_file(sec_array, shared_sec_fn, (int)size/2);
   if (tmp < 0) {
     error_print("ERROR: could not read secrets file into array.\n");
     return_val = tmp;
@@ -750,7 +1305,8 @@ int decrypt_bucket_file_with_sec(char *shared_sec_fn, char *input_fn, char *outp
     goto cleanup;
   }
 
-  unsigned char out_array[BUCKET_NUM];
+  unsigned char *out_array = arena_alloc(arena, (size_t)num_elem+1);
+  if (out_array == NULL) {return_val = -1; goto cleanup; }
   if ((tmp = decrypt_buckets_with_sec(out_array, byte_array, sec_array, num_elem))<0){
     return_val = tmp; 
     goto cleanup;
@@ -771,55 +1327,80 @@ int decrypt_bucket_file_with_sec(char *shared_sec_fn, char *input_fn, char *outp
   }
 
   cleanup:
-  if (byte_array != NULL) {
-    free(byte_array);
+  arena_reset(arena);
+  return return_val;
+}
+
+int decrypt_bucket_file_with_secs(char *input_fn, char **node_fns, const int ncount, char *output_fn, const bool estimate) {
+  int return_val = 0;
+  unsigned char *out_array = malloc(BUCKET_NUM+1);
+  if (out_array == NULL) {
+    error_print("ERROR: could not allocate output array.\n");
+    return -1;
+  }
+  int num_elem = decrypt_buckets_with_secs_file(out_array, input_fn, node_fns, ncount, BUCKET_NUM);
+  if (num_elem < 0) {
+    return_val = num_elem;
+    goto cleanup;
   }
-  if (sec_array != NULL) {
-    free(sec_array);
+  FILE *out_file = open_output(output_fn, "w");
+  if (out_file) {
+    if (estimate) {
+      double card = estimate_cardinality(out_array, (unsigned int)num_elem);
+      fprintf(out_file, "%.0f\n", card);
+      info_print("INFO: Written cardinality estimate %.0f to %s.\n", card, output_fn);
+    } else {
+      for (int i=0; i<num_elem; i++) {
+        fprintf(out_file, "%i\n", out_array[i]);
+      }
+      info_print("INFO: Written %d lines to %s.\n", num_elem, output_fn);
+    }
+    close_output(out_file);
+    return_val = 0;
+  } else {
+    error_print("ERROR: could not open %s for writing.\n", output_fn);
+    return_val = -6;
   }
+
+  cleanup:
+  free(out_array);
   return return_val;
 }
 
 int get_partial_decryptions(char *key_fn, char *input_fn, char *output_fn) {
+  return get_partial_decryptions_range(key_fn, input_fn, output_fn, NULL, ALL_BUCKETS, false);
+}
+
+int get_partial_decryptions_arena(struct Arena *arena, char *key_fn, char *input_fn, char *output_fn) {
   int return_val = 0;
   struct PrivateKey priv_key;
   int tmp;
-  unsigned int size_of_array = 0;
-  if ((tmp = read_privkey(&priv_key, key_fn)!=0)) {return tmp; }
+  if ((tmp = read_privkey(&priv_key, key_fn))!=0) {return tmp; }
 
-  ssize_t size;
-  size_t bytes_read = 0;
-  FILE *fp =fopen(input_fn, "rb");
-  unsigned char *in_array;
-  if (fp) {
-    fseek (fp , 0 , SEEK_END);
-    size = ftell (fp);
-    rewind (fp);
-    if (size % (2*crypto_core_ristretto255_BYTES) != 0) {
-      error_print("ERROR: %s contains %ld bytes, which does not divide %i.\n", input_fn, size, 2*crypto_core_ristretto255_BYTES);
-      fclose(fp);
-      return -1;
-    }
-    in_array = (unsigned char *)malloc((size_t)size);
-    bytes_read = fread(in_array, 1, (size_t)size, fp);
-    fclose(fp);
+  ssize_t size = file_size(input_fn);
+  if (size < 0) {
+    return_val = -1;
+    goto cleanup;
+  } else if (size % (2*crypto_core_ristretto255_BYTES) != 0) {
+    error_print("ERROR: %s contains %ld bytes, which does not divide %i.\n", input_fn, size, 2*crypto_core_ristretto255_BYTES);
+    return_val = -1;
+    goto cleanup;
+  }
+  unsigned char *in_array = arena_alloc(arena, (size_t)size);
+  unsigned char *out_array = arena_alloc(arena, (size_t)size/2);
+  if ((in_array == NULL) || (out_array == NULL)) {return_val = -1; goto cleanup; }
+  if (read_binary_CipherText_file(in_array, input_fn, (int)size) < 0) {
+    return_val = -1;
+    goto cleanup;
   }
 
-  unsigned char *out_array = (unsigned char*)malloc((size_t)size/2);
-  struct SharedSecret s;
-  struct CipherText x;
-  for (int i=0; i< size/(2*crypto_core_ristretto255_BYTES); i++) {
-    memcpy(x.c1, &in_array[2*i*crypto_core_ristretto255_BYTES], crypto_core_ristretto255_BYTES);
-    memcpy(x.c2, &in_array[(2*i+1)*crypto_core_ristretto255_BYTES], crypto_core_ristretto255_BYTES);
-    if (shared_secret(&s, x, priv_key)!=0) {
-      return_val = -1;
-      goto cleanup;
-    }
-    memcpy(&out_array[i*crypto_core_ristretto255_BYTES], s.val, crypto_core_ristretto255_BYTES);
+  if (partial_decryptions(NULL, out_array, in_array, 2*crypto_core_ristretto255_BYTES, (unsigned int)(size/(2*crypto_core_ristretto255_BYTES)), &priv_key) != 0) {
+    return_val = -1;
+    goto cleanup;
   }
 
   size_t bytes_written = 0;
-  fp = fopen(output_fn, "wb");
+  FILE *fp = fopen(output_fn, "wb");
   if (fp) {
     bytes_written = fwrite(out_array, 1, (size_t)size/2, fp);
     fclose(fp);
@@ -835,42 +1416,190 @@ int get_partial_decryptions(char *key_fn, char *input_fn, char *output_fn) {
   }
 
   cleanup:
-  free(in_array);
-  free(out_array);
+  sodium_memzero(&priv_key, sizeof priv_key);
+  arena_reset(arena);
   return return_val;
 }
 
-int add_all_ciphertexts(unsigned char *a1, const unsigned char *a2, const int num_elem) {
-  struct CipherText x;
-  struct CipherText y;
-  struct CipherText z;
-  for (int i=0; i<num_elem; i++) {
-    memcpy(x.c1, &a1[2*i*crypto_core_ristretto255_BYTES], crypto_core_ristretto255_BYTES);
-    memcpy(x.c2, &a1[(2*i+1)*crypto_core_ristretto255_BYTES], crypto_core_ristretto255_BYTES);
-    memcpy(y.c1, &a2[2*i*crypto_core_ristretto255_BYTES], crypto_core_ristretto255_BYTES);
-    memcpy(y.c2, &a2[(2*i+1)*crypto_core_ristretto255_BYTES], crypto_core_ristretto255_BYTES);
-    if (add_ciphertext(&z, x, y)!=0) {
-      error_print("ERROR: addition failure. 39fjs:%i\n", i);
+int ciphertexts_to_soa(unsigned char *c1s, unsigned char *c2s, const unsigned char *aos, const unsigned int num_ciphertexts) {
+  for (unsigned int i=0; i<num_ciphertexts; i++) {
+    memcpy(&c1s[(size_t)i*crypto_core_ristretto255_BYTES], &aos[(size_t)2*i*crypto_core_ristretto255_BYTES], crypto_core_ristretto255_BYTES);
+    memcpy(&c2s[(size_t)i*crypto_core_ristretto255_BYTES], &aos[(size_t)(2*i+1)*crypto_core_ristretto255_BYTES], crypto_core_ristretto255_BYTES);
+  }
+  return 0;
+}
+
+int ciphertexts_from_soa(unsigned char *aos, const unsigned char *c1s, const unsigned char *c2s, const unsigned int num_ciphertexts) {
+  for (unsigned int i=0; i<num_ciphertexts; i++) {
+    memcpy(&aos[(size_t)2*i*crypto_core_ristretto255_BYTES], &c1s[(size_t)i*crypto_core_ristretto255_BYTES], crypto_core_ristretto255_BYTES);
+    memcpy(&aos[(size_t)(2*i+1)*crypto_core_ristretto255_BYTES], &c2s[(size_t)i*crypto_core_ristretto255_BYTES], crypto_core_ristretto255_BYTES);
+  }
+  return 0;
+}
+
+int convert_CipherText_file_layout(char *input_fn, char *output_fn, const bool to_soa) {
+  // Each half of an SoA file is streamed through its own file position
+  if (is_std_stream(input_fn) || is_std_stream(output_fn)) {
+    error_print("ERROR: SoA conversion needs seekable files, not stdin or stdout.\n");
+    return -1;
+  }
+  unsigned int cipher_size = 2*crypto_core_ristretto255_BYTES;
+  unsigned int chunk = STREAM_CHUNK_BUCKETS*BUCKET_MAX;
+  int return_val = 0;
+  FILE *in_fp = NULL;
+  FILE *in_c2_fp = NULL;
+  FILE *out_fp = NULL;
+  FILE *out_c2_fp = NULL;
+  unsigned char *aos = malloc((size_t)chunk*cipher_size);
+  unsigned char *soa = malloc((size_t)chunk*cipher_size);
+  if ((aos == NULL) || (soa == NULL)) {
+    error_print("ERROR: could not allocate conversion buffers.\n");
+    return_val = -1;
+    goto cleanup;
+  }
+  FILE *exists = fopen(output_fn, "rb");
+  if (exists) {
+    error_print("ERROR: %s exists.\nAborting so we don't clobber it.\n", output_fn);
+    fclose(exists);
+    return_val = -2;
+    goto cleanup;
+  }
+  ssize_t size = file_size(input_fn);
+  if ((size < 0) || (size % cipher_size != 0)) {
+    error_print("ERROR: %s does not hold a whole number of CipherTexts.\n", input_fn);
+    return_val = -1;
+    goto cleanup;
+  }
+  unsigned int num_ciphertexts = (unsigned int)(size / cipher_size);
+  long c2_offset = (long)num_ciphertexts*crypto_core_ristretto255_BYTES;
+
+  // The c2 half of an SoA file is read or written through its own stream
+  in_fp = fopen(input_fn, "rb");
+  out_fp = fopen(output_fn, "wb");
+  if (to_soa) {
+    out_c2_fp = fopen(output_fn, "r+b");
+  } else {
+    in_c2_fp = fopen(input_fn, "rb");
+  }
+  if ((!in_fp) || (!out_fp) || (to_soa && !out_c2_fp) || (!to_soa && !in_c2_fp)) {
+    error_print("ERROR: could not open %s and %s.\n", input_fn, output_fn);
+    return_val = -1;
+    goto cleanup;
+  }
+  if (fseek(to_soa ? out_c2_fp : in_c2_fp, c2_offset, SEEK_SET) != 0) {
+    error_print("ERROR: could not seek to the c2 half.\n");
+    return_val = -1;
+    goto cleanup;
+  }
+  unsigned char *c1s = soa;
+  unsigned char *c2s = &soa[(size_t)chunk*crypto_core_ristretto255_BYTES];
+  for (unsigned int start=0; start<num_ciphertexts; start+=chunk) {
+    size_t n = (num_ciphertexts - start > chunk) ? chunk : num_ciphertexts - start;
+    if (to_soa) {
+      if (fread(aos, cipher_size, n, in_fp) != n) { return_val = -1; goto cleanup; }
+      if (validate_points(NULL, aos, 2*n, input_fn, 2*(size_t)start, 2*BUCKET_MAX) != 0) { return_val = -3; goto cleanup; }
+      ciphertexts_to_soa(c1s, c2s, aos, (unsigned int)n);
+      if ((fwrite(c1s, crypto_core_ristretto255_BYTES, n, out_fp) != n) ||
+          (fwrite(c2s, crypto_core_ristretto255_BYTES, n, out_c2_fp) != n)) {
+        return_val = -5;
+        goto cleanup;
+      }
+    } else {
+      if ((fread(c1s, crypto_core_ristretto255_BYTES, n, in_fp) != n) ||
+          (fread(c2s, crypto_core_ristretto255_BYTES, n, in_c2_fp) != n)) {
+        return_val = -1;
+        goto cleanup;
+      }
+      if ((validate_points(NULL, c1s, n, input_fn, start, BUCKET_MAX) != 0) ||
+          (validate_points(NULL, c2s, n, input_fn, start, BUCKET_MAX) != 0)) {
+        return_val = -3;
+        goto cleanup;
+      }
+      ciphertexts_from_soa(aos, c1s, c2s, (unsigned int)n);
+      if (fwrite(aos, cipher_size, n, out_fp) != n) { return_val = -5; goto cleanup; }
+    }
+  }
+  info_print("INFO: Converted %u CipherTexts to %s layout in %s.\n", num_ciphertexts, to_soa ? "SoA" : "AoS", output_fn);
+
+  cleanup:
+  if (return_val == -1) {
+    error_print("ERROR: could not read %s.\n", input_fn);
+  } else if (return_val == -5) {
+    error_print("ERROR: incorrect number of bytes written to %s.\n", output_fn);
+  }
+  if (in_fp != NULL) { fclose(in_fp); }
+  if (in_c2_fp != NULL) { fclose(in_c2_fp); }
+  // Flush the c2 half before the c1 stream, which created the file
+  if (out_c2_fp != NULL) { fclose(out_c2_fp); }
+  if (out_fp != NULL) { fclose(out_fp); }
+  free(aos);
+  free(soa);
+  return return_val;
+}
+
+int get_partial_decryptions_soa(char *key_fn, char *input_fn, char *output_fn) {
+  return get_partial_decryptions_range(key_fn, input_fn, output_fn, NULL, ALL_BUCKETS, true);
+}
+
+int decrypt_buckets_with_sec_soa(unsigned char *plain, const unsigned char *c2s, const unsigned char *shared_sec, const unsigned int num_buckets) {
+  unsigned char zero[crypto_core_ristretto255_BYTES];
+  unsigned char m[crypto_core_ristretto255_BYTES];
+  memset(zero, 0, sizeof zero);
+  for (unsigned int i=0; i<num_buckets; i++) {
+    unsigned char x = BUCKET_MAX;
+    for (unsigned int k=0; k<BUCKET_MAX; k++) {
+      size_t offset = ((size_t)i*BUCKET_MAX + k)*crypto_core_ristretto255_BYTES;
+      if (crypto_core_ristretto255_sub(m, &c2s[offset], &shared_sec[offset]) != 0) {
+        error_print("ERROR: could not decrypt values\n");
+        return -1;
+      }
+      // encode(0) is the identity, which encodes to all zeros
+      if (memcmp(m, zero, sizeof m) == 0) {
+        x = (unsigned char)k;
+        break;
+      }
+    }
+    plain[i] = x;
+  }
+  plain[num_buckets] = 0;
+  return (int)num_buckets;
+}
+
+int decrypt_bucket_file_with_sec_soa(char *shared_sec_fn, char *input_fn, char *output_fn) {
+  return decrypt_bucket_file_with_sec_range(shared_sec_fn, input_fn, output_fn, ALL_BUCKETS, true);
+}
+
+// Adds a2 into a1 point by point. Returns 0 on success, or -1 with the
+// index of the first point that could not be added in *failed
+static int add_all_points(unsigned char *a1, const unsigned char *a2, const size_t num_points, size_t *failed) {
+  for (size_t k=0; k<num_points; k++) {
+    unsigned char *p = &a1[k*crypto_core_ristretto255_BYTES];
+    if (crypto_core_ristretto255_add(p, p, &a2[k*crypto_core_ristretto255_BYTES])!=0) {
+      *failed = k;
       return -1;
     }
-    memcpy(&a1[2*i*crypto_core_ristretto255_BYTES], z.c1, crypto_core_ristretto255_BYTES);
-    memcpy(&a1[(2*i+1)*crypto_core_ristretto255_BYTES], z.c2, crypto_core_ristretto255_BYTES);
+  }
+  return 0;
+}
+
+// A CipherText is two points, c1 and c2, and the sum of two CipherTexts is
+// the pointwise sum of those points, so both arrays are flat point arrays
+int add_all_ciphertexts(unsigned char *a1, const unsigned char *a2, const int num_elem) {
+  if (num_elem <= 0) { return 0; }
+  size_t k;
+  if (add_all_points(a1, a2, 2*(size_t)num_elem, &k) != 0) {
+    error_print("ERROR: addition failure. 39fjs:%lu\n", (unsigned long)(k/2));
+    return -1;
   }
   return 0;
 }
 
 int add_all_secrets(unsigned char *a1, const unsigned char *a2, const int num_elem) {
-  struct SharedSecret x;
-  struct SharedSecret y;
-  struct SharedSecret z;
-  for (int i=0; i<num_elem; i++) {
-    memcpy(x.val, &a1[i*crypto_core_ristretto255_BYTES], crypto_core_ristretto255_BYTES);
-    memcpy(y.val, &a2[i*crypto_core_ristretto255_BYTES], crypto_core_ristretto255_BYTES);
-    if (crypto_core_ristretto255_add(z.val, x.val, y.val)!=0) {
-      error_print("ERROR: addition failure. 854sj:%i\n", i);
-      return -1;
-    }
-    memcpy(&a1[i*crypto_core_ristretto255_BYTES], z.val, crypto_core_ristretto255_BYTES);
+  if (num_elem <= 0) { return 0; }
+  size_t k;
+  if (add_all_points(a1, a2, (size_t)num_elem, &k) != 0) {
+    error_print("ERROR: addition failure. 854sj:%lu\n", (unsigned long)k);
+    return -1;
   }
   return 0;
 }
@@ -880,6 +1609,10 @@ int add_all_secrets(unsigned char *a1, const unsigned char *a2, const int num_el
 }*/
 
 int combine_binary_CipherText_files(char *combined_fn, char **fns, const int ncount) {
+  return combine_binary_CipherText_files_range(combined_fn, fns, ncount, ALL_BUCKETS);
+}
+
+int combine_binary_CipherText_files_arena(struct Arena *arena, char *combined_fn, char **fns, const int ncount) {
   unsigned int cipher_size = 2*crypto_core_ristretto255_BYTES;
   FILE *combined_file = fopen(combined_fn, "rb");
   if (combined_file) {
@@ -888,18 +1621,8 @@ int combine_binary_CipherText_files(char *combined_fn, char **fns, const int nco
     return -2;
   }
 
-  ssize_t size;
-  FILE *fp = fopen(fns[0], "rb");
-  if (fp) {
-    fseek(fp, 0, SEEK_END);
-    size = ftell(fp);
-    fclose(fp);
-  } else {
-    error_print("ERROR: problems opening %s for reading.\n", fns[0]);
-    return -1;
-  }
+  ssize_t size = file_size(fns[0]);
   if (size < 0) {
-    error_print("ERROR: problems seeking end of %s.\n", fns[0]);
     return -1;
   } else if (size % cipher_size != 0) {
     error_print("ERROR: %s contains %ld bytes, which does not divide %i.\n", fns[0], size, cipher_size);
@@ -909,17 +1632,18 @@ int combine_binary_CipherText_files(char *combined_fn, char **fns, const int nco
   
 
   int return_val = 0;
-  //unsigned char buffer[crypto_core_ristretto255_BYTES + 1];
-  unsigned char *ans;
-  ans = calloc((size_t)size, 1);
-  unsigned char *buffer;
-  buffer = calloc((size_t)size, 1);
+  unsigned char *ans = arena_alloc(arena, (size_t)size);
+  unsigned char *buffer = arena_alloc(arena, (size_t)size);
+  if ((ans == NULL) || (buffer == NULL)) {
+    return_val = -1;
+    goto cleanup;
+  }
 
   for (int file_it=0; file_it<ncount; file_it++) {
-    if (read_binary_CipherText_file(buffer, fns[file_it], (int)num_ciphertext*(int)cipher_size)==(int)num_ciphertext) {
-      if (file_it == 0) {
-        memcpy(ans, buffer, (size_t)size);
-      } else if (add_all_ciphertexts(ans, buffer, (int)num_ciphertext)!=0) {
+    // The first file is read straight into the sum
+    unsigned char *dest = (file_it == 0) ? ans : buffer;
+    if (read_binary_CipherText_file(dest, fns[file_it], (int)num_ciphertext*(int)cipher_size)==(int)num_ciphertext) {
+      if ((file_it > 0) && (add_all_ciphertexts(ans, buffer, (int)num_ciphertext)!=0)) {
         error_print("ERROR: something wrong happened. 21f2s3\n");
         return_val = -1;
         goto cleanup;
@@ -937,6 +1661,7 @@ int combine_binary_CipherText_files(char *combined_fn, char **fns, const int nco
   combined_file = fopen(combined_fn, "wb");
   if (combined_file) {
     bytes_written = fwrite(ans, 1, (size_t)size, combined_file);
+    fclose(combined_file);
     if (bytes_written != (size_t)size) {
       error_print("ERROR: incorrect number of bytes written to %s.\n", combined_fn);
       return_val = -1;
@@ -950,12 +1675,15 @@ int combine_binary_CipherText_files(char *combined_fn, char **fns, const int nco
   info_print("INFO: successfully written to %s.\n", combined_fn);
 
   cleanup:
-  free(ans);
-  free(buffer);
+  arena_reset(arena);
   return return_val;
 }
 
 int combine_partial_decryptions(char *combined_fn, char **fns, const int ncount) {
+  return combine_partial_decryptions_range(combined_fn, fns, ncount, ALL_BUCKETS);
+}
+
+int combine_partial_decryptions_arena(struct Arena *arena, char *combined_fn, char **fns, const int ncount) {
   unsigned int ss_size = crypto_core_ristretto255_BYTES;
   FILE *combined_file = fopen(combined_fn, "rb");
   if (combined_file) {
@@ -964,18 +1692,8 @@ int combine_partial_decryptions(char *combined_fn, char **fns, const int ncount)
     return -2;
   }
 
-  ssize_t size;
-  FILE *fp = fopen(fns[0], "rb");
-  if (fp) {
-    fseek(fp, 0, SEEK_END);
-    size = ftell(fp);
-    fclose(fp);
-  } else {
-    error_print("ERROR: problems opening %s for reading.\n", fns[0]);
-    return -1;
-  }
+  ssize_t size = file_size(fns[0]);
   if (size < 0) {
-    error_print("ERROR: problems seeking end of %s.\n", fns[0]);
     return -1;
   } else if (size % ss_size != 0) {
     error_print("ERROR: %s contains %ld bytes, which does not divide %i.\n", fns[0], size, ss_size);
@@ -985,17 +1703,18 @@ int combine_partial_decryptions(char *combined_fn, char **fns, const int ncount)
   
 
   int return_val = 0;
-  //unsigned char buffer[crypto_core_ristretto255_BYTES + 1];
-  unsigned char *ans;
-  ans = calloc((size_t)size, 1);
-  unsigned char *buffer;
-  buffer = calloc((size_t)size, 1);
+  unsigned char *ans = arena_alloc(arena, (size_t)size);
+  unsigned char *buffer = arena_alloc(arena, (size_t)size);
+  if ((ans == NULL) || (buffer == NULL)) {
+    return_val = -1;
+    goto cleanup;
+  }
 
   for (int file_it=0; file_it<ncount; file_it++) {
-    if (read_partial_decryption_file(buffer, fns[file_it], (int)num_secrets*(int)ss_size)==(int)num_secrets) {
-      if (file_it == 0) {
-        memcpy(ans, buffer, (size_t)size);
-      } else if (add_all_secrets(ans, buffer, (int)num_secrets)!=0) {
+    // The first file is read straight into the sum
+    unsigned char *dest = (file_it == 0) ? ans : buffer;
+    if (read_partial_decryption_file(dest, fns[file_it], (int)num_secrets*(int)ss_size)==(int)num_secrets) {
+      if ((file_it > 0) && (add_all_secrets(ans, buffer, (int)num_secrets)!=0)) {
         error_print("ERROR: something wrong happened. i23dd\n");
         return_val = -1;
         goto cleanup;
@@ -1013,6 +1732,7 @@ int combine_partial_decryptions(char *combined_fn, char **fns, const int ncount)
   combined_file = fopen(combined_fn, "wb");
   if (combined_file) {
     bytes_written = fwrite(ans, 1, (size_t)size, combined_file);
+    fclose(combined_file);
     if (bytes_written != (size_t)size) {
       error_print("ERROR: incorrect number of bytes written to %s.\n", combined_fn);
       return_val = -1;
@@ -1026,8 +1746,2660 @@ int combine_partial_decryptions(char *combined_fn, char **fns, const int ncount)
   info_print("INFO: successfully written to %s.\n", combined_fn);
 
   cleanup:
-  free(ans);
-  free(buffer);
+  arena_reset(arena);
+  return return_val;
+}
+
+static int sum_tree_build(struct CipherTextSumTree *t, char **fns, const int k, const int lo, const int hi) {
+  t->nodes[k] = malloc(t->array_bytes);
+  if (t->nodes[k] == NULL) {
+    error_print("ERROR: could not allocate %lu bytes for cached sums.\n", t->array_bytes);
+    return -1;
+  }
+  if (hi - lo == 1) {
+    if (read_binary_CipherText_file(t->nodes[k], fns[lo], (int)t->array_bytes) != (int)t->num_ciphertexts) {
+      error_print("ERROR: %s is not the right size\n", fns[lo]);
+      return -1;
+    }
+    return 0;
+  }
+  int mid = lo + (hi - lo)/2;
+  if (sum_tree_build(t, fns, 2*k, lo, mid) != 0) { return -1; }
+  if (sum_tree_build(t, fns, 2*k+1, mid, hi) != 0) { return -1; }
+  memcpy(t->nodes[k], t->nodes[2*k], t->array_bytes);
+  if (add_all_ciphertexts(t->nodes[k], t->nodes[2*k+1], (int)t->num_ciphertexts) != 0) {
+    error_print("ERROR: could not cache sum of parties [%i, %i)\n", lo, hi);
+    return -1;
+  }
+  return 0;
+}
+
+int sum_tree_init(struct CipherTextSumTree *t, char **fns, const int ncount) {
+  unsigned int cipher_size = 2*crypto_core_ristretto255_BYTES;
+  memset(t, 0, sizeof *t);
+  if (ncount < 1) {
+    error_print("ERROR: need at least one ciphertext file.\n");
+    return -1;
+  }
+  ssize_t size;
+  FILE *fp = fopen(fns[0], "rb");
+  if (fp) {
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fclose(fp);
+  } else {
+    error_print("ERROR: problems opening %s for reading.\n", fns[0]);
+    return -1;
+  }
+  if (size < 0) {
+    error_print("ERROR: problems seeking end of %s.\n", fns[0]);
+    return -1;
+  } else if (size % cipher_size != 0) {
+    error_print("ERROR: %s contains %ld bytes, which does not divide %i.\n", fns[0], size, cipher_size);
+    return -1;
+  }
+  t->ncount = ncount;
+  t->num_ciphertexts = (unsigned int)(size / cipher_size);
+  t->array_bytes = (size_t)size;
+  t->num_nodes = 4*ncount;
+  t->nodes = calloc((size_t)t->num_nodes, sizeof (unsigned char *));
+  if (t->nodes == NULL) {
+    error_print("ERROR: could not allocate cached sums.\n");
+    return -1;
+  }
+  if (sum_tree_build(t, fns, 1, 0, ncount) != 0) {
+    sum_tree_free(t);
+    return -1;
+  }
+  info_print("INFO: cached partial sums of %i ciphertext arrays.\n", ncount);
+  return 0;
+}
+
+// Adds the largest cached nodes fully covered by the members into out
+static int sum_tree_collect(unsigned char *out, const struct CipherTextSumTree *t, const int *prefix, const int k, const int lo, const int hi, int *pieces) {
+  int count = prefix[hi] - prefix[lo];
+  if (count == 0) {
+    return 0;
+  }
+  if (count == hi - lo) {
+    if (*pieces == 0) {
+      memcpy(out, t->nodes[k], t->array_bytes);
+    } else if (add_all_ciphertexts(out, t->nodes[k], (int)t->num_ciphertexts) != 0) {
+      error_print("ERROR: could not add cached sum of parties [%i, %i)\n", lo, hi);
+      return -1;
+    }
+    (*pieces)++;
+    return 0;
+  }
+  int mid = lo + (hi - lo)/2;
+  if (sum_tree_collect(out, t, prefix, 2*k, lo, mid, pieces) != 0) { return -1; }
+  return sum_tree_collect(out, t, prefix, 2*k+1, mid, hi, pieces);
+}
+
+int sum_tree_subset(unsigned char *out, const struct CipherTextSumTree *t, const bool *members) {
+  int return_val = 0;
+  int pieces = 0;
+  int *prefix = malloc(((size_t)t->ncount+1) * sizeof (int));
+  if (prefix == NULL) {
+    error_print("ERROR: could not allocate subset index.\n");
+    return -1;
+  }
+  prefix[0] = 0;
+  for (int i=0; i<t->ncount; i++) {
+    prefix[i+1] = prefix[i] + (members[i] ? 1 : 0);
+  }
+  if (prefix[t->ncount] == 0) {
+    error_print("ERROR: empty subset of parties.\n");
+    return_val = -1;
+  } else if (sum_tree_collect(out, t, prefix, 1, 0, t->ncount, &pieces) != 0) {
+    return_val = -1;
+  } else {
+    return_val = pieces;
+  }
+  free(prefix);
+  return return_val;
+}
+
+void sum_tree_free(struct CipherTextSumTree *t) {
+  if (t->nodes != NULL) {
+    for (int k=0; k<t->num_nodes; k++) {
+      free(t->nodes[k]);
+    }
+    free(t->nodes);
+  }
+  memset(t, 0, sizeof *t);
+}
+
+int combine_subsets_file(char *query_fn, char **fns, const int ncount) {
+  int return_val = 0;
+  int num_queries = 0;
+  char *line = NULL;
+  size_t len = 0;
+  bool *members = calloc((size_t)ncount, sizeof (bool));
+  unsigned char *out = NULL;
+  struct CipherTextSumTree t;
+  memset(&t, 0, sizeof t);
+  FILE *fp = fopen(query_fn, "r");
+  if (!fp) {
+    error_print("ERROR: could not open %s for reading.\n", query_fn);
+    free(members);
+    return -1;
+  }
+  if ((members == NULL) || (sum_tree_init(&t, fns, ncount) != 0)) {
+    return_val = -1;
+    goto cleanup;
+  }
+  out = malloc(t.array_bytes);
+  if (out == NULL) {
+    error_print("ERROR: could not allocate %lu bytes.\n", t.array_bytes);
+    return_val = -1;
+    goto cleanup;
+  }
+
+  while (getline(&line, &len, fp) != -1) {
+    char *saveptr = NULL;
+    char *out_fn = strtok_r(line, " \t\r\n", &saveptr);
+    if (out_fn == NULL) { continue; }
+    memset(members, 0, (size_t)ncount * sizeof (bool));
+    char *tok;
+    while ((tok = strtok_r(NULL, " \t\r\n", &saveptr)) != NULL) {
+      char *end;
+      long idx = strtol(tok, &end, 10);
+      if ((*end != '\0') || (idx < 0) || (idx >= ncount)) {
+        error_print("ERROR: %s is not a party index in [0, %i) for %s\n", tok, ncount, out_fn);
+        return_val = -1;
+        goto cleanup;
+      }
+      members[idx] = true;
+    }
+    FILE *combined_file = fopen(out_fn, "rb");
+    if (combined_file) {
+      error_print("ERROR: %s exists.\nAborting so we don't clobber it.\n", out_fn);
+      fclose(combined_file);
+      return_val = -2;
+      goto cleanup;
+    }
+    int pieces = sum_tree_subset(out, &t, members);
+    if (pieces < 0) {
+      error_print("ERROR: could not combine subset for %s\n", out_fn);
+      return_val = -1;
+      goto cleanup;
+    }
+    combined_file = fopen(out_fn, "wb");
+    if (!combined_file) {
+      error_print("ERROR: problem writing %s.\n", out_fn);
+      return_val = -1;
+      goto cleanup;
+    }
+    size_t bytes_written = fwrite(out, 1, t.array_bytes, combined_file);
+    fclose(combined_file);
+    if (bytes_written != t.array_bytes) {
+      error_print("ERROR: incorrect number of bytes written to %s.\n", out_fn);
+      return_val = -1;
+      goto cleanup;
+    }
+    info_print("INFO: written %s from %i cached sums.\n", out_fn, pieces);
+    num_queries++;
+  }
+  info_print("INFO: answered %i subset queries.\n", num_queries);
+
+  cleanup:
+  fclose(fp);
+  free(line);
+  free(members);
+  free(out);
+  sum_tree_free(&t);
   return return_val;
 }
 
+int read_intersection_queries(uint64_t **queries, char *query_fn, const int ncount) {
+  FILE *fp = fopen(query_fn, "r");
+  if (!fp) {
+    error_print("ERROR: could not open %s for reading.\n", query_fn);
+    return -1;
+  }
+  int return_val = 0;
+  int num_queries = 0;
+  int capacity = 0;
+  int line_num = 0;
+  char *line = NULL;
+  size_t len = 0;
+  *queries = NULL;
+  while (getline(&line, &len, fp) != -1) {
+    line_num++;
+    uint64_t mask = 0;
+    int arity = 0;
+    char *saveptr = NULL;
+    char *tok = strtok_r(line, " \t\r\n", &saveptr);
+    for (; tok != NULL; tok = strtok_r(NULL, " \t\r\n", &saveptr)) {
+      char *end;
+      long idx = strtol(tok, &end, 10);
+      if ((*end != '\0') || (idx < 0) || (idx >= ncount) || (idx >= MAX_INTERSECTION_PARTIES)) {
+        error_print("ERROR: %s on line %i is not a party index in [0, %i)\n", tok, line_num, ncount);
+        return_val = -1;
+        goto cleanup;
+      }
+      if ((mask & ((uint64_t)1 << idx)) == 0) {
+        mask |= (uint64_t)1 << idx;
+        arity++;
+      }
+    }
+    if (arity == 0) { continue; }
+    if (arity > MAX_INTERSECTION_ARITY) {
+      error_print("ERROR: line %i intersects %i parties, more than %i\n", line_num, arity, MAX_INTERSECTION_ARITY);
+      return_val = -1;
+      goto cleanup;
+    }
+    if (num_queries == capacity) {
+      capacity = capacity ? 2*capacity : 64;
+      uint64_t *tmp = realloc(*queries, (size_t)capacity * sizeof (uint64_t));
+      if (tmp == NULL) {
+        error_print("ERROR: could not allocate queries.\n");
+        return_val = -1;
+        goto cleanup;
+      }
+      *queries = tmp;
+    }
+    (*queries)[num_queries++] = mask;
+  }
+  return_val = num_queries;
+
+  cleanup:
+  if (return_val < 0) {
+    free(*queries);
+    *queries = NULL;
+  }
+  free(line);
+  fclose(fp);
+  return return_val;
+}
+
+static int compare_masks(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+int intersection_unions(uint64_t *unions, const uint64_t *queries, const int num_queries) {
+  size_t total = 0;
+  for (int q=0; q<num_queries; q++) {
+    // Every nonempty subset of the query's parties
+    for (uint64_t sub = queries[q]; sub != 0; sub = (sub - 1) & queries[q]) {
+      unions[total++] = sub;
+    }
+  }
+  // Sorting puts repeats next to each other
+  qsort(unions, total, sizeof *unions, compare_masks);
+  int num_unions = 0;
+  for (size_t i=0; i<total; i++) {
+    if ((num_unions == 0) || (unions[num_unions-1] != unions[i])) {
+      unions[num_unions++] = unions[i];
+    }
+  }
+  return num_unions;
+}
+
+double inclusion_exclusion(const uint64_t query, const uint64_t *unions, const double *union_estimates, const int num_unions) {
+  double est = 0;
+  for (int u=0; u<num_unions; u++) {
+    if ((unions[u] & ~query) != 0) { continue; }
+    int size = 0;
+    for (uint64_t m = unions[u]; m != 0; m &= m - 1) { size++; }
+    est += (size % 2 == 1) ? union_estimates[u] : -union_estimates[u];
+  }
+  return est;
+}
+
+int prepare_intersection_batch(char *query_fn, char *batch_fn, char **fns, const int ncount) {
+  FILE *batch_file = fopen(batch_fn, "rb");
+  if (batch_file) {
+    error_print("ERROR: %s exists.\nAborting so we don't clobber it.\n", batch_fn);
+    fclose(batch_file);
+    return -2;
+  }
+  int return_val = 0;
+  uint64_t *queries = NULL;
+  uint64_t *unions = NULL;
+  bool *members = NULL;
+  unsigned char *out = NULL;
+  struct CipherTextSumTree t;
+  memset(&t, 0, sizeof t);
+  batch_file = NULL;
+
+  int num_queries = read_intersection_queries(&queries, query_fn, ncount);
+  if (num_queries <= 0) {
+    error_print("ERROR: no intersection queries in %s\n", query_fn);
+    return_val = -1;
+    goto cleanup;
+  }
+  unions = malloc(((size_t)num_queries << MAX_INTERSECTION_ARITY) * sizeof (uint64_t));
+  members = calloc((size_t)ncount, sizeof (bool));
+  if ((unions == NULL) || (members == NULL)) {
+    error_print("ERROR: could not allocate unions.\n");
+    return_val = -1;
+    goto cleanup;
+  }
+  int num_unions = intersection_unions(unions, queries, num_queries);
+  if (sum_tree_init(&t, fns, ncount) != 0) {
+    return_val = -1;
+    goto cleanup;
+  }
+  out = malloc(t.array_bytes);
+  batch_file = fopen(batch_fn, "wb");
+  if ((out == NULL) || (!batch_file)) {
+    error_print("ERROR: problem writing %s.\n", batch_fn);
+    return_val = -1;
+    goto cleanup;
+  }
+  int total_pieces = 0;
+  for (int u=0; u<num_unions; u++) {
+    for (int i=0; i<ncount; i++) {
+      members[i] = ((unions[u] >> i) & 1) != 0;
+    }
+    int pieces = sum_tree_subset(out, &t, members);
+    if (pieces < 0) {
+      return_val = -1;
+      goto cleanup;
+    }
+    total_pieces += pieces;
+    if (fwrite(out, 1, t.array_bytes, batch_file) != t.array_bytes) {
+      error_print("ERROR: incorrect number of bytes written to %s.\n", batch_fn);
+      return_val = -1;
+      goto cleanup;
+    }
+  }
+  info_print("INFO: written %i unions for %i queries to %s from %i cached sums.\n", num_unions, num_queries, batch_fn, total_pieces);
+
+  cleanup:
+  if (batch_file != NULL) {
+    fclose(batch_file);
+  }
+  free(queries);
+  free(unions);
+  free(members);
+  free(out);
+  sum_tree_free(&t);
+  return return_val;
+}
+
+int finish_intersection_batch(char *query_fn, char *batch_fn, char *output_fn, char **node_fns, const int ncount) {
+  unsigned int uct_size = sizeof (((struct UnrolledCipherText*)0)->arr);
+  int return_val = 0;
+  uint64_t *queries = NULL;
+  uint64_t *unions = NULL;
+  double *union_estimates = NULL;
+  unsigned char *plain = NULL;
+
+  int num_queries = read_intersection_queries(&queries, query_fn, MAX_INTERSECTION_PARTIES);
+  if (num_queries <= 0) {
+    error_print("ERROR: no intersection queries in %s\n", query_fn);
+    return_val = -1;
+    goto cleanup;
+  }
+  unions = malloc(((size_t)num_queries << MAX_INTERSECTION_ARITY) * sizeof (uint64_t));
+  if (unions == NULL) {
+    error_print("ERROR: could not allocate unions.\n");
+    return_val = -1;
+    goto cleanup;
+  }
+  int num_unions = intersection_unions(unions, queries, num_queries);
+
+  ssize_t size;
+  FILE *fp = fopen(batch_fn, "rb");
+  if (fp) {
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fclose(fp);
+  } else {
+    error_print("ERROR: problems opening %s for reading.\n", batch_fn);
+    return_val = -1;
+    goto cleanup;
+  }
+  if ((size < 0) || (size % ((ssize_t)num_unions*uct_size) != 0)) {
+    error_print("ERROR: %s does not hold %i unions of whole buckets.\n", batch_fn, num_unions);
+    return_val = -1;
+    goto cleanup;
+  }
+  unsigned int total_buckets = (unsigned int)(size / uct_size);
+  unsigned int num_buckets = total_buckets / (unsigned int)num_unions;
+  union_estimates = malloc((size_t)num_unions * sizeof (double));
+  plain = malloc((size_t)total_buckets + 1);
+  if ((union_estimates == NULL) || (plain == NULL)) {
+    error_print("ERROR: could not allocate %u registers.\n", total_buckets);
+    return_val = -1;
+    goto cleanup;
+  }
+  if (decrypt_buckets_with_secs_file(plain, batch_fn, node_fns, ncount, total_buckets) != (int)total_buckets) {
+    return_val = -1;
+    goto cleanup;
+  }
+  for (int u=0; u<num_unions; u++) {
+    union_estimates[u] = estimate_cardinality(&plain[(size_t)u*num_buckets], num_buckets);
+  }
+
+  FILE *out_file = fopen(output_fn, "w");
+  if (!out_file) {
+    error_print("ERROR: could not open %s for writing.\n", output_fn);
+    return_val = -6;
+    goto cleanup;
+  }
+  for (int q=0; q<num_queries; q++) {
+    const char *sep = "";
+    for (int i=0; i<MAX_INTERSECTION_PARTIES; i++) {
+      if ((queries[q] >> i) & 1) {
+        fprintf(out_file, "%s%i", sep, i);
+        sep = " ";
+      }
+    }
+    fprintf(out_file, "\t%.0f\n", inclusion_exclusion(queries[q], unions, union_estimates, num_unions));
+  }
+  fclose(out_file);
+  info_print("INFO: Written %i intersection estimates to %s.\n", num_queries, output_fn);
+
+  cleanup:
+  free(queries);
+  free(unions);
+  free(union_estimates);
+  free(plain);
+  return return_val;
+}
+
+/* Standard HyperLogLog estimator (Flajolet et al. 2007), with the linear
+ * counting correction for small cardinalities. No large range correction
+ * is applied, as the registers are assumed to come from 64-bit hashes.
+ * */
+double estimate_cardinality(const unsigned char *registers, const unsigned int num_buckets) {
+  double m = (double)num_buckets;
+  double alpha;
+  double sum = 0;
+  unsigned int zeros = 0;
+  if (num_buckets == 0) { return 0; }
+  switch (num_buckets) {
+    case 16: alpha = 0.673; break;
+    case 32: alpha = 0.697; break;
+    case 64: alpha = 0.709; break;
+    default: alpha = 0.7213/(1.0 + 1.079/m); break;
+  }
+  for (unsigned int i=0; i<num_buckets; i++) {
+    sum += ldexp(1.0, -(int)registers[i]);
+    if (registers[i] == 0) { zeros++; }
+  }
+  double est = alpha * m * m / sum;
+  if ((est <= 2.5*m) && (zeros > 0)) {
+    est = m * log(m / (double)zeros);
+  }
+  return est;
+}
+
+/* Register-wise max of two plaintext register arrays, stored into a1.
+ *
+ * The union of HyperLogLog sketches is a register-wise max, so shards held
+ * by the same party can be merged here before a single encryption.
+ * Uses SSE2 byte max 16 registers at a time when available.
+ * */
+int merge_registers(unsigned char *a1, const unsigned char *a2, const unsigned int num_buckets) {
+  unsigned int i = 0;
+#ifdef __SSE2__
+  for (; i+16<=num_buckets; i+=16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)&a1[i]);
+    __m128i y = _mm_loadu_si128((const __m128i *)&a2[i]);
+    _mm_storeu_si128((__m128i *)&a1[i], _mm_max_epu8(x, y));
+  }
+#endif
+  for (; i<num_buckets; i++) {
+    if (a2[i] > a1[i]) {
+      a1[i] = a2[i];
+    }
+  }
+  return 0;
+}
+
+int merge_register_files(char *combined_fn, char **fns, const int ncount) {
+  FILE *combined_file = is_std_stream(combined_fn) ? NULL : fopen(combined_fn, "rb");
+  if (combined_file) {
+    error_print("ERROR: %s exists.\nAborting so we don't clobber it.\n", combined_fn);
+    fclose(combined_file);
+    return -2;
+  }
+
+  int return_val = 0;
+  int num_buckets = 0;
+  int tmp;
+  // one extra byte for the 255 delimiter written by read_file_to_array
+  unsigned char *ans = calloc(BUCKET_NUM+1, 1);
+  unsigned char *buffer = calloc(BUCKET_NUM+1, 1);
+  if ((ans == NULL) || (buffer == NULL)) {
+    error_print("ERROR: could not allocate register buffers.\n");
+    return_val = -1;
+    goto cleanup;
+  }
+
+  for (int file_it=0; file_it<ncount; file_it++) {
+    tmp = read_file_to_array(buffer, fns[file_it], BUCKET_NUM);
+    if (tmp < 0) {
+      error_print("ERROR: could not read %s into array.\n", fns[file_it]);
+      return_val = -1;
+      goto cleanup;
+    }
+    if (file_it == 0) {
+      num_buckets = tmp;
+      memcpy(ans, buffer, (size_t)num_buckets);
+    } else if (tmp != num_buckets) {
+      error_print("ERROR: %s has %i registers, expected %i\n", fns[file_it], tmp, num_buckets);
+      return_val = -1;
+      goto cleanup;
+    } else {
+      merge_registers(ans, buffer, (unsigned int)num_buckets);
+    }
+  }
+
+  combined_file = open_output(combined_fn, "w");
+  if (combined_file) {
+    for (int i=0; i<num_buckets; i++) {
+      fprintf(combined_file, "%i\n", ans[i]);
+    }
+    close_output(combined_file);
+    info_print("INFO: Written %d merged registers to %s.\n", num_buckets, combined_fn);
+  } else {
+    error_print("ERROR: could not open %s for writing.\n", combined_fn);
+    return_val = -6;
+    goto cleanup;
+  }
+
+  cleanup:
+  free(ans);
+  free(buffer);
+  return return_val;
+}
+
+static void worker_pool_work(struct WorkerPool *pool) {
+  // Called with pool->lock held, released while running each range
+  while ((pool->next < pool->n) && (pool->return_val == 0)) {
+    unsigned int start = pool->next;
+    unsigned int end = (pool->n - start > pool->grain) ? start + pool->grain : pool->n;
+    pool->next = end;
+    pthread_mutex_unlock(&pool->lock);
+    int r = pool->fn(pool->arg, start, end);
+    pthread_mutex_lock(&pool->lock);
+    if ((r != 0) && (pool->return_val == 0)) {
+      pool->return_val = r;
+    }
+  }
+}
+
+static void *worker_pool_thread(void *p) {
+  struct WorkerPool *pool = p;
+  unsigned long seen = 0;
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while ((!pool->shutdown) && (pool->generation == seen)) {
+      pthread_cond_wait(&pool->work_ready, &pool->lock);
+    }
+    if (pool->shutdown) { break; }
+    seen = pool->generation;
+    worker_pool_work(pool);
+    if (--pool->active == 0) {
+      pthread_cond_signal(&pool->work_done);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+int worker_pool_init(struct WorkerPool *pool, const int num_threads) {
+  memset(pool, 0, sizeof *pool);
+  int n = num_threads;
+  if (n <= 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    n = (cpus > 0) ? (int)cpus : 1;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work_ready, NULL);
+  pthread_cond_init(&pool->work_done, NULL);
+  // The calling thread is one of the n
+  pool->threads = calloc((size_t)n, sizeof (pthread_t));
+  if (pool->threads == NULL) {
+    error_print("ERROR: could not allocate worker pool.\n");
+    return -1;
+  }
+  for (int i=0; i<n-1; i++) {
+    if (pthread_create(&pool->threads[i], NULL, worker_pool_thread, pool) != 0) {
+      error_print("ERROR: could only start %i worker threads.\n", i);
+      break;
+    }
+    pool->num_threads++;
+  }
+  return 0;
+}
+
+int worker_pool_run(struct WorkerPool *pool, worker_fn fn, void *arg, const unsigned int n, const unsigned int grain) {
+  pthread_mutex_lock(&pool->lock);
+  pool->fn = fn;
+  pool->arg = arg;
+  pool->n = n;
+  pool->grain = (grain > 0) ? grain : 1;
+  pool->next = 0;
+  pool->return_val = 0;
+  pool->active = pool->num_threads;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->work_ready);
+  worker_pool_work(pool);
+  while (pool->active > 0) {
+    pthread_cond_wait(&pool->work_done, &pool->lock);
+  }
+  int return_val = pool->return_val;
+  pthread_mutex_unlock(&pool->lock);
+  return return_val;
+}
+
+void worker_pool_free(struct WorkerPool *pool) {
+  if (pool->threads == NULL) { return; }
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = true;
+  pthread_cond_broadcast(&pool->work_ready);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i=0; i<pool->num_threads; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  free(pool->threads);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work_ready);
+  pthread_cond_destroy(&pool->work_done);
+  memset(pool, 0, sizeof *pool);
+}
+
+/* The default pool is started on first use and lives until the process
+ * exits. It is only used by one caller at a time, and anyone who finds it
+ * busy does their work on the calling thread instead. */
+static struct WorkerPool default_pool;
+static pthread_once_t default_pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t default_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool default_pool_ok = false;
+
+static void default_pool_start(void) {
+  default_pool_ok = (worker_pool_init(&default_pool, 0) == 0);
+}
+
+// Runs fn over [0, n) on pool, or on the default pool if pool is NULL
+static int run_on_pool(struct WorkerPool *pool, worker_fn fn, void *arg, const unsigned int n, const unsigned int grain) {
+  if (pool != NULL) {
+    return worker_pool_run(pool, fn, arg, n, grain);
+  }
+  pthread_once(&default_pool_once, default_pool_start);
+  if (default_pool_ok && (pthread_mutex_trylock(&default_pool_lock) == 0)) {
+    int return_val = worker_pool_run(&default_pool, fn, arg, n, grain);
+    pthread_mutex_unlock(&default_pool_lock);
+    return return_val;
+  }
+  return fn(arg, 0, n);
+}
+
+struct ValidateJob {
+  const unsigned char *points;
+  const char *fn;
+  size_t first_point;
+  unsigned int points_per_bucket;
+};
+
+static int validate_range(void *p, const unsigned int start, const unsigned int end) {
+  struct ValidateJob *job = p;
+  for (unsigned int k=start; k<end; k++) {
+    if (crypto_core_ristretto255_is_valid_point(&job->points[(size_t)k*crypto_core_ristretto255_BYTES]) != 1) {
+      size_t point = job->first_point + k;
+      error_print("ERROR: %s: bucket %lu (point %lu) is not a valid point.\n",
+          job->fn, point / job->points_per_bucket, point);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int validate_points(struct WorkerPool *pool, const unsigned char *points, const size_t num_points, const char *fn, const size_t first_point, const unsigned int points_per_bucket) {
+  if (num_points == 0) { return 0; }
+  if (num_points > UINT_MAX) {
+    error_print("ERROR: %s: too many points to validate at once.\n", fn);
+    return -1;
+  }
+  struct ValidateJob job = {points, fn, first_point, (points_per_bucket > 0) ? points_per_bucket : 1};
+  return run_on_pool(pool, validate_range, &job, (unsigned int)num_points, 1024);
+}
+
+int context_init(struct MpcHllContext *ctx, const int num_threads) {
+  memset(ctx, 0, sizeof *ctx);
+  // encode(0) is the identity, and deliberately reports -1
+  for (unsigned int i=1; i<=BUCKET_MAX; i++) {
+    if (encode(&ctx->encode_table[i], i) != 0) { return -1; }
+  }
+  arena_init(&ctx->arena, true);
+  return worker_pool_init(&ctx->pool, num_threads);
+}
+
+int context_load_pubkey(struct MpcHllContext *ctx, const char *fn) {
+  if (read_pubkey(&ctx->pub_key, fn) != 0) { return -1; }
+  ctx->has_pub_key = true;
+  return 0;
+}
+
+int context_load_privkey(struct MpcHllContext *ctx, const char *fn) {
+  if (read_privkey(&ctx->priv_key, fn) != 0) { return -1; }
+  if (priv2pub_ref(&ctx->pub_key, &ctx->priv_key) != 0) { return -1; }
+  ctx->has_priv_key = true;
+  ctx->has_pub_key = true;
+  return 0;
+}
+
+unsigned char *context_scratch(struct MpcHllContext *ctx, const size_t size) {
+  if (size > ctx->scratch_size) {
+    unsigned char *tmp = realloc(ctx->scratch, size);
+    if (tmp == NULL) {
+      error_print("ERROR: could not grow scratch buffer to %lu bytes.\n", size);
+      return NULL;
+    }
+    ctx->scratch = tmp;
+    ctx->scratch_size = size;
+  }
+  return ctx->scratch;
+}
+
+void context_free(struct MpcHllContext *ctx) {
+  worker_pool_free(&ctx->pool);
+  arena_free(&ctx->arena);
+  free(ctx->scratch);
+  sodium_memzero(ctx, sizeof *ctx);
+}
+
+struct ContextJob {
+  struct MpcHllContext *ctx;
+  unsigned char *out;
+  const unsigned char *in;
+  const unsigned char *in2;
+};
+
+static int context_encrypt_range(void *p, const unsigned int start, const unsigned int end) {
+  struct ContextJob *job = p;
+  unsigned int uct_size = sizeof (((struct UnrolledCipherText*)0)->arr);
+  for (unsigned int i=start; i<end; i++) {
+    // UnrolledCipherText only holds unsigned chars, so it has no alignment needs
+    if (unroll_and_encrypt_ref((struct UnrolledCipherText *)&job->out[(size_t)i*uct_size], job->in[i], &job->ctx->pub_key) != 0) {
+      error_print("ERROR: could not encrypt bucket %u\n", i);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int context_encrypt_buckets(struct MpcHllContext *ctx, unsigned char *out, const unsigned char *in, const unsigned int num_buckets) {
+  if (!ctx->has_pub_key) {
+    error_print("ERROR: no public key loaded.\n");
+    return -1;
+  }
+  struct ContextJob job = {ctx, out, in, NULL};
+  if (worker_pool_run(&ctx->pool, context_encrypt_range, &job, num_buckets, 16) != 0) { return -1; }
+  return (int)num_buckets;
+}
+
+// Decrypts slots in order, stopping at the first encryption of zero
+static int context_decrypt_range(void *p, const unsigned int start, const unsigned int end) {
+  struct ContextJob *job = p;
+  const unsigned char *zero = job->ctx->encode_table[0].val;
+  unsigned char s[crypto_core_ristretto255_BYTES];
+  unsigned char m[crypto_core_ristretto255_BYTES];
+  for (unsigned int i=start; i<end; i++) {
+    const unsigned char *c = &job->in[(size_t)i*BUCKET_MAX*2*crypto_core_ristretto255_BYTES];
+    unsigned char x = BUCKET_MAX;
+    for (unsigned int k=0; k<BUCKET_MAX; k++) {
+      const unsigned char *c1 = &c[2*k*crypto_core_ristretto255_BYTES];
+      const unsigned char *c2 = c1 + crypto_core_ristretto255_BYTES;
+      if (job->in2 != NULL) {
+        memcpy(s, &job->in2[((size_t)i*BUCKET_MAX+k)*crypto_core_ristretto255_BYTES], sizeof s);
+      } else if (crypto_scalarmult_ristretto255(s, job->ctx->priv_key.val, c1) != 0) {
+        error_print("ERROR: could not decrypt bucket %u\n", i);
+        return -1;
+      }
+      if (crypto_core_ristretto255_sub(m, c2, s) != 0) {
+        error_print("ERROR: could not decrypt bucket %u\n", i);
+        return -1;
+      }
+      if (memcmp(m, zero, sizeof m) == 0) {
+        x = (unsigned char)k;
+        break;
+      }
+    }
+    job->out[i] = x;
+  }
+  sodium_memzero(s, sizeof s);
+  return 0;
+}
+
+int context_decrypt_buckets(struct MpcHllContext *ctx, unsigned char *plain, const unsigned char *enc, const unsigned int num_buckets) {
+  if (!ctx->has_priv_key) {
+    error_print("ERROR: no private key loaded.\n");
+    return -1;
+  }
+  struct ContextJob job = {ctx, plain, enc, NULL};
+  if (worker_pool_run(&ctx->pool, context_decrypt_range, &job, num_buckets, 16) != 0) { return -1; }
+  return (int)num_buckets;
+}
+
+int context_decrypt_buckets_with_sec(struct MpcHllContext *ctx, unsigned char *plain, const unsigned char *enc, const unsigned char *shared_sec, const unsigned int num_buckets) {
+  struct ContextJob job = {ctx, plain, enc, shared_sec};
+  if (worker_pool_run(&ctx->pool, context_decrypt_range, &job, num_buckets, 64) != 0) { return -1; }
+  return (int)num_buckets;
+}
+
+/* Partial decryption multiplies millions of c1's by the same private key.
+ * crypto_scalarmult_ristretto255 is constant time in the scalar: its
+ * window lookups and conditional moves do not depend on the key's bits,
+ * so ranges of c1's can safely be spread over every thread of a pool. */
+struct PartialJob {
+  unsigned char *shared_sec;
+  const unsigned char *c1s;
+  size_t stride;
+  const struct PrivateKey *key;
+};
+
+static int partial_range(void *p, const unsigned int start, const unsigned int end) {
+  struct PartialJob *job = p;
+  for (unsigned int i=start; i<end; i++) {
+    if (crypto_scalarmult_ristretto255(&job->shared_sec[(size_t)i*crypto_core_ristretto255_BYTES], job->key->val, &job->c1s[(size_t)i*job->stride]) != 0) {
+      error_print("ERROR: could not generate shared secret %u\n", i);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int partial_decryptions(struct WorkerPool *pool, unsigned char *shared_sec, const unsigned char *c1s, const size_t stride, const unsigned int num_ciphertexts, const struct PrivateKey *key) {
+  struct PartialJob job = {shared_sec, c1s, stride, key};
+  return run_on_pool(pool, partial_range, &job, num_ciphertexts, 256);
+}
+
+/* decrypt_buckets and decrypt_buckets_with_sec spread ranges of buckets
+ * over the default pool. Each bucket is decrypted in place in the caller's
+ * arrays and writes only its own byte of plain, so the result is the same
+ * as decrypting them in order. */
+struct DecryptJob {
+  unsigned char *plain;
+  const struct UnrolledCipherText *uct;
+  // Decrypts with key if shared secrets are not given
+  const struct UnrolledSharedSecret *uss;
+  const struct PrivateKey *key;
+};
+
+static int decrypt_range(void *p, const unsigned int start, const unsigned int end) {
+  struct DecryptJob *job = p;
+  for (unsigned int i=start; i<end; i++) {
+    int tmp = (job->uss != NULL) ?
+      decrypt_and_reroll_with_sec_ref(&job->plain[i], &job->uct[i], &job->uss[i]) :
+      decrypt_and_reroll_ref(&job->plain[i], &job->uct[i], job->key);
+    if (tmp != 0) {
+      error_print("ERROR: could not decrypt values\n");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int decrypt_buckets_ref(unsigned char *plain, const unsigned char *enc, const struct PrivateKey *privkey, const unsigned int num_elem) {
+  struct DecryptJob job = {plain, (const struct UnrolledCipherText *)enc, NULL, privkey};
+  if (run_on_pool(NULL, decrypt_range, &job, num_elem, 4) != 0) { return -1; }
+  plain[num_elem] = 0;
+  return (int)num_elem;
+}
+
+int decrypt_buckets_with_sec(unsigned char *plain, const unsigned char *enc, const unsigned char *shared_sec, const unsigned int num_elem) {
+  struct DecryptJob job = {plain, (const struct UnrolledCipherText *)enc, (const struct UnrolledSharedSecret *)shared_sec, NULL};
+  if (run_on_pool(NULL, decrypt_range, &job, num_elem, 64) != 0) { return -1; }
+  plain[num_elem] = 0;
+  return (int)num_elem;
+}
+
+int context_partial_decryptions(struct MpcHllContext *ctx, unsigned char *shared_sec, const unsigned char *enc, const unsigned int num_ciphertexts) {
+  if (!ctx->has_priv_key) {
+    error_print("ERROR: no private key loaded.\n");
+    return -1;
+  }
+  return partial_decryptions(&ctx->pool, shared_sec, enc, 2*crypto_core_ristretto255_BYTES, num_ciphertexts, &ctx->priv_key);
+}
+
+int context_get_partial_decryptions(struct MpcHllContext *ctx, char *input_fn, char *output_fn) {
+  unsigned int cipher_size = 2*crypto_core_ristretto255_BYTES;
+  unsigned int chunk = STREAM_CHUNK_BUCKETS*BUCKET_MAX;
+  int return_val = 0;
+  FILE *out_fp = NULL;
+  FILE *fp = fopen(input_fn, "rb");
+  if (!fp) {
+    error_print("ERROR: could not open %s for reading.\n", input_fn);
+    return -1;
+  }
+  fseek(fp, 0, SEEK_END);
+  ssize_t size = ftell(fp);
+  rewind(fp);
+  if ((size < 0) || (size % cipher_size != 0)) {
+    error_print("ERROR: %s contains %ld bytes, which does not divide %i.\n", input_fn, size, cipher_size);
+    return_val = -1;
+    goto cleanup;
+  }
+  unsigned int num_ciphertexts = (unsigned int)(size / cipher_size);
+  unsigned char *in_array = context_scratch(ctx, (size_t)chunk*(cipher_size + crypto_core_ristretto255_BYTES));
+  if (in_array == NULL) {
+    return_val = -1;
+    goto cleanup;
+  }
+  unsigned char *out_array = &in_array[(size_t)chunk*cipher_size];
+  out_fp = fopen(output_fn, "wb");
+  if (!out_fp) {
+    error_print("ERROR: could not open %s for writing.\n", output_fn);
+    return_val = -6;
+    goto cleanup;
+  }
+  for (unsigned int start=0; start<num_ciphertexts; start+=chunk) {
+    unsigned int n = (num_ciphertexts - start > chunk) ? chunk : num_ciphertexts - start;
+    if (fread(in_array, cipher_size, n, fp) != n) {
+      error_print("ERROR: short read from %s.\n", input_fn);
+      return_val = -1;
+      goto cleanup;
+    }
+    if (validate_points(&ctx->pool, in_array, 2*(size_t)n, input_fn, 2*(size_t)start, 2*BUCKET_MAX) != 0) {
+      return_val = -1;
+      goto cleanup;
+    }
+    if (context_partial_decryptions(ctx, out_array, in_array, n) != 0) {
+      return_val = -1;
+      goto cleanup;
+    }
+    if (fwrite(out_array, crypto_core_ristretto255_BYTES, n, out_fp) != n) {
+      error_print("ERROR: incorrect number of bytes written to %s.\n", output_fn);
+      return_val = -5;
+      goto cleanup;
+    }
+  }
+  info_print("INFO: Written %u shared secrets to %s.\n", num_ciphertexts, output_fn);
+
+  cleanup:
+  fclose(fp);
+  if (out_fp != NULL) {
+    fclose(out_fp);
+  }
+  return return_val;
+}
+
+/* The registers of every sketch in the manifest are read into one array,
+ * so that bucket b of sketch s has the global index offsets[s] + b. The
+ * global array is encrypted a window at a time across the whole pool, and
+ * each window is written out to the sketches it overlaps. A window spans
+ * many small sketches, which keeps every thread busy. */
+#define MANIFEST_WINDOW_BUCKETS (16*STREAM_CHUNK_BUCKETS)
+
+int encrypt_bucket_manifest(char *key_fn, char *manifest_fn, const int num_threads) {
+  unsigned int uct_size = sizeof (((struct UnrolledCipherText*)0)->arr);
+  int return_val = 0;
+  int num_sketches = 0;
+  int capacity = 0;
+  char **fns = NULL;
+  size_t *offsets = NULL;
+  char *line = NULL;
+  size_t len = 0;
+  FILE *out_fp = NULL;
+  struct MpcHllContext ctx;
+  if (context_init(&ctx, num_threads) != 0) {
+    context_free(&ctx);
+    return -1;
+  }
+  FILE *fp = fopen(manifest_fn, "r");
+  if (!fp) {
+    error_print("ERROR: could not open %s for reading.\n", manifest_fn);
+    context_free(&ctx);
+    return -1;
+  }
+  if (context_load_pubkey(&ctx, key_fn) != 0) {
+    return_val = -1;
+    goto cleanup;
+  }
+
+  // Each line is an input register file followed by an output file
+  while (getline(&line, &len, fp) != -1) {
+    char *saveptr = NULL;
+    char *in_fn = strtok_r(line, " \t\r\n", &saveptr);
+    if (in_fn == NULL) { continue; }
+    char *out_fn = strtok_r(NULL, " \t\r\n", &saveptr);
+    if ((out_fn == NULL) || (strtok_r(NULL, " \t\r\n", &saveptr) != NULL)) {
+      error_print("ERROR: line %i of %s is not an input and an output file.\n", num_sketches+1, manifest_fn);
+      return_val = -1;
+      goto cleanup;
+    }
+    if (num_sketches == capacity) {
+      capacity = (capacity > 0) ? 2*capacity : 16;
+      char **tmp = realloc(fns, 2*(size_t)capacity*sizeof (char *));
+      if (tmp == NULL) {
+        error_print("ERROR: could not allocate the manifest.\n");
+        return_val = -1;
+        goto cleanup;
+      }
+      fns = tmp;
+    }
+    fns[2*num_sketches] = strdup(in_fn);
+    fns[2*num_sketches+1] = strdup(out_fn);
+    num_sketches++;
+    if ((fns[2*num_sketches-2] == NULL) || (fns[2*num_sketches-1] == NULL)) {
+      error_print("ERROR: could not allocate the manifest.\n");
+      return_val = -1;
+      goto cleanup;
+    }
+  }
+  if (num_sketches == 0) {
+    error_print("ERROR: %s lists no sketches.\n", manifest_fn);
+    return_val = -1;
+    goto cleanup;
+  }
+
+  // One extra byte for the 255 delimiter written by read_file_to_array
+  offsets = malloc(((size_t)num_sketches+1)*sizeof (size_t));
+  unsigned char *registers = arena_alloc(&ctx.arena, (size_t)num_sketches*BUCKET_NUM+1);
+  if ((offsets == NULL) || (registers == NULL)) {
+    error_print("ERROR: could not allocate registers for %i sketches.\n", num_sketches);
+    return_val = -1;
+    goto cleanup;
+  }
+  offsets[0] = 0;
+  for (int s=0; s<num_sketches; s++) {
+    int tmp = read_file_to_array(&registers[offsets[s]], fns[2*s], BUCKET_NUM);
+    if (tmp < 0) {
+      error_print("ERROR: could not read %s into array.\n", fns[2*s]);
+      return_val = tmp;
+      goto cleanup;
+    }
+    offsets[s+1] = offsets[s] + (size_t)tmp;
+  }
+  size_t total = offsets[num_sketches];
+  info_print("INFO: encrypting %lu buckets from %i sketches.\n", total, num_sketches);
+
+  unsigned char *out_array = context_scratch(&ctx, (size_t)MANIFEST_WINDOW_BUCKETS*uct_size);
+  if (out_array == NULL) {
+    return_val = -1;
+    goto cleanup;
+  }
+  int cur = 0;
+  for (size_t start=0; ; start+=MANIFEST_WINDOW_BUCKETS) {
+    size_t n = (total - start > MANIFEST_WINDOW_BUCKETS) ? MANIFEST_WINDOW_BUCKETS : total - start;
+    if ((n > 0) && (context_encrypt_buckets(&ctx, out_array, &registers[start], (unsigned int)n) < 0)) {
+      error_print("ERROR: could not encrypt buckets %lu to %lu.\n", start, start+n);
+      return_val = -1;
+      goto cleanup;
+    }
+    size_t pos = start;
+    // Empty sketches are finished as soon as they are reached
+    while ((cur < num_sketches) && ((pos < start+n) || (offsets[cur+1] <= pos))) {
+      if (out_fp == NULL) {
+        out_fp = fopen(fns[2*cur+1], "wb");
+        if (!out_fp) {
+          error_print("ERROR: could not open %s for writing.\n", fns[2*cur+1]);
+          return_val = -6;
+          goto cleanup;
+        }
+      }
+      size_t seg_end = (offsets[cur+1] < start+n) ? offsets[cur+1] : start+n;
+      if (seg_end > pos) {
+        size_t seg_bytes = (seg_end - pos)*uct_size;
+        if (fwrite(&out_array[(pos - start)*uct_size], 1, seg_bytes, out_fp) != seg_bytes) {
+          error_print("ERROR: incorrect number of bytes written to %s.\n", fns[2*cur+1]);
+          return_val = -5;
+          goto cleanup;
+        }
+        pos = seg_end;
+      }
+      if (offsets[cur+1] <= pos) {
+        fclose(out_fp);
+        out_fp = NULL;
+        info_print("INFO: Written %lu bytes to %s.\n", (offsets[cur+1] - offsets[cur])*uct_size, fns[2*cur+1]);
+        cur++;
+      }
+    }
+    if (start+n >= total) { break; }
+  }
+
+  cleanup:
+  fclose(fp);
+  if (out_fp != NULL) { fclose(out_fp); }
+  for (int i=0; i<2*num_sketches; i++) { free(fns[i]); }
+  free(fns);
+  free(offsets);
+  free(line);
+  context_free(&ctx);
+  return return_val;
+}
+
+/* Rerandomization adds a fresh encryption of zero, (r*G, r*Y), to every
+ * CipherText. r*G uses libsodium's precomputed table for the base point.
+ * Blinding multiplies both halves of every CipherText by a fresh random
+ * scalar z, which keeps encryptions of zero as they are and turns any other
+ * plaintext m into the unrelated z*m. When both are asked for, each
+ * CipherText is blinded and then rerandomized while it is in cache.
+ *
+ * The randomness for a whole batch is drawn with one randombytes_buf call
+ * and reduced to scalars, and the CipherTexts are updated in place. */
+#define RERANDOMIZE_GRAIN 64
+
+struct RerandomizeJob {
+  unsigned char *enc;
+  const struct PublicKey *pub;
+  bool blind;
+};
+
+static int rerandomize_range(void *p, const unsigned int start, const unsigned int end) {
+  struct RerandomizeJob *job = p;
+  // Room for a blinding scalar and a rerandomizing one per CipherText
+  unsigned char wide[2*RERANDOMIZE_GRAIN][crypto_core_ristretto255_NONREDUCEDSCALARBYTES];
+  unsigned char r[crypto_core_ristretto255_SCALARBYTES];
+  unsigned char t[crypto_core_ristretto255_BYTES];
+  unsigned int per_ct = (job->blind ? 1u : 0u) + ((job->pub != NULL) ? 1u : 0u);
+  int return_val = 0;
+  for (unsigned int batch=start; batch<end; batch+=RERANDOMIZE_GRAIN) {
+    unsigned int n = (end - batch > RERANDOMIZE_GRAIN) ? RERANDOMIZE_GRAIN : end - batch;
+    randombytes_buf(wide, (size_t)n*per_ct*sizeof wide[0]);
+    unsigned char (*next)[crypto_core_ristretto255_NONREDUCEDSCALARBYTES] = wide;
+    for (unsigned int k=0; k<n; k++) {
+      unsigned char *c1 = &job->enc[(size_t)(batch+k)*2*crypto_core_ristretto255_BYTES];
+      unsigned char *c2 = c1 + crypto_core_ristretto255_BYTES;
+      if (job->blind) {
+        crypto_core_ristretto255_scalar_reduce(r, *next++);
+        if ((crypto_scalarmult_ristretto255(c1, r, c1) != 0) ||
+            (crypto_scalarmult_ristretto255(c2, r, c2) != 0)) {
+          error_print("ERROR: could not blind CipherText %u\n", batch+k);
+          return_val = -1;
+          goto cleanup;
+        }
+      }
+      if (job->pub != NULL) {
+        crypto_core_ristretto255_scalar_reduce(r, *next++);
+        if ((crypto_scalarmult_ristretto255_base(t, r) != 0) ||
+            (crypto_core_ristretto255_add(c1, c1, t) != 0) ||
+            (crypto_scalarmult_ristretto255(t, r, job->pub->val) != 0) ||
+            (crypto_core_ristretto255_add(c2, c2, t) != 0)) {
+          error_print("ERROR: could not rerandomize CipherText %u\n", batch+k);
+          return_val = -1;
+          goto cleanup;
+        }
+      }
+    }
+  }
+
+  cleanup:
+  sodium_memzero(wide, sizeof wide);
+  sodium_memzero(r, sizeof r);
+  return return_val;
+}
+
+int rerandomize_ciphertexts(struct WorkerPool *pool, unsigned char *enc, const unsigned int num_ciphertexts, const struct PublicKey *pub) {
+  struct RerandomizeJob job = {enc, pub, false};
+  return run_on_pool(pool, rerandomize_range, &job, num_ciphertexts, RERANDOMIZE_GRAIN);
+}
+
+int blind_ciphertexts(struct WorkerPool *pool, unsigned char *enc, const unsigned int num_ciphertexts, const struct PublicKey *pub) {
+  struct RerandomizeJob job = {enc, pub, true};
+  return run_on_pool(pool, rerandomize_range, &job, num_ciphertexts, RERANDOMIZE_GRAIN);
+}
+
+int rerandomize_CipherText_file(char *key_fn, char *input_fn, char *output_fn, const bool blind) {
+  return rerandomize_CipherText_file_range(key_fn, input_fn, output_fn, blind, ALL_BUCKETS);
+}
+
+/* Bucket streams
+ *
+ * Ciphertext, shared secret and register arrays all hold a fixed-size
+ * record per bucket, so a range of buckets can be read by seeking straight
+ * to it, and the shards written for consecutive ranges concatenate into
+ * the output for the whole range. stream_buckets reads every input a chunk
+ * of buckets at a time, validates the points in it, hands the chunk to a
+ * kernel and writes out what the kernel produced.
+ * */
+struct BucketInput {
+  char *fn;
+  // Registers already in memory, used instead of fn
+  const unsigned char *mem;
+  // Bytes per bucket read from this input, starting at offset
+  size_t bucket_bytes;
+  long offset;
+  // Bytes per bucket in the whole file, when it holds more than this input
+  // (the c1 and c2 halves of SoA files), or 0
+  size_t file_bucket_bytes;
+  bool points;
+  // The file only holds the buckets in the range, as written for it
+  bool range_only;
+};
+
+typedef int (*bucket_kernel)(void *arg, unsigned char *out, unsigned char **in, const unsigned int first_bucket, const unsigned int num_buckets);
+
+struct BucketStream {
+  struct BucketInput *inputs;
+  int num_inputs;
+  // Number of buckets in memory inputs
+  unsigned int mem_buckets;
+  // Output file, or NULL to write into out_mem, or nowhere if that is NULL
+  char *output_fn;
+  unsigned char *out_mem;
+  // Registers are written out as newline delimited text
+  size_t out_bucket_bytes;
+  bool text_output;
+  bool no_clobber;
+  bucket_kernel kernel;
+  void *arg;
+};
+
+/* The reads, the kernel and the writes of a stream overlap: the chunk
+ * after the one being processed is read and the one before it written
+ * out, each through its own slot, so a stream never holds more than
+ * STREAM_SLOTS chunks and takes about as long as the slowest of the three.
+ * The reads and writes are queued to io_uring where it is available, and
+ * run on a reader and a writer thread otherwise. */
+#define STREAM_SLOTS 3
+
+enum SlotState { SLOT_FREE, SLOT_READ, SLOT_DONE };
+
+struct StreamSlot {
+  unsigned char **in;
+  unsigned char *out;
+  unsigned int start;
+  unsigned int num_buckets;
+  // No chunks follow this one
+  bool last;
+  enum SlotState state;
+};
+
+struct StreamPipe {
+  const struct BucketStream *s;
+  FILE **fps;
+  FILE *out_fp;
+  unsigned int start;
+  // BUCKET_RANGE_END until the end of an input read from stdin is found
+  unsigned int end;
+  struct StreamSlot slots[STREAM_SLOTS];
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  // The first error stops every stage
+  int error;
+};
+
+// Returns once slot is in state, or the pipe has failed
+static int stream_wait(struct StreamPipe *pipe, struct StreamSlot *slot, const enum SlotState state) {
+  pthread_mutex_lock(&pipe->lock);
+  while ((slot->state != state) && (pipe->error == 0)) {
+    pthread_cond_wait(&pipe->cond, &pipe->lock);
+  }
+  int return_val = pipe->error;
+  pthread_mutex_unlock(&pipe->lock);
+  return return_val;
+}
+
+static void stream_set(struct StreamPipe *pipe, struct StreamSlot *slot, const enum SlotState state) {
+  pthread_mutex_lock(&pipe->lock);
+  slot->state = state;
+  pthread_cond_broadcast(&pipe->cond);
+  pthread_mutex_unlock(&pipe->lock);
+}
+
+static void stream_fail(struct StreamPipe *pipe, const int error) {
+  pthread_mutex_lock(&pipe->lock);
+  if (pipe->error == 0) { pipe->error = error; }
+  pthread_cond_broadcast(&pipe->cond);
+  pthread_mutex_unlock(&pipe->lock);
+}
+
+// Reads from a file, or from stdin, which cannot seek and so is read up to
+// the first bucket of the range and then only as far as it goes
+static void *stream_reader(void *p) {
+  struct StreamPipe *pipe = p;
+  const struct BucketStream *s = pipe->s;
+  for (int i=0; i<s->num_inputs; i++) {
+    const struct BucketInput *x = &s->inputs[i];
+    for (unsigned int b=0; (pipe->fps[i] == stdin) && !x->range_only && (b<pipe->start); b+=STREAM_CHUNK_BUCKETS) {
+      unsigned int nb = (pipe->start - b > STREAM_CHUNK_BUCKETS) ? STREAM_CHUNK_BUCKETS : pipe->start - b;
+      if (fread(pipe->slots[0].in[i], x->bucket_bytes, nb, stdin) != nb) {
+        error_print("ERROR: stdin ends before bucket %u.\n", pipe->start);
+        stream_fail(pipe, -1);
+        return NULL;
+      }
+    }
+  }
+  unsigned int start = pipe->start;
+  bool last = false;
+  for (unsigned int k=0; !last; k++) {
+    struct StreamSlot *slot = &pipe->slots[k % STREAM_SLOTS];
+    if (stream_wait(pipe, slot, SLOT_FREE) != 0) { break; }
+    unsigned int want = (pipe->end - start > STREAM_CHUNK_BUCKETS) ? STREAM_CHUNK_BUCKETS : pipe->end - start;
+    unsigned int nb = want;
+    for (int i=0; i<s->num_inputs; i++) {
+      const struct BucketInput *x = &s->inputs[i];
+      unsigned int got = want;
+      if (x->mem != NULL) {
+        memcpy(slot->in[i], &x->mem[(size_t)start*x->bucket_bytes], (size_t)want*x->bucket_bytes);
+      } else {
+        size_t bytes = fread(slot->in[i], 1, (size_t)want*x->bucket_bytes, pipe->fps[i]);
+        if ((bytes % x->bucket_bytes != 0) || ferror(pipe->fps[i])) {
+          error_print("ERROR: %s ends partway through a bucket, or could not be read.\n", is_std_stream(x->fn) ? "stdin" : x->fn);
+          stream_fail(pipe, -1);
+          return NULL;
+        }
+        got = (unsigned int)(bytes / x->bucket_bytes);
+      }
+      if ((i > 0) && (got != nb)) {
+        error_print("ERROR: the inputs hold different numbers of buckets, %s ends first.\n", (got < nb) ? (is_std_stream(x->fn) ? "stdin" : x->fn) : "stdin");
+        stream_fail(pipe, -1);
+        return NULL;
+      }
+      nb = got;
+    }
+    slot->start = start;
+    slot->num_buckets = nb;
+    start += nb;
+    last = (nb < want) || (start == pipe->end);
+    slot->last = last;
+    if (last) { pipe->end = start; }
+    stream_set(pipe, slot, SLOT_READ);
+  }
+  return NULL;
+}
+
+static void *stream_writer(void *p) {
+  struct StreamPipe *pipe = p;
+  const struct BucketStream *s = pipe->s;
+  bool last = false;
+  for (unsigned int k=0; !last; k++) {
+    struct StreamSlot *slot = &pipe->slots[k % STREAM_SLOTS];
+    if (stream_wait(pipe, slot, SLOT_DONE) != 0) { break; }
+    if (s->output_fn == NULL) {
+      if (s->out_mem != NULL) {
+        memcpy(&s->out_mem[(size_t)(slot->start - pipe->start)*s->out_bucket_bytes], slot->out, (size_t)slot->num_buckets*s->out_bucket_bytes);
+      }
+    } else if (s->text_output) {
+      for (unsigned int j=0; j<slot->num_buckets; j++) {
+        fprintf(pipe->out_fp, "%i\n", slot->out[j]);
+      }
+    } else if (fwrite(slot->out, s->out_bucket_bytes, slot->num_buckets, pipe->out_fp) != slot->num_buckets) {
+      error_print("ERROR: incorrect number of bytes written to %s.\n", s->output_fn);
+      stream_fail(pipe, -5);
+      break;
+    }
+    last = slot->last;
+    stream_set(pipe, slot, SLOT_FREE);
+  }
+  return NULL;
+}
+
+// Validates the points of the chunk in slot and runs the kernel on it.
+// Returns 0, or the error that stops the stream
+static int stream_process(const struct BucketStream *s, struct StreamSlot *slot) {
+  unsigned int start = slot->start;
+  unsigned int nb = slot->num_buckets;
+  for (int i=0; (nb > 0) && (i<s->num_inputs); i++) {
+    const struct BucketInput *x = &s->inputs[i];
+    size_t ppb = x->bucket_bytes / crypto_core_ristretto255_BYTES;
+    if (x->points && (validate_points(NULL, slot->in[i], (size_t)nb*ppb, x->fn, (size_t)start*ppb, (unsigned int)ppb) != 0)) {
+      return -1;
+    }
+  }
+  int kernel_val = (nb > 0) ? s->kernel(s->arg, slot->out, slot->in, start, nb) : 0;
+  if (kernel_val != 0) {
+    error_print("ERROR: could not process buckets %u to %u.\n", start, start+nb);
+    // A kernel's own error code, such as -3 for invalid input, is kept
+    return (kernel_val < 0) ? kernel_val : -1;
+  }
+  return 0;
+}
+
+// Runs the stream on a reader, a writer and the calling thread
+static void stream_with_threads(struct StreamPipe *pipe) {
+  pthread_t reader, writer;
+  pthread_mutex_init(&pipe->lock, NULL);
+  pthread_cond_init(&pipe->cond, NULL);
+  if (pthread_create(&reader, NULL, stream_reader, pipe) != 0) {
+    error_print("ERROR: could not start the reader thread.\n");
+    pipe->error = -1;
+    goto cleanup;
+  }
+  if (pthread_create(&writer, NULL, stream_writer, pipe) != 0) {
+    error_print("ERROR: could not start the writer thread.\n");
+    stream_fail(pipe, -1);
+    pthread_join(reader, NULL);
+    goto cleanup;
+  }
+  bool last = false;
+  for (unsigned int k=0; !last; k++) {
+    struct StreamSlot *slot = &pipe->slots[k % STREAM_SLOTS];
+    if (stream_wait(pipe, slot, SLOT_READ) != 0) { break; }
+    int tmp = stream_process(pipe->s, slot);
+    if (tmp != 0) {
+      stream_fail(pipe, tmp);
+      break;
+    }
+    last = slot->last;
+    stream_set(pipe, slot, SLOT_DONE);
+  }
+  pthread_join(reader, NULL);
+  pthread_join(writer, NULL);
+
+  cleanup:
+  pthread_cond_destroy(&pipe->cond);
+  pthread_mutex_destroy(&pipe->lock);
+}
+
+static bool stream_io_uring = true;
+static unsigned long stream_ring_runs = 0;
+
+/* With io_uring the calling thread runs a stream by itself. It queues the
+ * reads of the next chunks and the write of the chunk it has processed,
+ * which the kernel carries out while it processes the current chunk, and
+ * only waits when the chunk it needs next is not read yet or its slot is
+ * still being written. stdin, stdout and text output always use the
+ * threads, as they cannot be read or written at an offset, and so does
+ * everything when uring_init fails. */
+struct RingRequest {
+  unsigned char *buf;
+  unsigned int len;
+  uint64_t off;
+  int fd;
+};
+
+struct StreamRing {
+  struct Uring ring;
+  // Request i of slot j is reqs[j*per_slot + i], with the reads of the
+  // inputs first and the write last
+  struct RingRequest *reqs;
+  unsigned int per_slot;
+  // Requests of each slot that are not complete
+  unsigned int pending[STREAM_SLOTS];
+  unsigned int inflight;
+  // Offsets of the first bucket of the range in each input, and the output
+  int *fds;
+  uint64_t *bases;
+  int out_fd;
+  uint64_t out_base;
+};
+
+static void ring_fail(struct StreamPipe *pipe, const int error) {
+  if (pipe->error == 0) { pipe->error = error; }
+}
+
+static void ring_submit(struct StreamRing *sr, const unsigned int id, const bool write) {
+  struct RingRequest *q = &sr->reqs[id];
+  if (write) {
+    uring_queue_write(&sr->ring, q->fd, q->buf, q->len, q->off, id);
+  } else {
+    uring_queue_read(&sr->ring, q->fd, q->buf, q->len, q->off, id);
+  }
+  sr->inflight++;
+}
+
+static void ring_complete(struct StreamPipe *pipe, struct StreamRing *sr, const struct UringCompletion *c) {
+  unsigned int id = (unsigned int)c->user_data;
+  struct RingRequest *q = &sr->reqs[id];
+  int i = (int)(id % sr->per_slot);
+  bool write = (i == pipe->s->num_inputs);
+  sr->inflight--;
+  if ((c->res > 0) && ((unsigned int)c->res < q->len) && (pipe->error == 0)) {
+    // Finish a short read or write where it stopped
+    q->buf += c->res;
+    q->off += (uint64_t)c->res;
+    q->len -= (unsigned int)c->res;
+    ring_submit(sr, id, write);
+    return;
+  }
+  if (write && (c->res <= 0)) {
+    error_print("ERROR: incorrect number of bytes written to %s.\n", pipe->s->output_fn);
+    ring_fail(pipe, -5);
+  } else if (c->res <= 0) {
+    error_print("ERROR: %s ends partway through a bucket, or could not be read.\n", pipe->s->inputs[i].fn);
+    ring_fail(pipe, -1);
+  }
+  sr->pending[id / sr->per_slot]--;
+}
+
+// Queues the reads of chunk j of the stream into its slot
+static void ring_read(struct StreamPipe *pipe, struct StreamRing *sr, const unsigned int j) {
+  const struct BucketStream *s = pipe->s;
+  unsigned int k = j % STREAM_SLOTS;
+  struct StreamSlot *slot = &pipe->slots[k];
+  slot->start = pipe->start + j*STREAM_CHUNK_BUCKETS;
+  slot->num_buckets = (pipe->end - slot->start > STREAM_CHUNK_BUCKETS) ? STREAM_CHUNK_BUCKETS : pipe->end - slot->start;
+  slot->last = (slot->start + slot->num_buckets == pipe->end);
+  for (int i=0; i<s->num_inputs; i++) {
+    const struct BucketInput *x = &s->inputs[i];
+    if (x->mem != NULL) {
+      memcpy(slot->in[i], &x->mem[(size_t)slot->start*x->bucket_bytes], (size_t)slot->num_buckets*x->bucket_bytes);
+      continue;
+    }
+    unsigned int id = k*sr->per_slot + (unsigned int)i;
+    struct RingRequest *q = &sr->reqs[id];
+    q->buf = slot->in[i];
+    q->len = (unsigned int)(slot->num_buckets*x->bucket_bytes);
+    q->off = sr->bases[i] + (uint64_t)(slot->start - pipe->start)*x->bucket_bytes;
+    q->fd = sr->fds[i];
+    ring_submit(sr, id, false);
+    sr->pending[k]++;
+  }
+}
+
+// Queues the write of the processed chunk in slot k
+static void ring_write(struct StreamPipe *pipe, struct StreamRing *sr, const unsigned int k) {
+  const struct BucketStream *s = pipe->s;
+  struct StreamSlot *slot = &pipe->slots[k];
+  size_t bytes = (size_t)slot->num_buckets*s->out_bucket_bytes;
+  if (s->output_fn == NULL) {
+    if (s->out_mem != NULL) {
+      memcpy(&s->out_mem[(size_t)(slot->start - pipe->start)*s->out_bucket_bytes], slot->out, bytes);
+    }
+    return;
+  }
+  unsigned int id = k*sr->per_slot + (unsigned int)s->num_inputs;
+  struct RingRequest *q = &sr->reqs[id];
+  q->buf = slot->out;
+  q->len = (unsigned int)bytes;
+  q->off = sr->out_base + (uint64_t)(slot->start - pipe->start)*s->out_bucket_bytes;
+  q->fd = sr->out_fd;
+  ring_submit(sr, id, true);
+  sr->pending[k]++;
+}
+
+// Submits what is queued, waits for a completion if wait is set, and
+// handles every completion there is
+static int ring_progress(struct StreamPipe *pipe, struct StreamRing *sr, const bool wait) {
+  int return_val = uring_enter(&sr->ring, wait);
+  if (return_val != 0) {
+    error_print("ERROR: io_uring_enter failed.\n");
+    ring_fail(pipe, -1);
+  }
+  struct UringCompletion c;
+  while (uring_reap(&sr->ring, &c)) {
+    ring_complete(pipe, sr, &c);
+  }
+  return return_val;
+}
+
+// Runs the stream with io_uring if it can, and returns false to leave it
+// to stream_with_threads otherwise
+static bool stream_with_ring(struct StreamPipe *pipe) {
+  const struct BucketStream *s = pipe->s;
+  bool ok = stream_io_uring && (STREAM_SLOTS*((size_t)s->num_inputs+1) <= 4096) &&
+    ((s->output_fn == NULL) || (!s->text_output && (pipe->out_fp != stdout)));
+  for (int i=0; ok && (i<s->num_inputs); i++) {
+    ok = (s->inputs[i].mem != NULL) || (pipe->fps[i] != stdin);
+  }
+  struct StreamRing sr;
+  memset(&sr, 0, sizeof sr);
+  sr.per_slot = (unsigned int)s->num_inputs + 1;
+  if (!ok || (uring_init(&sr.ring, STREAM_SLOTS*sr.per_slot) != 0)) { return false; }
+  sr.reqs = calloc((size_t)STREAM_SLOTS*sr.per_slot, sizeof (struct RingRequest));
+  sr.fds = calloc((size_t)s->num_inputs, sizeof (int));
+  sr.bases = calloc((size_t)s->num_inputs, sizeof (uint64_t));
+  ok = (sr.reqs != NULL) && (sr.fds != NULL) && (sr.bases != NULL);
+  for (int i=0; ok && (i<s->num_inputs); i++) {
+    if (s->inputs[i].mem != NULL) { continue; }
+    long pos = ftell(pipe->fps[i]);
+    sr.fds[i] = fileno(pipe->fps[i]);
+    sr.bases[i] = (uint64_t)pos;
+    ok = (pos >= 0);
+  }
+  if (ok && (pipe->out_fp != NULL)) {
+    long pos = ftell(pipe->out_fp);
+    sr.out_fd = fileno(pipe->out_fp);
+    sr.out_base = (uint64_t)pos;
+    ok = (pos >= 0);
+  }
+  if (!ok) {
+    free(sr.reqs);
+    free(sr.fds);
+    free(sr.bases);
+    uring_free(&sr.ring);
+    return false;
+  }
+
+  unsigned int num_chunks = (pipe->end - pipe->start + STREAM_CHUNK_BUCKETS - 1) / STREAM_CHUNK_BUCKETS;
+  unsigned int next = 0;
+  for (unsigned int j=0; (j<num_chunks) && (pipe->error == 0); j++) {
+    unsigned int k = j % STREAM_SLOTS;
+    for (;;) {
+      // Read ahead into every slot that has been written out
+      while ((next < num_chunks) && (next < j + STREAM_SLOTS) && (sr.pending[next % STREAM_SLOTS] == 0) && (pipe->error == 0)) {
+        ring_read(pipe, &sr, next++);
+      }
+      bool ready = (next > j) && (sr.pending[k] == 0);
+      ring_progress(pipe, &sr, !ready);
+      if (ready || (pipe->error != 0)) { break; }
+    }
+    if (pipe->error != 0) { break; }
+    int tmp = stream_process(s, &pipe->slots[k]);
+    if (tmp != 0) {
+      ring_fail(pipe, tmp);
+      break;
+    }
+    ring_write(pipe, &sr, k);
+  }
+  // The buffers must outlive every request, even after an error
+  while ((sr.inflight > 0) && (ring_progress(pipe, &sr, true) == 0)) {}
+  free(sr.reqs);
+  free(sr.fds);
+  free(sr.bases);
+  uring_free(&sr.ring);
+  __atomic_fetch_add(&stream_ring_runs, 1, __ATOMIC_RELAXED);
+  return true;
+}
+
+bool stream_use_io_uring(const bool enable) {
+  stream_io_uring = enable;
+  struct Uring r;
+  if (!enable || (uring_init(&r, 1) != 0)) { return false; }
+  uring_free(&r);
+  return true;
+}
+
+unsigned long stream_io_uring_runs(void) {
+  return __atomic_load_n(&stream_ring_runs, __ATOMIC_RELAXED);
+}
+
+static int stream_buckets(const struct BucketStream *s, const struct BucketRange range, unsigned int *num_written) {
+  int return_val = 0;
+  struct StreamPipe pipe;
+  memset(&pipe, 0, sizeof pipe);
+  pipe.s = s;
+  pipe.fps = calloc((size_t)s->num_inputs, sizeof (FILE *));
+  bool allocated = (pipe.fps != NULL);
+  for (int k=0; k<STREAM_SLOTS; k++) {
+    pipe.slots[k].in = calloc((size_t)s->num_inputs, sizeof (unsigned char *));
+    pipe.slots[k].out = malloc((size_t)STREAM_CHUNK_BUCKETS*s->out_bucket_bytes + 1);
+    allocated = allocated && (pipe.slots[k].in != NULL) && (pipe.slots[k].out != NULL);
+    for (int i=0; allocated && (i<s->num_inputs); i++) {
+      pipe.slots[k].in[i] = malloc((size_t)STREAM_CHUNK_BUCKETS*s->inputs[i].bucket_bytes);
+      allocated = (pipe.slots[k].in[i] != NULL);
+    }
+  }
+  if (!allocated) {
+    error_print("ERROR: could not allocate stream buffers.\n");
+    return_val = -1;
+    goto cleanup;
+  }
+
+  // Every input must hold the same number of buckets. Inputs from stdin are
+  // checked as they are read instead
+  unsigned int num_buckets = BUCKET_RANGE_END;
+  bool have_count = false;
+  int num_std = 0;
+  for (int i=0; i<s->num_inputs; i++) {
+    const struct BucketInput *x = &s->inputs[i];
+    unsigned int nb = s->mem_buckets;
+    if ((x->mem == NULL) && is_std_stream(x->fn)) {
+      if ((++num_std > 1) || (x->offset != 0) || (x->file_bucket_bytes != 0)) {
+        error_print("ERROR: only one whole input can be read from stdin.\n");
+        return_val = -1;
+        goto cleanup;
+      }
+      continue;
+    } else if (x->mem == NULL) {
+      size_t per_bucket = (x->file_bucket_bytes > 0) ? x->file_bucket_bytes : x->bucket_bytes;
+      ssize_t size = file_size(x->fn);
+      if ((size >= 0) && (x->file_bucket_bytes == 0)) {
+        // The offset of a plain input is a header, and holds no buckets
+        size = (size > x->offset) ? size - x->offset : 0;
+      }
+      if (size < 0) {
+        return_val = -1;
+        goto cleanup;
+      } else if (((size_t)size % per_bucket != 0) || ((size_t)size / per_bucket > UINT_MAX)) {
+        error_print("ERROR: %s contains %ld bytes, which is not a whole number of %lu byte buckets.\n", x->fn, size, per_bucket);
+        return_val = -1;
+        goto cleanup;
+      }
+      nb = (unsigned int)((size_t)size / per_bucket);
+    }
+    if (x->range_only) {
+      continue;
+    } else if (have_count && (nb != num_buckets)) {
+      error_print("ERROR: %s holds %u buckets, expected %u.\n", (x->fn != NULL) ? x->fn : "input", nb, num_buckets);
+      return_val = -1;
+      goto cleanup;
+    }
+    num_buckets = nb;
+    have_count = true;
+  }
+  pipe.start = range.start;
+  pipe.end = (range.end < num_buckets) ? range.end : num_buckets;
+  if (pipe.start > pipe.end) {
+    error_print("ERROR: bucket range %u:%u is outside of the %u buckets.\n", range.start, range.end, num_buckets);
+    return_val = -1;
+    goto cleanup;
+  }
+  for (int i=0; i<s->num_inputs; i++) {
+    const struct BucketInput *x = &s->inputs[i];
+    ssize_t size = (x->range_only && !is_std_stream(x->fn)) ? file_size(x->fn) : -1;
+    if ((size >= 0) && ((size_t)size != (size_t)(pipe.end - pipe.start)*x->bucket_bytes)) {
+      error_print("ERROR: %s holds %ld bytes, expected %lu for buckets %u to %u.\n", x->fn, size, (unsigned long)(pipe.end - pipe.start)*x->bucket_bytes, pipe.start, pipe.end);
+      return_val = -1;
+      goto cleanup;
+    }
+  }
+
+  if (s->no_clobber && (s->output_fn != NULL) && !is_std_stream(s->output_fn)) {
+    FILE *exists = fopen(s->output_fn, "rb");
+    if (exists) {
+      error_print("ERROR: %s exists.\nAborting so we don't clobber it.\n", s->output_fn);
+      fclose(exists);
+      return_val = -2;
+      goto cleanup;
+    }
+  }
+  for (int i=0; i<s->num_inputs; i++) {
+    const struct BucketInput *x = &s->inputs[i];
+    if (x->mem != NULL) { continue; }
+    if (is_std_stream(x->fn)) {
+      pipe.fps[i] = stdin;
+      continue;
+    }
+    pipe.fps[i] = fopen(x->fn, "rb");
+    if (!pipe.fps[i]) {
+      error_print("ERROR: could not open %s for reading.\n", x->fn);
+      return_val = -1;
+      goto cleanup;
+    }
+    size_t skip = x->range_only ? 0 : (size_t)pipe.start*x->bucket_bytes;
+    if (fseek(pipe.fps[i], x->offset + (long)skip, SEEK_SET) != 0) {
+      error_print("ERROR: could not seek to bucket %u of %s.\n", pipe.start, x->fn);
+      return_val = -1;
+      goto cleanup;
+    }
+  }
+  pipe.out_fp = (s->output_fn == NULL) ? NULL : open_output(s->output_fn, s->text_output ? "w" : "wb");
+  if ((s->output_fn != NULL) && !pipe.out_fp) {
+    error_print("ERROR: could not open %s for writing.\n", s->output_fn);
+    return_val = -6;
+    goto cleanup;
+  }
+
+  if (!stream_with_ring(&pipe)) {
+    stream_with_threads(&pipe);
+  }
+  return_val = pipe.error;
+  if ((return_val == 0) && (num_written != NULL)) {
+    *num_written = pipe.end - pipe.start;
+  }
+  if ((return_val == 0) && (s->output_fn != NULL)) {
+    info_print("INFO: Written buckets %u to %u to %s.\n", pipe.start, pipe.end, s->output_fn);
+  }
+
+  cleanup:
+  if (pipe.out_fp != NULL) {
+    if ((close_output(pipe.out_fp) != 0) && (return_val == 0)) {
+      error_print("ERROR: could not finish writing %s.\n", s->output_fn);
+      return_val = -5;
+    }
+  }
+  for (int i=0; (pipe.fps != NULL) && (i<s->num_inputs); i++) {
+    if ((pipe.fps[i] != NULL) && (pipe.fps[i] != stdin)) { fclose(pipe.fps[i]); }
+  }
+  free(pipe.fps);
+  for (int j=0; j<STREAM_SLOTS; j++) {
+    for (int i=0; (pipe.slots[j].in != NULL) && (i<s->num_inputs); i++) {
+      free(pipe.slots[j].in[i]);
+    }
+    free(pipe.slots[j].in);
+    free(pipe.slots[j].out);
+  }
+  return return_val;
+}
+
+int parse_bucket_range(struct BucketRange *r, const char *arg) {
+  char *end;
+  r->start = 0;
+  r->end = BUCKET_RANGE_END;
+  unsigned long start = strtoul(arg, &end, 10);
+  if ((end == arg) || (*end != ':') || (start >= BUCKET_RANGE_END)) {
+    error_print("ERROR: %s is not a bucket range start:end.\n", arg);
+    return -1;
+  }
+  const char *end_arg = end + 1;
+  unsigned long stop = BUCKET_RANGE_END;
+  if (*end_arg != '\0') {
+    stop = strtoul(end_arg, &end, 10);
+    if ((*end != '\0') || (stop < start) || (stop > BUCKET_RANGE_END)) {
+      error_print("ERROR: %s is not a bucket range start:end.\n", arg);
+      return -1;
+    }
+  }
+  r->start = (unsigned int)start;
+  r->end = (unsigned int)stop;
+  return 0;
+}
+
+int take_option(char **value, const char *name, int *argc, char *argv[]) {
+  for (int i=1; i<*argc; i++) {
+    if (strcmp(argv[i], name) != 0) { continue; }
+    if (i+1 >= *argc) {
+      error_print("ERROR: %s needs a value.\n", name);
+      return -1;
+    }
+    *value = argv[i+1];
+    // Shifts the NULL at argv[argc] down too
+    memmove(&argv[i], &argv[i+2], (size_t)(*argc-i-1)*sizeof (char *));
+    *argc -= 2;
+    return 1;
+  }
+  return 0;
+}
+
+int take_range_option(struct BucketRange *r, int *argc, char *argv[]) {
+  r->start = 0;
+  r->end = BUCKET_RANGE_END;
+  char *value;
+  int found = take_option(&value, "--range", argc, argv);
+  if (found == 0) {
+    found = take_option(&value, "-range", argc, argv);
+  }
+  if ((found > 0) && (parse_bucket_range(r, value) != 0)) {
+    error_print("ERROR: --range needs a bucket range start:end.\n");
+    return -1;
+  }
+  return found;
+}
+
+static const struct BucketInput ciphertext_input = {NULL, NULL, BUCKET_MAX*2*crypto_core_ristretto255_BYTES, 0, 0, true, false};
+static const struct BucketInput secret_input = {NULL, NULL, BUCKET_MAX*crypto_core_ristretto255_BYTES, 0, 0, true, false};
+
+/* Proofs of partial decryption
+ *
+ * A node proves that its shared secrets are x*c1 for the x behind its
+ * public key X with a single Chaum-Pedersen proof per file, over the
+ * random linear combinations C = sum z_k c1_k and S = sum z_k ss_k. The
+ * weights z_k come from a hash chain over X, the first bucket and every
+ * bucket of c1s and shared secrets in turn, so they are only fixed once
+ * the shared secrets are, and a wrong shared secret anywhere in the file
+ * breaks S = x*C except with negligible probability.
+ *
+ * The weights are 128 bits, which is enough for a batch check in a group
+ * of prime order. The prover gets S as x*C. The verifier needs both sums,
+ * which is two scalar multiplications per point, as libsodium has no
+ * multi-scalar multiplication. It does not need the private key, and a
+ * bad node is caught before anything is combined or decrypted. */
+struct ProofState {
+  // Hash chain so far
+  unsigned char h[crypto_generichash_BYTES];
+  // Running C and S
+  unsigned char c[crypto_core_ristretto255_BYTES];
+  unsigned char s[crypto_core_ristretto255_BYTES];
+  unsigned char *weights;
+  unsigned char *partials;
+};
+
+#define PROOF_GRAIN 256
+#define WEIGHT_BYTES 16
+
+static int proof_state_init(struct ProofState *p, const struct PublicKey *pub, const unsigned int first_bucket) {
+  memset(p, 0, sizeof *p);
+  unsigned char start[4];
+  for (unsigned int b=0; b<4; b++) {
+    start[b] = (unsigned char)((first_bucket >> (8*b)) & 0xff);
+  }
+  crypto_generichash_state st;
+  crypto_generichash_init(&st, NULL, 0, sizeof p->h);
+  crypto_generichash_update(&st, (const unsigned char *)"mpc-hll partial decryption", 26);
+  crypto_generichash_update(&st, pub->val, sizeof pub->val);
+  crypto_generichash_update(&st, start, sizeof start);
+  crypto_generichash_final(&st, p->h, sizeof p->h);
+  // Weights are scalars with only their low WEIGHT_BYTES bytes set
+  p->weights = calloc((size_t)STREAM_CHUNK_BUCKETS*BUCKET_MAX, crypto_core_ristretto255_SCALARBYTES);
+  p->partials = malloc(((size_t)STREAM_CHUNK_BUCKETS*BUCKET_MAX/PROOF_GRAIN)*crypto_core_ristretto255_BYTES);
+  if ((p->weights == NULL) || (p->partials == NULL)) {
+    error_print("ERROR: could not allocate proof buffers.\n");
+    return -1;
+  }
+  return 0;
+}
+
+static void proof_state_free(struct ProofState *p) {
+  free(p->weights);
+  free(p->partials);
+}
+
+// Extends the hash chain over num_buckets buckets of c1s and shared
+// secrets, and derives the weight of each of their points
+static void proof_weights(struct ProofState *p, const unsigned char *c1s, const size_t stride, const unsigned char *ss, const unsigned int num_buckets) {
+  for (unsigned int b=0; b<num_buckets; b++) {
+    crypto_generichash_state st;
+    crypto_generichash_init(&st, NULL, 0, sizeof p->h);
+    crypto_generichash_update(&st, p->h, sizeof p->h);
+    for (unsigned int j=0; j<BUCKET_MAX; j++) {
+      crypto_generichash_update(&st, &c1s[((size_t)b*BUCKET_MAX+j)*stride], crypto_core_ristretto255_BYTES);
+    }
+    crypto_generichash_update(&st, &ss[(size_t)b*BUCKET_MAX*crypto_core_ristretto255_BYTES], BUCKET_MAX*crypto_core_ristretto255_BYTES);
+    crypto_generichash_final(&st, p->h, sizeof p->h);
+    for (unsigned int j=0; j<BUCKET_MAX; j++) {
+      unsigned char idx = (unsigned char)j;
+      crypto_generichash(&p->weights[((size_t)b*BUCKET_MAX+j)*crypto_core_ristretto255_SCALARBYTES], WEIGHT_BYTES, &idx, 1, p->h, sizeof p->h);
+    }
+  }
+}
+
+struct WeightedSumJob {
+  const unsigned char *points;
+  size_t stride;
+  const unsigned char *weights;
+  unsigned char *partials;
+};
+
+static int weighted_sum_range(void *p, const unsigned int start, const unsigned int end) {
+  struct WeightedSumJob *job = p;
+  unsigned char *acc = &job->partials[(size_t)(start/PROOF_GRAIN)*crypto_core_ristretto255_BYTES];
+  unsigned char term[crypto_core_ristretto255_BYTES];
+  memset(acc, 0, crypto_core_ristretto255_BYTES);
+  for (unsigned int k=start; k<end; k++) {
+    // Only the identity gives an error, and it adds nothing
+    if (crypto_scalarmult_ristretto255(term, &job->weights[(size_t)k*crypto_core_ristretto255_SCALARBYTES], &job->points[(size_t)k*job->stride]) != 0) {
+      continue;
+    }
+    if (crypto_core_ristretto255_add(acc, acc, term) != 0) { return -1; }
+  }
+  return 0;
+}
+
+// sum += sum of weights[k]*points[k] for the n points, on the default pool
+static int weighted_sum(unsigned char *sum, const unsigned char *points, const size_t stride, const unsigned int n, struct ProofState *p) {
+  struct WeightedSumJob job = {points, stride, p->weights, p->partials};
+  unsigned int num_partials = (n + PROOF_GRAIN - 1) / PROOF_GRAIN;
+  memset(p->partials, 0, (size_t)num_partials*crypto_core_ristretto255_BYTES);
+  if (run_on_pool(NULL, weighted_sum_range, &job, n, PROOF_GRAIN) != 0) { return -1; }
+  for (unsigned int i=0; i<num_partials; i++) {
+    if (crypto_core_ristretto255_add(sum, sum, &p->partials[(size_t)i*crypto_core_ristretto255_BYTES]) != 0) { return -1; }
+  }
+  return 0;
+}
+
+// The challenge binds the whole chain, both sums and the commitments
+static void proof_challenge(unsigned char *e, const struct ProofState *p, const unsigned char *s_sum, const unsigned char *a1, const unsigned char *a2) {
+  unsigned char wide[crypto_core_ristretto255_NONREDUCEDSCALARBYTES];
+  crypto_generichash_state st;
+  crypto_generichash_init(&st, NULL, 0, sizeof wide);
+  crypto_generichash_update(&st, p->h, sizeof p->h);
+  crypto_generichash_update(&st, p->c, sizeof p->c);
+  crypto_generichash_update(&st, s_sum, crypto_core_ristretto255_BYTES);
+  crypto_generichash_update(&st, a1, crypto_core_ristretto255_BYTES);
+  crypto_generichash_update(&st, a2, crypto_core_ristretto255_BYTES);
+  crypto_generichash_final(&st, wide, sizeof wide);
+  crypto_core_ristretto255_scalar_reduce(e, wide);
+}
+
+static int write_partial_proof(const struct ProofState *p, const struct PrivateKey *key, const char *proof_fn) {
+  struct PartialProof proof;
+  unsigned char r[crypto_core_ristretto255_SCALARBYTES];
+  unsigned char e[crypto_core_ristretto255_SCALARBYTES];
+  unsigned char s_sum[crypto_core_ristretto255_BYTES];
+  // S = x*C, as every shared secret is x times its c1
+  if ((crypto_scalarmult_ristretto255(s_sum, key->val, p->c) != 0)) {
+    error_print("ERROR: nothing to prove.\n");
+    return -1;
+  }
+  crypto_core_ristretto255_scalar_random(r);
+  if ((crypto_scalarmult_ristretto255_base(proof.a1, r) != 0) || (crypto_scalarmult_ristretto255(proof.a2, r, p->c) != 0)) {
+    return -1;
+  }
+  proof_challenge(e, p, s_sum, proof.a1, proof.a2);
+  crypto_core_ristretto255_scalar_mul(proof.s, e, key->val);
+  crypto_core_ristretto255_scalar_add(proof.s, proof.s, r);
+  sodium_memzero(r, sizeof r);
+  FILE *fp = fopen(proof_fn, "wb");
+  if ((fp == NULL) || (fwrite(&proof, sizeof proof, 1, fp) != 1)) {
+    error_print("ERROR: could not write the proof to %s.\n", proof_fn);
+    if (fp != NULL) { fclose(fp); }
+    return -5;
+  }
+  if (fclose(fp) != 0) { return -5; }
+  info_print("INFO: Written the proof of partial decryption to %s.\n", proof_fn);
+  return 0;
+}
+
+struct KeyKernelArg {
+  const struct PublicKey *pub;
+  const struct PrivateKey *priv;
+  size_t stride;
+  // Accumulates a proof of the partial decryptions, if not NULL
+  struct ProofState *proof;
+};
+
+struct EncryptKernelArg {
+  const struct PublicKey *pub;
+  // With more than one key, bucket i for pub[k] is written to
+  // extra_out[(k-1)*STREAM_CHUNK_BUCKETS + i] and then to extra_fp[k-1]
+  unsigned int num_pubs;
+  struct UnrolledCipherText *extra_out;
+  FILE **extra_fp;
+  // Writes BitCipherTexts instead of UnrolledCipherTexts
+  bool bits;
+};
+
+struct EncryptJob {
+  const struct EncryptKernelArg *k;
+  unsigned char *out;
+  const unsigned char *in;
+};
+
+static int encrypt_kernel_range(void *p, const unsigned int start, const unsigned int end) {
+  struct EncryptJob *job = p;
+  const struct PublicKey *pub = job->k->pub;
+  struct UnrolledCipherText *uct = (struct UnrolledCipherText *)job->out;
+  struct BitCipherText *bct = (struct BitCipherText *)job->out;
+  struct UnrolledCipherText multi[job->k->num_pubs];
+  for (unsigned int i=start; i<end; i++) {
+    if (job->k->num_pubs > 1) {
+      if (unroll_and_encrypt_multi(multi, job->in[i], pub, job->k->num_pubs) != 0) {
+        error_print("ERROR: could not encrypt bucket %u\n", i);
+        return -1;
+      }
+      uct[i] = multi[0];
+      for (unsigned int k=1; k<job->k->num_pubs; k++) {
+        job->k->extra_out[(size_t)(k-1)*STREAM_CHUNK_BUCKETS + i] = multi[k];
+      }
+      continue;
+    }
+    int tmp = job->k->bits ? encrypt_bits(&bct[i], job->in[i], pub) : unroll_and_encrypt_ref(&uct[i], job->in[i], pub);
+    if (tmp != 0) {
+      error_print("ERROR: could not encrypt bucket %u\n", i);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int encrypt_kernel(void *arg, unsigned char *out, unsigned char **in, const unsigned int first_bucket, const unsigned int num_buckets) {
+  struct EncryptKernelArg *k = arg;
+  struct EncryptJob job = {k, out, in[0]};
+  if (run_on_pool(NULL, encrypt_kernel_range, &job, num_buckets, 16) != 0) { return -1; }
+  for (unsigned int j=1; j<k->num_pubs; j++) {
+    if (fwrite(&k->extra_out[(size_t)(j-1)*STREAM_CHUNK_BUCKETS], sizeof (struct UnrolledCipherText), num_buckets, k->extra_fp[j-1]) != num_buckets) {
+      error_print("ERROR: could not write buckets %u to %u for key %u.\n", first_bucket, first_bucket+num_buckets, j+1);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int decrypt_kernel(void *arg, unsigned char *out, unsigned char **in, const unsigned int first_bucket, const unsigned int num_buckets) {
+  struct KeyKernelArg *k = arg;
+  return (decrypt_buckets_ref(out, in[0], k->priv, num_buckets) < 0) ? -1 : 0;
+}
+
+static int decrypt_with_sec_kernel(void *arg, unsigned char *out, unsigned char **in, const unsigned int first_bucket, const unsigned int num_buckets) {
+  return (decrypt_buckets_with_sec(out, in[0], in[1], num_buckets) < 0) ? -1 : 0;
+}
+
+static int decrypt_with_sec_soa_kernel(void *arg, unsigned char *out, unsigned char **in, const unsigned int first_bucket, const unsigned int num_buckets) {
+  return (decrypt_buckets_with_sec_soa(out, in[0], in[1], num_buckets) < 0) ? -1 : 0;
+}
+
+static int partial_kernel(void *arg, unsigned char *out, unsigned char **in, const unsigned int first_bucket, const unsigned int num_buckets) {
+  struct KeyKernelArg *k = arg;
+  if (partial_decryptions(NULL, out, in[0], k->stride, num_buckets*BUCKET_MAX, k->priv) != 0) { return -1; }
+  if (k->proof == NULL) { return 0; }
+  proof_weights(k->proof, in[0], k->stride, out, num_buckets);
+  return weighted_sum(k->proof->c, in[0], k->stride, num_buckets*BUCKET_MAX, k->proof);
+}
+
+// in[0] holds the c1s, in[1] the shared secrets to check
+static int verify_kernel(void *arg, unsigned char *out, unsigned char **in, const unsigned int first_bucket, const unsigned int num_buckets) {
+  struct KeyKernelArg *k = arg;
+  proof_weights(k->proof, in[0], k->stride, in[1], num_buckets);
+  if (weighted_sum(k->proof->c, in[0], k->stride, num_buckets*BUCKET_MAX, k->proof) != 0) { return -1; }
+  return weighted_sum(k->proof->s, in[1], crypto_core_ristretto255_BYTES, num_buckets*BUCKET_MAX, k->proof);
+}
+
+/* The rounds of the max protocol over files of BitCipherTexts. The
+ * aggregator's state is the number of inputs, then the permutations of the
+ * tests of every input in every bucket, and has to be kept secret. */
+struct MaxKernelArg {
+  // The number of inputs, or of share files for the second round
+  int ncount;
+  const struct PublicKey *pub;
+  // The permutations of a chunk, written to state_fp by the first round
+  unsigned char *perms;
+  FILE *state_fp;
+};
+
+struct MaxJob {
+  struct MaxKernelArg *k;
+  unsigned char *out;
+  unsigned char **in;
+};
+
+#define PERM_BYTES (BUCKET_MAX+1)
+
+static int max_tests_range(void *p, const unsigned int start, const unsigned int end) {
+  struct MaxJob *job = p;
+  struct EqualityTests *tests = (struct EqualityTests *)job->out;
+  for (unsigned int b=start; b<end; b++) {
+    for (int i=0; i<job->k->ncount; i++) {
+      size_t g = (size_t)b*(size_t)job->k->ncount + (size_t)i;
+      const struct BitCipherText *bct = (const struct BitCipherText *)job->in[i];
+      if (equality_tests(&tests[g], &job->k->perms[g*PERM_BYTES], &bct[b]) != 0) { return -1; }
+    }
+  }
+  return 0;
+}
+
+static int max_tests_kernel(void *arg, unsigned char *out, unsigned char **in, const unsigned int first_bucket, const unsigned int num_buckets) {
+  struct MaxKernelArg *k = arg;
+  struct MaxJob job = {k, out, in};
+  if (run_on_pool(NULL, max_tests_range, &job, num_buckets, 4) != 0) { return -1; }
+  size_t n = (size_t)num_buckets*(size_t)k->ncount;
+  if (fwrite(k->perms, PERM_BYTES, n, k->state_fp) != n) {
+    error_print("ERROR: could not write the state of buckets %u to %u.\n", first_bucket, first_bucket+num_buckets);
+    return -1;
+  }
+  return 0;
+}
+
+// in[0] holds the tests, and in[1] to in[ncount] the shares of each holder
+static int reencode_range(void *p, const unsigned int start, const unsigned int end) {
+  struct MaxJob *job = p;
+  struct EqualityTests *out = (struct EqualityTests *)job->out;
+  const struct EqualityTests *tests = (const struct EqualityTests *)job->in[0];
+  struct TestShares secs;
+  for (unsigned int g=start; g<end; g++) {
+    secs = ((const struct TestShares *)job->in[1])[g];
+    for (int i=2; i<=job->k->ncount; i++) {
+      const struct TestShares *shares = (const struct TestShares *)job->in[i];
+      if (add_all_secrets((unsigned char *)&secs, (const unsigned char *)&shares[g], BUCKET_MAX+1) != 0) { return -1; }
+    }
+    // -3 for a register out of range is passed on through the pool
+    int tmp = reencode_tests_with_secs(&out[g], &tests[g], &secs, job->k->pub);
+    if (tmp != 0) { return tmp; }
+  }
+  return 0;
+}
+
+static int reencode_kernel(void *arg, unsigned char *out, unsigned char **in, const unsigned int first_bucket, const unsigned int num_buckets) {
+  struct MaxJob job = {arg, out, in};
+  return run_on_pool(NULL, reencode_range, &job, num_buckets, 1);
+}
+
+static int max_combine_range(void *p, const unsigned int start, const unsigned int end) {
+  struct MaxJob *job = p;
+  struct UnrolledCipherText *uct = (struct UnrolledCipherText *)job->out;
+  const struct EqualityTests *indicators = (const struct EqualityTests *)job->in[0];
+  const unsigned char *perms = job->in[1];
+  struct EqualityTests sums;
+  for (unsigned int b=start; b<end; b++) {
+    memset(&sums, 0, sizeof sums);
+    for (int i=0; i<job->k->ncount; i++) {
+      size_t g = (size_t)b*(size_t)job->k->ncount + (size_t)i;
+      if (add_indicators(&sums, &indicators[g], &perms[g*PERM_BYTES]) != 0) { return -1; }
+    }
+    if (indicators_to_unary(&uct[b], &sums) != 0) { return -1; }
+  }
+  return 0;
+}
+
+static int max_combine_kernel(void *arg, unsigned char *out, unsigned char **in, const unsigned int first_bucket, const unsigned int num_buckets) {
+  struct MaxKernelArg *k = arg;
+  struct MaxJob job = {k, out, in};
+  if (run_on_pool(NULL, max_combine_range, &job, num_buckets, 16) != 0) { return -1; }
+  // Hides the counts, leaving whether each slot is 0
+  return blind_ciphertexts(NULL, out, num_buckets*BUCKET_MAX, k->pub);
+}
+
+struct SumKernelArg {
+  int ncount;
+  bool ciphertexts;
+  // Lagrange coefficients the shared secrets are weighted by, or NULL
+  const unsigned char *lambdas;
+};
+
+struct ScaleJob {
+  unsigned char *points;
+  const unsigned char *scalar;
+};
+
+static int scale_range(void *p, const unsigned int start, const unsigned int end) {
+  struct ScaleJob *job = p;
+  for (unsigned int i=start; i<end; i++) {
+    unsigned char *point = &job->points[(size_t)i*crypto_core_ristretto255_BYTES];
+    if (crypto_scalarmult_ristretto255(point, job->scalar, point) != 0) {
+      error_print("ERROR: could not weight shared secret %u\n", i);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Multiplies the shared secrets of each of the ncount inputs by its
+// Lagrange coefficient, in place
+static int weight_secrets(unsigned char **in, const struct SumKernelArg *k, const unsigned int num_buckets) {
+  for (int i=0; (k->lambdas != NULL) && (i<k->ncount); i++) {
+    struct ScaleJob job = {in[i], &k->lambdas[(size_t)i*crypto_core_ristretto255_SCALARBYTES]};
+    if (run_on_pool(NULL, scale_range, &job, num_buckets*BUCKET_MAX, 256) != 0) { return -1; }
+  }
+  return 0;
+}
+
+// Sums the inputs into out
+static int sum_kernel(void *arg, unsigned char *out, unsigned char **in, const unsigned int first_bucket, const unsigned int num_buckets) {
+  struct SumKernelArg *k = arg;
+  int n = (int)num_buckets*BUCKET_MAX;
+  if (weight_secrets(in, k, num_buckets) != 0) { return -1; }
+  memcpy(out, in[0], (size_t)n*(k->ciphertexts ? 2 : 1)*crypto_core_ristretto255_BYTES);
+  for (int i=1; i<k->ncount; i++) {
+    if ((k->ciphertexts ? add_all_ciphertexts(out, in[i], n) : add_all_secrets(out, in[i], n)) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// in[0] is the CipherTexts, and in[1..] the partial decryptions of each node
+static int decrypt_with_secs_kernel(void *arg, unsigned char *out, unsigned char **in, const unsigned int first_bucket, const unsigned int num_buckets) {
+  struct SumKernelArg *k = arg;
+  if (weight_secrets(&in[1], k, num_buckets) != 0) { return -1; }
+  for (int i=2; i<=k->ncount; i++) {
+    if (add_all_secrets(in[1], in[i], (int)num_buckets*BUCKET_MAX) != 0) { return -1; }
+  }
+  return (decrypt_buckets_with_sec(out, in[0], in[1], num_buckets) < 0) ? -1 : 0;
+}
+
+struct RerandomizeKernelArg {
+  const struct PublicKey *pub;
+  bool blind;
+};
+
+static int rerandomize_kernel(void *arg, unsigned char *out, unsigned char **in, const unsigned int first_bucket, const unsigned int num_buckets) {
+  struct RerandomizeKernelArg *k = arg;
+  unsigned int n = num_buckets*BUCKET_MAX;
+  memcpy(out, in[0], (size_t)n*2*crypto_core_ristretto255_BYTES);
+  return k->blind ? blind_ciphertexts(NULL, out, n, k->pub) : rerandomize_ciphertexts(NULL, out, n, k->pub);
+}
+
+static int encrypt_file_range(char **key_fns, char **output_fns, const int nkeys, char *input_fn, const bool bits, const struct BucketRange range) {
+  if ((nkeys < 1) || (nkeys > MAX_RECIPIENTS)) {
+    error_print("ERROR: can only encrypt to 1 to %d keys at once.\n", MAX_RECIPIENTS);
+    return -1;
+  }
+  struct PublicKey pub_keys[MAX_RECIPIENTS];
+  for (int k=0; k<nkeys; k++) {
+    if (read_pubkey(&pub_keys[k], key_fns[k]) != 0) { return -1; }
+  }
+  FILE *extra_fp[MAX_RECIPIENTS] = {NULL};
+  struct EncryptKernelArg arg = {pub_keys, (unsigned int)nkeys, NULL, extra_fp, bits};
+  // one extra byte for the 255 delimiter
+  unsigned char *registers = malloc(BUCKET_NUM+1);
+  if (registers == NULL) { return -1; }
+  int tmp = read_file_to_array(registers, input_fn, BUCKET_NUM);
+  if (tmp < 0) {
+    error_print("ERROR: could not read file into array.\n");
+    free(registers);
+    return tmp;
+  }
+  struct BucketInput input = {input_fn, registers, 1, 0, 0, false, false};
+  int return_val = 0;
+  if (nkeys > 1) {
+    arg.extra_out = malloc((size_t)(nkeys-1)*STREAM_CHUNK_BUCKETS*sizeof (struct UnrolledCipherText));
+    if (arg.extra_out == NULL) {
+      return_val = -1;
+      goto cleanup;
+    }
+  }
+  for (int k=1; k<nkeys; k++) {
+    if (is_std_stream(output_fns[k])) {
+      error_print("ERROR: only the first output can be stdout.\n");
+      return_val = -1;
+      goto cleanup;
+    }
+    if ((extra_fp[k-1] = fopen(output_fns[k], "wb")) == NULL) {
+      error_print("ERROR: could not open %s for writing.\n", output_fns[k]);
+      return_val = -1;
+      goto cleanup;
+    }
+  }
+  size_t out_bytes = bits ? sizeof (struct BitCipherText) : ciphertext_input.bucket_bytes;
+  struct BucketStream s = {&input, 1, (unsigned int)tmp, output_fns[0], NULL, out_bytes, false, false, encrypt_kernel, &arg};
+  return_val = stream_buckets(&s, range, NULL);
+  if ((return_val == 0) && (nkeys > 1)) {
+    info_print("INFO: Written the encryptions under the other %d keys.\n", nkeys-1);
+  }
+
+  cleanup:
+  for (int k=1; k<nkeys; k++) {
+    if ((extra_fp[k-1] != NULL) && (fclose(extra_fp[k-1]) != 0) && (return_val == 0)) {
+      error_print("ERROR: could not finish writing %s.\n", output_fns[k]);
+      return_val = -5;
+    }
+  }
+  free(arg.extra_out);
+  free(registers);
+  return return_val;
+}
+
+int encrypt_bucket_file_range(char *key_fn, char *input_fn, char *output_fn, const struct BucketRange range) {
+  return encrypt_file_range(&key_fn, &output_fn, 1, input_fn, false, range);
+}
+
+int encrypt_bit_file_range(char *key_fn, char *input_fn, char *output_fn, const struct BucketRange range) {
+  return encrypt_file_range(&key_fn, &output_fn, 1, input_fn, true, range);
+}
+
+int encrypt_bucket_file_multi_range(char **key_fns, char **output_fns, const int nkeys, char *input_fn, const struct BucketRange range) {
+  return encrypt_file_range(key_fns, output_fns, nkeys, input_fn, false, range);
+}
+
+int decrypt_bucket_file_range(char *key_fn, char *input_fn, char *output_fn, const struct BucketRange range) {
+  struct PrivateKey priv_key;
+  int tmp;
+  if ((tmp = read_privkey(&priv_key, key_fn)) != 0) { return tmp; }
+  struct BucketInput input = ciphertext_input;
+  input.fn = input_fn;
+  struct KeyKernelArg arg = {NULL, &priv_key, 0, NULL};
+  struct BucketStream s = {&input, 1, 0, output_fn, NULL, 1, true, false, decrypt_kernel, &arg};
+  int return_val = stream_buckets(&s, range, NULL);
+  sodium_memzero(&priv_key, sizeof priv_key);
+  return return_val;
+}
+
+int decrypt_bucket_file_with_sec_range(char *shared_sec_fn, char *input_fn, char *output_fn, const struct BucketRange range, const bool soa) {
+  struct BucketInput inputs[2] = {ciphertext_input, secret_input};
+  inputs[0].fn = input_fn;
+  inputs[1].fn = shared_sec_fn;
+  if (soa) {
+    // Only the c2 half of the file is read, so it has to be seekable
+    if (is_std_stream(input_fn)) {
+      error_print("ERROR: SoA files cannot be read from stdin.\n");
+      return -1;
+    }
+    ssize_t size = file_size(input_fn);
+    if (size < 0) { return -1; }
+    inputs[0].bucket_bytes = secret_input.bucket_bytes;
+    inputs[0].file_bucket_bytes = ciphertext_input.bucket_bytes;
+    inputs[0].offset = (long)(size/2);
+  }
+  struct BucketStream s = {inputs, 2, 0, output_fn, NULL, 1, true, false, soa ? decrypt_with_sec_soa_kernel : decrypt_with_sec_kernel, NULL};
+  return stream_buckets(&s, range, NULL);
+}
+
+int get_partial_decryptions_range(char *key_fn, char *input_fn, char *output_fn, char *proof_fn, const struct BucketRange range, const bool soa) {
+  struct PrivateKey priv_key;
+  struct PublicKey pub_key;
+  // Zeroed so that cleanup can free it even if it was never initialised
+  struct ProofState proof;
+  memset(&proof, 0, sizeof proof);
+  int tmp;
+  if ((tmp = read_privkey(&priv_key, key_fn)) != 0) { return tmp; }
+  struct BucketInput input = ciphertext_input;
+  input.fn = input_fn;
+  struct KeyKernelArg arg = {NULL, &priv_key, 2*crypto_core_ristretto255_BYTES, NULL};
+  if (soa) {
+    // Only the c1 half of the file is read
+    input.bucket_bytes = secret_input.bucket_bytes;
+    input.file_bucket_bytes = ciphertext_input.bucket_bytes;
+    arg.stride = crypto_core_ristretto255_BYTES;
+  }
+  int return_val = 0;
+  if (proof_fn != NULL) {
+    arg.proof = &proof;
+    if ((priv2pub_ref(&pub_key, &priv_key) != 0) || (proof_state_init(&proof, &pub_key, range.start) != 0)) {
+      return_val = -1;
+      goto cleanup;
+    }
+  }
+  struct BucketStream s = {&input, 1, 0, output_fn, NULL, secret_input.bucket_bytes, false, false, partial_kernel, &arg};
+  return_val = stream_buckets(&s, range, NULL);
+  if ((return_val == 0) && (proof_fn != NULL)) {
+    return_val = write_partial_proof(&proof, &priv_key, proof_fn);
+  }
+
+  cleanup:
+  if (proof_fn != NULL) { proof_state_free(&proof); }
+  sodium_memzero(&priv_key, sizeof priv_key);
+  return return_val;
+}
+
+int verify_partial_decryptions_range(char *pub_fn, char *input_fn, char *ss_fn, char *proof_fn, const struct BucketRange range, const bool soa) {
+  struct PublicKey pub_key;
+  struct PartialProof proof;
+  struct ProofState state;
+  if (read_pubkey(&pub_key, pub_fn) != 0) { return -1; }
+  FILE *fp = fopen(proof_fn, "rb");
+  if ((fp == NULL) || (fread(&proof, sizeof proof, 1, fp) != 1) || (fgetc(fp) != EOF)) {
+    error_print("ERROR: %s does not hold a proof of partial decryption.\n", proof_fn);
+    if (fp != NULL) { fclose(fp); }
+    return -1;
+  }
+  fclose(fp);
+  struct BucketInput inputs[2] = {ciphertext_input, secret_input};
+  inputs[0].fn = input_fn;
+  inputs[1].fn = ss_fn;
+  inputs[1].range_only = true;
+  struct KeyKernelArg arg = {&pub_key, NULL, 2*crypto_core_ristretto255_BYTES, &state};
+  if (soa) {
+    inputs[0].bucket_bytes = secret_input.bucket_bytes;
+    inputs[0].file_bucket_bytes = ciphertext_input.bucket_bytes;
+    arg.stride = crypto_core_ristretto255_BYTES;
+  }
+  int return_val = proof_state_init(&state, &pub_key, range.start);
+  if (return_val == 0) {
+    struct BucketStream s = {inputs, 2, 0, NULL, NULL, 0, false, false, verify_kernel, &arg};
+    return_val = stream_buckets(&s, range, NULL);
+  }
+  if (return_val == 0) {
+    // s*G == A1 + e*X and s*C == A2 + e*S
+    unsigned char e[crypto_core_ristretto255_SCALARBYTES];
+    unsigned char lhs[crypto_core_ristretto255_BYTES];
+    unsigned char rhs[crypto_core_ristretto255_BYTES];
+    proof_challenge(e, &state, state.s, proof.a1, proof.a2);
+    bool ok = (crypto_scalarmult_ristretto255_base(lhs, proof.s) == 0) &&
+      (crypto_scalarmult_ristretto255(rhs, e, pub_key.val) == 0) &&
+      (crypto_core_ristretto255_add(rhs, rhs, proof.a1) == 0) &&
+      (sodium_memcmp(lhs, rhs, sizeof lhs) == 0) &&
+      (crypto_scalarmult_ristretto255(lhs, proof.s, state.c) == 0) &&
+      (crypto_scalarmult_ristretto255(rhs, e, state.s) == 0) &&
+      (crypto_core_ristretto255_add(rhs, rhs, proof.a2) == 0) &&
+      (sodium_memcmp(lhs, rhs, sizeof lhs) == 0);
+    if (ok) {
+      info_print("INFO: %s is a correct partial decryption of %s under %s.\n", ss_fn, input_fn, pub_fn);
+    } else {
+      error_print("ERROR: the proof in %s does not hold: %s is not a correct partial decryption of %s under %s.\n", proof_fn, ss_fn, input_fn, pub_fn);
+      return_val = -3;
+    }
+  }
+  proof_state_free(&state);
+  return return_val;
+}
+
+static int sum_files_range(char *combined_fn, char **fns, const int ncount, const struct BucketRange range, const bool ciphertexts, const unsigned char *lambdas) {
+  struct BucketInput *inputs = calloc((size_t)ncount, sizeof (struct BucketInput));
+  if (inputs == NULL) { return -1; }
+  for (int i=0; i<ncount; i++) {
+    inputs[i] = ciphertexts ? ciphertext_input : secret_input;
+    inputs[i].fn = fns[i];
+  }
+  struct SumKernelArg arg = {ncount, ciphertexts, lambdas};
+  struct BucketStream s = {inputs, ncount, 0, combined_fn, NULL, inputs[0].bucket_bytes, false, true, sum_kernel, &arg};
+  int return_val = stream_buckets(&s, range, NULL);
+  free(inputs);
+  return return_val;
+}
+
+int combine_binary_CipherText_files_range(char *combined_fn, char **fns, const int ncount, const struct BucketRange range) {
+  if (ncount < 1) { return -1; }
+  return sum_files_range(combined_fn, fns, ncount, range, true, NULL);
+}
+
+int max_tests_file(char *state_fn, char *tests_fn, char **fns, const int ncount) {
+  if (ncount < 1) { return -1; }
+  struct BucketInput *inputs = calloc((size_t)ncount, sizeof (struct BucketInput));
+  struct MaxKernelArg arg = {ncount, NULL, NULL, NULL};
+  int return_val = 0;
+  arg.perms = malloc((size_t)STREAM_CHUNK_BUCKETS*(size_t)ncount*PERM_BYTES);
+  if ((inputs == NULL) || (arg.perms == NULL)) {
+    return_val = -1;
+    goto cleanup;
+  }
+  for (int i=0; i<ncount; i++) {
+    inputs[i] = ciphertext_input;
+    inputs[i].fn = fns[i];
+    inputs[i].bucket_bytes = sizeof (struct BitCipherText);
+  }
+  if (is_std_stream(state_fn) || ((arg.state_fp = fopen(state_fn, "wb")) == NULL) ||
+      (fwrite(&ncount, sizeof ncount, 1, arg.state_fp) != 1)) {
+    error_print("ERROR: could not open %s for writing.\n", state_fn);
+    return_val = -1;
+    goto cleanup;
+  }
+  struct BucketStream s = {inputs, ncount, 0, tests_fn, NULL, (size_t)ncount*sizeof (struct EqualityTests), false, true, max_tests_kernel, &arg};
+  return_val = stream_buckets(&s, ALL_BUCKETS, NULL);
+
+  cleanup:
+  if ((arg.state_fp != NULL) && (fclose(arg.state_fp) != 0) && (return_val == 0)) {
+    error_print("ERROR: could not finish writing %s.\n", state_fn);
+    return_val = -5;
+  }
+  free(arg.perms);
+  free(inputs);
+  return return_val;
+}
+
+static int test_shares_kernel(void *arg, unsigned char *out, unsigned char **in, const unsigned int first_bucket, const unsigned int num_buckets) {
+  struct KeyKernelArg *k = arg;
+  return partial_decryptions(NULL, out, in[0], k->stride, num_buckets*(BUCKET_MAX+1), k->priv);
+}
+
+int max_test_shares_file(char *key_fn, char *tests_fn, char *shares_fn) {
+  struct PrivateKey priv_key;
+  int tmp;
+  if ((tmp = read_privkey(&priv_key, key_fn)) != 0) { return tmp; }
+  struct BucketInput input = ciphertext_input;
+  input.fn = tests_fn;
+  input.bucket_bytes = sizeof (struct EqualityTests);
+  struct KeyKernelArg arg = {NULL, &priv_key, 2*crypto_core_ristretto255_BYTES, NULL};
+  struct BucketStream s = {&input, 1, 0, shares_fn, NULL, sizeof (struct TestShares), false, true, test_shares_kernel, &arg};
+  int return_val = stream_buckets(&s, ALL_BUCKETS, NULL);
+  sodium_memzero(&priv_key, sizeof priv_key);
+  return return_val;
+}
+
+int reencode_tests_file(char *pub_fn, char *tests_fn, char **share_fns, const int nshares, char *indicators_fn) {
+  if (nshares < 1) { return -1; }
+  struct PublicKey pub_key;
+  if (read_pubkey(&pub_key, pub_fn) != 0) { return -1; }
+  struct BucketInput *inputs = calloc((size_t)(nshares+1), sizeof (struct BucketInput));
+  if (inputs == NULL) { return -1; }
+  inputs[0] = ciphertext_input;
+  inputs[0].fn = tests_fn;
+  inputs[0].bucket_bytes = sizeof (struct EqualityTests);
+  for (int i=0; i<nshares; i++) {
+    inputs[i+1] = secret_input;
+    inputs[i+1].fn = share_fns[i];
+    inputs[i+1].bucket_bytes = sizeof (struct TestShares);
+  }
+  struct MaxKernelArg arg = {nshares, &pub_key, NULL, NULL};
+  struct BucketStream s = {inputs, nshares+1, 0, indicators_fn, NULL, sizeof (struct EqualityTests), false, true, reencode_kernel, &arg};
+  int return_val = stream_buckets(&s, ALL_BUCKETS, NULL);
+  if (return_val == -3) {
+    error_print("ERROR: %s holds a register that is not in [0,%d], or the shares are not from every key holder.\n", tests_fn, BUCKET_MAX);
+    if (!is_std_stream(indicators_fn)) { remove(indicators_fn); }
+  }
+  free(inputs);
+  return return_val;
+}
+
+int max_combine_file(char *pub_fn, char *state_fn, char *indicators_fn, char *output_fn) {
+  struct PublicKey pub_key;
+  if (read_pubkey(&pub_key, pub_fn) != 0) { return -1; }
+  int ncount = 0;
+  FILE *fp = is_std_stream(state_fn) ? NULL : fopen(state_fn, "rb");
+  if ((fp == NULL) || (fread(&ncount, sizeof ncount, 1, fp) != 1) || (ncount < 1)) {
+    error_print("ERROR: %s does not hold the state of a max protocol.\n", state_fn);
+    if (fp != NULL) { fclose(fp); }
+    return -1;
+  }
+  fclose(fp);
+  struct BucketInput inputs[2] = {ciphertext_input, ciphertext_input};
+  inputs[0].fn = indicators_fn;
+  inputs[0].bucket_bytes = (size_t)ncount*sizeof (struct EqualityTests);
+  inputs[1].fn = state_fn;
+  inputs[1].bucket_bytes = (size_t)ncount*PERM_BYTES;
+  inputs[1].offset = (long)sizeof ncount;
+  inputs[1].points = false;
+  struct MaxKernelArg arg = {ncount, &pub_key, NULL, NULL};
+  struct BucketStream s = {inputs, 2, 0, output_fn, NULL, ciphertext_input.bucket_bytes, false, true, max_combine_kernel, &arg};
+  return stream_buckets(&s, ALL_BUCKETS, NULL);
+}
+
+int combine_partial_decryptions_range(char *combined_fn, char **fns, const int ncount, const struct BucketRange range) {
+  if (ncount < 1) { return -1; }
+  return sum_files_range(combined_fn, fns, ncount, range, false, NULL);
+}
+
+// Streams input_fn and the partial decryptions in node_fns into output_fn,
+// or into plain if output_fn is NULL
+static int decrypt_with_secs_stream(unsigned char *plain, char *input_fn, char **node_fns, const int ncount, const unsigned char *lambdas, char *output_fn, const struct BucketRange range, unsigned int *num_written) {
+  if (ncount < 1) {
+    error_print("ERROR: need at least one partial decryption file.\n");
+    return -1;
+  }
+  struct BucketInput *inputs = calloc((size_t)ncount+1, sizeof (struct BucketInput));
+  if (inputs == NULL) { return -1; }
+  inputs[0] = ciphertext_input;
+  inputs[0].fn = input_fn;
+  for (int i=0; i<ncount; i++) {
+    inputs[i+1] = secret_input;
+    inputs[i+1].fn = node_fns[i];
+  }
+  struct SumKernelArg arg = {ncount, false, lambdas};
+  struct BucketStream s = {inputs, ncount+1, 0, output_fn, plain, 1, (output_fn != NULL), false, decrypt_with_secs_kernel, &arg};
+  int return_val = stream_buckets(&s, range, num_written);
+  free(inputs);
+  return return_val;
+}
+
+int decrypt_bucket_file_with_secs_range(char *input_fn, char **node_fns, const int ncount, char *output_fn, const struct BucketRange range) {
+  return decrypt_with_secs_stream(NULL, input_fn, node_fns, ncount, NULL, output_fn, range, NULL);
+}
+
+int combine_threshold_partial_decryptions_range(char *combined_fn, char **fns, const unsigned int *indices, const int ncount, const struct BucketRange range) {
+  if (ncount < 1) { return -1; }
+  unsigned char *lambdas = malloc((size_t)ncount*crypto_core_ristretto255_SCALARBYTES);
+  if (lambdas == NULL) { return -1; }
+  int return_val = lagrange_coefficients(lambdas, indices, ncount);
+  if (return_val == 0) {
+    return_val = sum_files_range(combined_fn, fns, ncount, range, false, lambdas);
+  }
+  free(lambdas);
+  return return_val;
+}
+
+int decrypt_bucket_file_with_threshold_secs_range(char *input_fn, char **node_fns, const unsigned int *indices, const int ncount, char *output_fn, const struct BucketRange range) {
+  if (ncount < 1) { return -1; }
+  unsigned char *lambdas = malloc((size_t)ncount*crypto_core_ristretto255_SCALARBYTES);
+  if (lambdas == NULL) { return -1; }
+  int return_val = lagrange_coefficients(lambdas, indices, ncount);
+  if (return_val == 0) {
+    return_val = decrypt_with_secs_stream(NULL, input_fn, node_fns, ncount, lambdas, output_fn, range, NULL);
+  }
+  free(lambdas);
+  return return_val;
+}
+
+int decrypt_buckets_with_secs_file(unsigned char *plain, char *input_fn, char **node_fns, const int ncount, const unsigned int max_buckets) {
+  // One bucket more than fits is read, to tell that the input is too long
+  struct BucketRange range = {0, (max_buckets < BUCKET_RANGE_END) ? max_buckets + 1 : max_buckets};
+  unsigned int num_elem = 0;
+  int return_val = decrypt_with_secs_stream(plain, input_fn, node_fns, ncount, NULL, NULL, range, &num_elem);
+  if (return_val != 0) { return return_val; }
+  if (num_elem > max_buckets) {
+    error_print("ERROR: %s contains more than %u buckets.\n", input_fn, max_buckets);
+    return -1;
+  }
+  plain[num_elem] = 0;
+  return (int)num_elem;
+}
+
+int rerandomize_CipherText_file_range(char *key_fn, char *input_fn, char *output_fn, const bool blind, const struct BucketRange range) {
+  struct PublicKey pub_key;
+  if (read_pubkey(&pub_key, key_fn) != 0) { return -1; }
+  struct BucketInput input = ciphertext_input;
+  input.fn = input_fn;
+  struct RerandomizeKernelArg arg = {&pub_key, blind};
+  struct BucketStream s = {&input, 1, 0, output_fn, NULL, ciphertext_input.bucket_bytes, false, true, rerandomize_kernel, &arg};
+  return stream_buckets(&s, range, NULL);
+}
@@ -3,7 +3,31 @@
 
 #define _GNU_SOURCE
 #define BUCKET_NUM 65536
+/* BUCKET_MAX bounds the registers, and is the number of unary slots in
+ * every bucket, so file sizes and the work on them scale with it. Real
+ * registers rarely go far above 20, so a consortium can agree on a smaller
+ * public bound for a run and build with it, e.g. make BUCKET_MAX=20. Every
+ * party of the run must use the same bound, as files do not record it.
+ * Registers above the bound are rejected, or clamped to it if built with
+ * CLAMP_REGISTERS=1, which changes a combined register only when its true
+ * max is above the bound. */
+#ifndef BUCKET_MAX
 #define BUCKET_MAX 32
+#endif
+#ifndef CLAMP_REGISTERS
+#define CLAMP_REGISTERS 0
+#endif
+#if (BUCKET_MAX < 2) || (BUCKET_MAX > 254)
+#error "BUCKET_MAX must be in [2, 254]"
+#endif
+// Number of buckets processed at a time by the streaming file functions
+#define STREAM_CHUNK_BUCKETS 256
+// Intersection queries are bitmasks over at most 64 parties, and each one
+// needs a union for every nonempty subset of its parties
+#define MAX_INTERSECTION_PARTIES 64
+#define MAX_INTERSECTION_ARITY 10
+// Most keys a sketch can be encrypted to at once
+#define MAX_RECIPIENTS 8
 
 #include <stdio.h>
 #include <sodium.h>
@@ -11,6 +35,9 @@
 #include <inttypes.h>
 #include <string.h>
 #include <stdbool.h>
+#include <math.h>
+#include <pthread.h>
+#include <limits.h>
 
 #ifndef ERROR_PRINT
 #define ERROR_PRINT 1
@@ -65,6 +92,143 @@ struct UnrolledSharedSecret {
   struct SharedSecret arr[BUCKET_MAX];
 };
 
+/* BitCipherText is the logarithmic encoding of a register: its value in
+ * [0, BUCKET_MAX] as BIT_WIDTH encrypted bits, least significant first,
+ * each encode(1) or the identity. It is BUCKET_MAX/BIT_WIDTH times smaller
+ * and cheaper to write than an UnrolledCipherText, but adding two does not
+ * give their max, so the aggregator turns them into unary first with the
+ * max protocol below.
+ *
+ * EqualityTests holds the tests of one register against every t in
+ * [0, BUCKET_MAX], each blinded by its own random scalar as in
+ * private_equality_test, in a random order: exactly one decrypts to 0. */
+#if BUCKET_MAX < 4
+#define BIT_WIDTH 2
+#elif BUCKET_MAX < 8
+#define BIT_WIDTH 3
+#elif BUCKET_MAX < 16
+#define BIT_WIDTH 4
+#elif BUCKET_MAX < 32
+#define BIT_WIDTH 5
+#elif BUCKET_MAX < 64
+#define BIT_WIDTH 6
+#elif BUCKET_MAX < 128
+#define BIT_WIDTH 7
+#else
+#define BIT_WIDTH 8
+#endif
+struct BitCipherText {
+  struct CipherText arr[BIT_WIDTH];
+};
+struct EqualityTests {
+  struct CipherText arr[BUCKET_MAX+1];
+};
+// A key holder's shared secrets for the EqualityTests of one register
+struct TestShares {
+  struct SharedSecret arr[BUCKET_MAX+1];
+};
+
+// A Chaum-Pedersen proof of partial decryption, see
+// get_partial_decryptions_range
+struct PartialProof {
+  unsigned char a1[crypto_core_ristretto255_BYTES];
+  unsigned char a2[crypto_core_ristretto255_BYTES];
+  unsigned char s[crypto_core_ristretto255_SCALARBYTES];
+};
+
+/* CipherTextSumTree caches partial sums of the ciphertext arrays of N parties
+ * in a segment tree. Node 1 covers parties [0, ncount), and the children of
+ * node k are 2k and 2k+1, splitting the range of k in half.
+ *
+ * Because adding ciphertexts is a group operation, the combined array of any
+ * subset of the parties is the sum of the cached nodes fully covered by the
+ * subset, which is a handful of nodes for typical (contiguous or
+ * leave-one-out) subsets rather than one per member.
+ *
+ * The cache is not bounded: it keeps all 2*ncount - 1 nodes in memory, the
+ * ncount input arrays and ncount - 1 sums, so it takes about twice the size
+ * of all the input files together.
+ * */
+struct CipherTextSumTree {
+  int ncount;
+  unsigned int num_ciphertexts;
+  size_t array_bytes;
+  int num_nodes;
+  unsigned char **nodes;
+};
+
+/* WorkerPool runs a function over the indices [0, n) on a fixed set of
+ * threads, handing out ranges of at most `grain` indices at a time.
+ * The calling thread works too, so a pool of 1 thread spawns nothing.
+ *
+ * The function returns 0 on success. The first nonzero value returned stops
+ * any further ranges from being handed out, and is returned by the run.
+ * Only one run may be in progress on a pool at a time.
+ * */
+typedef int (*worker_fn)(void *arg, const unsigned int start, const unsigned int end);
+struct WorkerPool {
+  int num_threads;
+  pthread_t *threads;
+  pthread_mutex_t lock;
+  pthread_cond_t work_ready;
+  pthread_cond_t work_done;
+  unsigned long generation;
+  bool shutdown;
+  worker_fn fn;
+  void *arg;
+  unsigned int n;
+  unsigned int grain;
+  unsigned int next;
+  int active;
+  int return_val;
+};
+
+/* Arena owns the per-run buffers of the file-level functions.
+ *
+ * Allocations are 64-byte aligned slices of anonymous mappings, and are
+ * all released at once by arena_reset, which keeps the memory mapped for
+ * the next run, or by arena_free. Each allocation is exactly what the run
+ * needs. When a run outgrows the arena, a new block is mapped, and the
+ * next reset folds the blocks into one sized for the whole run, so that a
+ * batch of similar runs settles into a single mapping.
+ *
+ * With huge_pages set, large blocks are backed by huge pages when the
+ * system has them reserved, and by transparent huge pages otherwise.
+ * */
+struct ArenaBlock {
+  struct ArenaBlock *next;
+  size_t mapped;
+  size_t size;
+  size_t used;
+  unsigned char *data;
+};
+struct Arena {
+  struct ArenaBlock *head;
+  size_t capacity_hint;
+  bool huge_pages;
+};
+
+/* MpcHllContext keeps everything that can be reused between operations on
+ * the same keys: the keys themselves, precomputed group elements, a scratch
+ * buffer that only grows, and a worker pool. Services embedding the library
+ * should load a context once and use the context_* array operations, which
+ * do no per-call allocation and use every thread in the pool. The arena can
+ * be passed to the *_arena file-level functions to reuse their buffers.
+ *
+ * encode_table[i] is encode(i), so encode_table[0] is the identity.
+ * */
+struct MpcHllContext {
+  struct PublicKey pub_key;
+  struct PrivateKey priv_key;
+  bool has_pub_key;
+  bool has_priv_key;
+  struct PlainText encode_table[BUCKET_MAX+1];
+  unsigned char *scratch;
+  size_t scratch_size;
+  struct Arena arena;
+  struct WorkerPool pool;
+};
+
 /* Most of the following functions store result in the first argument.
  *
  * Almost all of them furthermore return a negative value as an error code,
@@ -73,6 +237,10 @@ struct UnrolledSharedSecret {
  * Note however that a few will return a positive value corresponding
  * to length on success. These functions will be separately noted.
  *
+ * Every function taking a struct by value has a *_ref version taking a
+ * const pointer instead, which avoids copying the struct on every call.
+ * The by-value versions are thin wrappers around them.
+ *
  * */
 
 /* generates a random scalar in Ristretto255 as a private elgamal key */
@@ -80,17 +248,24 @@ int generate_key(struct PrivateKey *a);
 
 /* generates a public elgamal key from a private key by taking g*priv.val */
 int priv2pub(struct PublicKey *a, const struct PrivateKey priv);
+int priv2pub_ref(struct PublicKey *a, const struct PrivateKey *priv);
 
 /* encryption and decryption via public/private keys respectively */
 int encrypt(struct CipherText *a, const struct PlainText plain, const struct PublicKey pub);
 int decrypt(struct PlainText *a, const struct CipherText x, const struct PrivateKey key);
+int encrypt_ref(struct CipherText *a, const struct PlainText *plain, const struct PublicKey *pub);
+int decrypt_ref(struct PlainText *a, const struct CipherText *x, const struct PrivateKey *key);
 
 /* The basic homomorphic binary operation */
 int add_ciphertext(struct CipherText *a, const struct CipherText x, const struct CipherText y);
+// a may be the same as x or y, to add in place
+int add_ciphertext_ref(struct CipherText *a, const struct CipherText *x, const struct CipherText *y);
 
 /* generate a shared secret for distributed decryption of CipherText */
 int shared_secret(struct SharedSecret *s, const struct CipherText x, const struct PrivateKey key);
 int decrypt_with_sec(struct PlainText *a, const struct CipherText x, const struct SharedSecret s);
+int shared_secret_ref(struct SharedSecret *s, const struct CipherText *x, const struct PrivateKey *key);
+int decrypt_with_sec_ref(struct PlainText *a, const struct CipherText *x, const struct SharedSecret *s);
 
 /* encoding / decoding integers as Ristretto255 elements 
  *
@@ -105,10 +280,13 @@ int decrypt_with_sec(struct PlainText *a, const struct CipherText x, const struc
 int encode(struct PlainText *a, const unsigned int message);
 unsigned char decode(const struct PlainText x);
 int decode_equal(const struct PlainText x, const unsigned int y);
+unsigned char decode_ref(const struct PlainText *x);
+int decode_equal_ref(const struct PlainText *x, const unsigned int y);
 
 /* Performs a private equality test that gives a CipherText 0 if x == y,
  * and a random number otherwise */
 int private_equality_test(struct CipherText *a, const struct CipherText x, const struct CipherText y);
+int private_equality_test_ref(struct CipherText *a, const struct CipherText *x, const struct CipherText *y);
 
 /* Encodes/decodes a character in [0, BUCKET_MAX] to/from unary */
 int unroll(struct UnrolledPlainText *a, const unsigned char x);
@@ -116,12 +294,51 @@ int reroll(unsigned char *a, const struct UnrolledPlainText upt);
 int unroll_and_encrypt(struct UnrolledCipherText *a, const unsigned char x, const struct PublicKey pub_key);
 int decrypt_and_reroll(unsigned char *a, const struct UnrolledCipherText uct, const struct PrivateKey priv_key);
 int decrypt_and_reroll_with_sec(unsigned char *a, const struct UnrolledCipherText uct, const struct UnrolledSharedSecret uss);
+int reroll_ref(unsigned char *a, const struct UnrolledPlainText *upt);
+int unroll_and_encrypt_ref(struct UnrolledCipherText *a, const unsigned char x, const struct PublicKey *pub_key);
+int decrypt_and_reroll_ref(unsigned char *a, const struct UnrolledCipherText *uct, const struct PrivateKey *priv_key);
+int decrypt_and_reroll_with_sec_ref(unsigned char *a, const struct UnrolledCipherText *uct, const struct UnrolledSharedSecret *uss);
+/* As unroll_and_encrypt, encrypting x to npubs keys at once, into
+ * a[0] to a[npubs-1]. Each slot uses one random y for every key, so all
+ * the a[k] share their c1s and only y*pub is computed per key. This is
+ * the multi-recipient ElGamal of Kurosawa, as secure as encrypting to each
+ * key on its own, and the a[k] decrypt exactly like any other bucket. */
+int unroll_and_encrypt_multi(struct UnrolledCipherText *a, const unsigned char x, const struct PublicKey *pubs, const unsigned int npubs);
+
+/* The max protocol over BitCipherTexts, in rounds:
+ *  1. the aggregator turns each register into shuffled EqualityTests with
+ *     equality_tests, and keeps the order of each in perm
+ *  2. every key holder computes its shares of the tests with test_shares,
+ *     and a party other than the aggregator sums them, decrypts the tests
+ *     with reencode_tests_with_secs, and encrypts encode(1) in place of the
+ *     one 0 and 0 in place of the others, which tells it nothing as it
+ *     does not know the order. reencode_tests does both with a single key
+ *  3. the aggregator puts the indicators of every party back in order and
+ *     sums them with add_indicators, so sums[t] encrypts the number of
+ *     parties whose register is t, and indicators_to_unary sums those into
+ *     the UnrolledCipherText of the max, whose slot j encrypts the number
+ *     of parties above j. Blinding it with blind_ciphertexts leaves only
+ *     whether each slot is 0, as for the sum of unary registers.
+ * It is safe against key holders and an aggregator that follow the
+ * protocol and do not collude: the aggregator must never see the summed
+ * shares. reencode_tests returns -3 if the tests do not hold exactly one 0,
+ * as for a register above BUCKET_MAX. */
+int encrypt_bits(struct BitCipherText *a, const unsigned char x, const struct PublicKey *pub_key);
+int decrypt_bits(unsigned char *x, const struct BitCipherText *a, const struct PrivateKey *priv_key);
+int equality_tests(struct EqualityTests *a, unsigned char *perm, const struct BitCipherText *x);
+int test_shares(struct TestShares *a, const struct EqualityTests *tests, const struct PrivateKey *priv_key);
+int reencode_tests_with_secs(struct EqualityTests *a, const struct EqualityTests *tests, const struct TestShares *secs, const struct PublicKey *pub_key);
+int reencode_tests(struct EqualityTests *a, const struct EqualityTests *tests, const struct PrivateKey *priv_key, const struct PublicKey *pub_key);
+int add_indicators(struct EqualityTests *sums, const struct EqualityTests *indicators, const unsigned char *perm);
+int indicators_to_unary(struct UnrolledCipherText *a, const struct EqualityTests *sums);
 
 /* File IO functions */
 int read_pubkey(struct PublicKey *a, const char *fn);
 int write_pubkey(const struct PublicKey pubkey, const char *fn);
+int write_pubkey_ref(const struct PublicKey *pubkey, const char *fn);
 int read_privkey(struct PrivateKey *a, const char *fn);
 int write_privkey(const struct PrivateKey privkey, const char *fn);
+int write_privkey_ref(const struct PrivateKey *privkey, const char *fn);
 
 /* File IO wrapper
  * keygen_node will ensure that a private key is stored in private_fn and 
@@ -135,39 +352,115 @@ int keygen_node(char *private_fn, char *public_fn);
 int combine_public_keys(char *combined_fn, char **node_fns, const int ncount);
 int combine_private_keys(char *combined_fn, char **node_fns, const int ncount);
 
+/* Threshold decryption
+ *
+ * threshold_keygen deals Shamir shares of a fresh private key to n nodes,
+ * so that the partial decryptions of any t of them can be combined into a
+ * full decryption. Node i (from 1) gets the share f(i) in priv_fns[i-1] and,
+ * if pub_fns is not NULL, its public key in pub_fns[i-1]. The combined public
+ * key f(0)*G goes to pub_fn. The dealer sees the whole key, so it has to be
+ * trusted, and should forget the key once the shares are out.
+ *
+ * The shares are ordinary private keys, so get_partial_decryption works
+ * unchanged. Its outputs are combined with the Lagrange coefficients of the
+ * indices of the nodes that responded, instead of being summed. */
+int threshold_keygen(const int t, const int n, char *pub_fn, char **priv_fns, char **pub_fns);
+// Writes the ncount coefficients that interpolate f(0) from the shares of
+// the nodes in indices. Fails if an index is 0 or repeated
+int lagrange_coefficients(unsigned char *lambdas, const unsigned int *indices, const int ncount);
+// Splits a share argument "index:file". Returns 1 if arg is one, 0 if not
+int parse_share_arg(unsigned int *index, char **fn, char *arg);
+
+void arena_init(struct Arena *a, const bool huge_pages);
+// Returns NULL if no memory could be mapped
+void *arena_alloc(struct Arena *a, const size_t size);
+void arena_reset(struct Arena *a);
+void arena_free(struct Arena *a);
+
+/* The file-level functions below that have an *_arena variant take all of
+ * their buffers from the arena, and reset it before returning, and hold the
+ * whole array at once. The plain versions stream the array in chunks
+ * through stream_buckets, whose reads and writes overlap the arithmetic,
+ * in memory bounded by a few chunks whatever the size of the array.
+ *
+ * The streamed functions, and the _range ones, take "-" as a file name for
+ * stdin or stdout. The files have no header, so an input from stdin just
+ * ends at the last whole bucket before EOF, and only one input may come
+ * from stdin. SoA files need seeking and cannot be streamed this way. */
 // Encrypts a newline delimited list of integers in [0,BUCKET_MAX] from input_fn and writes it out to output_fn, using the public key found in key_fn
 int encrypt_bucket_file(char *key_fn, char *input_fn, char *output_fn);
+int encrypt_bucket_file_arena(struct Arena *arena, char *key_fn, char *input_fn, char *output_fn);
 // Reverses the encryption from encrypt_bucket_file
 int decrypt_bucket_file(char *key_fn, char *input_fn, char *output_fn);
+int decrypt_bucket_file_arena(struct Arena *arena, char *key_fn, char *input_fn, char *output_fn);
 // Reverses the encryption from encrypt_bucket_file
 int decrypt_bucket_file_with_sec(char *shared_sec_fn, char *input_fn, char *output_fn);
+int decrypt_bucket_file_with_sec_arena(struct Arena *arena, char *shared_sec_fn, char *input_fn, char *output_fn);
 // Reads newline separated integers in [0,BUCKET_MAX] file into array. If items were read, return the number. Return a negative number upon error.
-// max is the size of the ans buffer
+// At most buf_size integers are read, and ans must hold buf_size + 1 bytes
+// for the 255 delimiter written after them
 int read_file_to_array(unsigned char *ans, char *fn, size_t buf_size);
 // Reads binary encrypted file into array, with serialized CipherText objects. Returns the number of objects read. Returns a negative number on error.
 // sizeof ans = buf_size in bytes
 int read_binary_CipherText_file(unsigned char *ans, char *fn, int buf_size);
+// Decrypts input_fn using the partial decryption files in node_fns directly,
+// summing the shared secrets chunk by chunk without writing a combined file.
+// plain must have space for max_buckets + 1.
+// Returns the number of buckets on success, and a negative value on error.
+int decrypt_buckets_with_secs_file(unsigned char *plain, char *input_fn, char **node_fns, const int ncount, const unsigned int max_buckets);
+// File wrapper around decrypt_buckets_with_secs_file. Writes out the registers
+// as newline delimited integers, or the cardinality estimate if estimate is set
+int decrypt_bucket_file_with_secs(char *input_fn, char **node_fns, const int ncount, char *output_fn, const bool estimate);
 // Gets the shared secrets for a partial decryption of a file
 int get_partial_decryptions(char *key_fn, char *input_fn, char *output_fn);
+int get_partial_decryptions_arena(struct Arena *arena, char *key_fn, char *input_fn, char *output_fn);
 // decrypts a file with a collection of partial decryptions
 int combine_partial_decryptions(char *combined_fn, char **node_fns, const int ncount);
+int combine_partial_decryptions_arena(struct Arena *arena, char *combined_fn, char **node_fns, const int ncount);
 // Reads binary shared secrets file into array, with serialized SharedSecrets objects. Returns the number of objects read. Returns a negative number on error.
 // sizeof ans = buf_size in bytes
 int read_partial_decryption_file(unsigned char *ans, char *fn, int buf_size);
 
+/* Structure-of-arrays (SoA) layout
+ *
+ * The default (AoS) layout stores c1 and c2 of each CipherText next to each
+ * other. The SoA layout of the same n CipherTexts is all n c1's followed by
+ * all n c2's, in the same order. Partial decryption only reads the c1 half,
+ * and decryption with shared secrets only reads the c2 half.
+ *
+ * Both layouts are arrays of independent points, so combine-arrays and
+ * add_all_ciphertexts work unchanged on SoA arrays, provided that every
+ * input uses the same layout.
+ * */
+// Splits num_ciphertexts AoS CipherTexts into c1s and c2s, and back
+int ciphertexts_to_soa(unsigned char *c1s, unsigned char *c2s, const unsigned char *aos, const unsigned int num_ciphertexts);
+int ciphertexts_from_soa(unsigned char *aos, const unsigned char *c1s, const unsigned char *c2s, const unsigned int num_ciphertexts);
+// Streaming conversion of a CipherText file to SoA (to_soa) or back to AoS
+int convert_CipherText_file_layout(char *input_fn, char *output_fn, const bool to_soa);
+// Same as get_partial_decryptions, for an SoA input file
+int get_partial_decryptions_soa(char *key_fn, char *input_fn, char *output_fn);
+// Same as decrypt_buckets_with_sec, given only the c2 half of SoA buckets
+int decrypt_buckets_with_sec_soa(unsigned char *plain, const unsigned char *c2s, const unsigned char *shared_sec, const unsigned int num_buckets);
+// Same as decrypt_bucket_file_with_sec, for an SoA input file
+int decrypt_bucket_file_with_sec_soa(char *shared_sec_fn, char *input_fn, char *output_fn);
+
 // Returns the number of buckets in UnrolledCipherTexts
 // Returns negative value on error 
 // array "in" should be (-1)-delimited (alternately 255-delimited)
 // max_elem is in units of UnrolledCipherTexts
 int encrypt_buckets(unsigned char *out, const unsigned char *in, const struct PublicKey pubkey, const unsigned int max_buckets);
+int encrypt_buckets_ref(unsigned char *out, const unsigned char *in, const struct PublicKey *pubkey, const unsigned int max_buckets);
 // Decrypt array
 // Returns the number of buckets on success
 // Returns negative value on error
 // plain must have space for num_buckets + 1 (to null terminate)
+// Buckets are decrypted in parallel on the default pool
 int decrypt_buckets(unsigned char *plain, const unsigned char *enc, const struct PrivateKey privkey, const unsigned int num_buckets);
+int decrypt_buckets_ref(unsigned char *plain, const unsigned char *enc, const struct PrivateKey *privkey, const unsigned int num_buckets);
 int decrypt_buckets_with_sec(unsigned char *plain, const unsigned char *enc, const unsigned char *shared_sec, const unsigned int num_buckets);
 
-// a1 and a2 are byte arrays of concatenated CipherTexts
+// a1 and a2 are byte arrays of concatenated CipherTexts, and a1 += a2 is
+// computed in place
 int add_all_ciphertexts(unsigned char *a1, const unsigned char *a2, const int num_ciphertexts);
 // a1 and a2 are byte arrays of concatenated SharedSecrets
 int add_all_secrets(unsigned char *a1, const unsigned char *a2, const int num_ciphertexts);
@@ -176,6 +469,181 @@ int add_all_secrets(unsigned char *a1, const unsigned char *a2, const int num_ci
 // Adds together all ciphertexts found in fns, and puts output in combined_fn
 // ncount = number of CipherTexts
 int combine_binary_CipherText_files(char *combined_fn, char **fns, const int ncount);
+int combine_binary_CipherText_files_arena(struct Arena *arena, char *combined_fn, char **fns, const int ncount);
+
+// HyperLogLog cardinality estimate of an array of registers in [0,BUCKET_MAX]
+double estimate_cardinality(const unsigned char *registers, const unsigned int num_buckets);
+
+// Reads the ciphertext arrays in fns and builds the cached partial sums
+int sum_tree_init(struct CipherTextSumTree *t, char **fns, const int ncount);
+// Puts the combined array of the parties i with members[i] set into out,
+// which must hold t->array_bytes. Returns the number of cached pieces used,
+// or a negative value on error (including an empty subset)
+int sum_tree_subset(unsigned char *out, const struct CipherTextSumTree *t, const bool *members);
+void sum_tree_free(struct CipherTextSumTree *t);
+// Answers a batch of subset unions over the arrays in fns. Each line of
+// query_fn is an output file name followed by the (0-based) party indices
+int combine_subsets_file(char *query_fn, char **fns, const int ncount);
+
+/* Batched intersection estimates by inclusion-exclusion
+ *
+ * Each line of a query file lists the 0-based indices of parties whose
+ * intersection should be estimated. A query is stored as a bitmask of
+ * its parties, and needs the union of every nonempty subset of them.
+ *
+ * prepare_intersection_batch concatenates the combined arrays of all of
+ * the distinct unions into batch_fn, so that every node runs a single
+ * get_partial_decryptions over it. finish_intersection_batch streams the
+ * batch with the nodes' partial decryptions, and writes one estimate per
+ * query to output_fn.
+ * */
+// Returns the number of queries read into *queries (malloc'd), or negative
+int read_intersection_queries(uint64_t **queries, char *query_fn, const int ncount);
+// Distinct unions needed by the queries, in increasing order. unions must
+// have room for num_queries << MAX_INTERSECTION_ARITY. Returns the count
+int intersection_unions(uint64_t *unions, const uint64_t *queries, const int num_queries);
+// |A_1 & ... & A_k| = sum over nonempty T of (-1)^(|T|+1) |union of T|
+double inclusion_exclusion(const uint64_t query, const uint64_t *unions, const double *union_estimates, const int num_unions);
+int prepare_intersection_batch(char *query_fn, char *batch_fn, char **fns, const int ncount);
+int finish_intersection_batch(char *query_fn, char *batch_fn, char *output_fn, char **node_fns, const int ncount);
+
+/* Checks that each of the num_points encodings in points is a valid
+ * Ristretto255 point, on pool, or on a shared default pool if pool is NULL.
+ * The points are numbered from first_point within fn, and a bad one is
+ * reported with its file and bucket index. Returns 0 if all are valid.
+ *
+ * Every reader of ciphertext and shared secret files runs this on what it
+ * has just read, so corrupt inputs are rejected before any arithmetic. */
+int validate_points(struct WorkerPool *pool, const unsigned char *points, const size_t num_points, const char *fn, const size_t first_point, const unsigned int points_per_bucket);
+
+/* Rerandomization adds a fresh encryption of zero under pub to each of the
+ * num_ciphertexts CipherTexts in enc, in place, on pool (or the default
+ * pool if NULL). The plaintexts are unchanged, but the result can no longer
+ * be linked to the parties' inputs. Combined arrays should be rerandomized
+ * before they are sent out for partial decryption. */
+int rerandomize_ciphertexts(struct WorkerPool *pool, unsigned char *enc, const unsigned int num_ciphertexts, const struct PublicKey *pub);
+/* Blinding multiplies each CipherText by a fresh random scalar, in place,
+ * so that decryption only shows whether each slot is zero and not which
+ * random point landed in it. It has to happen once, before any partial
+ * decryption, as every node must decrypt the same CipherTexts. If pub is
+ * not NULL, each CipherText is also rerandomized in the same pass. */
+int blind_ciphertexts(struct WorkerPool *pool, unsigned char *enc, const unsigned int num_ciphertexts, const struct PublicKey *pub);
+// Streams input_fn through rerandomize_ciphertexts, or blind_ciphertexts
+// if blind is set, into output_fn
+int rerandomize_CipherText_file(char *key_fn, char *input_fn, char *output_fn, const bool blind);
+
+/* Writes key*c1 for num_ciphertexts c1's into shared_sec, on pool (or the
+ * default pool if NULL). Consecutive c1's are stride bytes apart: a whole
+ * CipherText in the default layout, or one point in the c1 half of an SoA
+ * file. Each point is a libsodium scalar multiplication, which is constant
+ * time in the key, so the gain over a loop of shared_secret comes only from
+ * the threads. */
+int partial_decryptions(struct WorkerPool *pool, unsigned char *shared_sec, const unsigned char *c1s, const size_t stride, const unsigned int num_ciphertexts, const struct PrivateKey *key);
+
+/* Bucket ranges select buckets [start, end) of an array. Ciphertext,
+ * shared secret and register files hold one fixed-size record per bucket,
+ * so the _range functions below seek straight to start and only read the
+ * buckets in the range, and the outputs for consecutive ranges can be
+ * concatenated (with cat) into the output for the whole array. An end past
+ * the last bucket stops at the last bucket. */
+struct BucketRange {
+  unsigned int start;
+  unsigned int end;
+};
+#define BUCKET_RANGE_END UINT_MAX
+#define ALL_BUCKETS ((struct BucketRange){0, BUCKET_RANGE_END})
+// Parses "start:end"; a missing end means BUCKET_RANGE_END
+int parse_bucket_range(struct BucketRange *r, const char *arg);
+// Removes a "--range start:end" (or "-range") option from argv and parses
+// it into r, which is ALL_BUCKETS otherwise. Returns 1 if the option was
+// found, 0 if not and a negative value if it could not be parsed
+int take_range_option(struct BucketRange *r, int *argc, char *argv[]);
+// The streams behind the _range functions queue their file reads and
+// writes to io_uring where the build and the kernel have it, and use a
+// reader and a writer thread otherwise. Returns whether they now use
+// io_uring, which can be turned off to compare the two
+bool stream_use_io_uring(const bool enable);
+// Number of streams that have run on io_uring, to tell it from the threads
+unsigned long stream_io_uring_runs(void);
+// Removes an option "name value" from argv and points value at its value.
+// Returns 1 if the option was found, 0 if not and -1 if it has no value
+int take_option(char **value, const char *name, int *argc, char *argv[]);
+// Same as the functions without _range, limited to the buckets in range.
+// soa selects an SoA input file
+int encrypt_bucket_file_range(char *key_fn, char *input_fn, char *output_fn, const struct BucketRange range);
+// Encrypts input_fn to nkeys keys at once with unroll_and_encrypt_multi,
+// writing a standard file per key, of which only the first may be stdout
+int encrypt_bucket_file_multi_range(char **key_fns, char **output_fns, const int nkeys, char *input_fn, const struct BucketRange range);
+// Writes BitCipherTexts, for the max protocol
+int encrypt_bit_file_range(char *key_fn, char *input_fn, char *output_fn, const struct BucketRange range);
+int decrypt_bucket_file_range(char *key_fn, char *input_fn, char *output_fn, const struct BucketRange range);
+int decrypt_bucket_file_with_sec_range(char *shared_sec_fn, char *input_fn, char *output_fn, const struct BucketRange range, const bool soa);
+int decrypt_bucket_file_with_secs_range(char *input_fn, char **node_fns, const int ncount, char *output_fn, const struct BucketRange range);
+int combine_binary_CipherText_files_range(char *combined_fn, char **fns, const int ncount, const struct BucketRange range);
+int combine_partial_decryptions_range(char *combined_fn, char **fns, const int ncount, const struct BucketRange range);
+/* The rounds of the max protocol over files of BitCipherTexts, which end
+ * in a combined file of CipherTexts like combine_binary_CipherText_files.
+ * state_fn holds the permutations of the aggregator between the first
+ * and last rounds, and must not reach the key holder. */
+int max_tests_file(char *state_fn, char *tests_fn, char **fns, const int ncount);
+// Round 2 is max_test_shares_file at every key holder, then
+// reencode_tests_file over all their shares under the combined public key
+int max_test_shares_file(char *key_fn, char *tests_fn, char *shares_fn);
+int reencode_tests_file(char *pub_fn, char *tests_fn, char **share_fns, const int nshares, char *indicators_fn);
+int max_combine_file(char *pub_fn, char *state_fn, char *indicators_fn, char *output_fn);
+/* If proof_fn is not NULL, get_partial_decryptions_range also writes a
+ * proof that every shared secret in output_fn is the private key times its
+ * c1, which verify_partial_decryptions_range checks with only the public
+ * key, for the same input and range, with ss_fn holding only the buckets
+ * in the range as written for it. One proof covers the whole output,
+ * through random linear combinations of the c1s and shared secrets with
+ * 128 bit weights hashed from all of them. Verification costs two scalar
+ * multiplications per point. verify returns 0 for a valid proof, -3 for
+ * an invalid one and other negative values on errors. */
+int get_partial_decryptions_range(char *key_fn, char *input_fn, char *output_fn, char *proof_fn, const struct BucketRange range, const bool soa);
+int verify_partial_decryptions_range(char *pub_fn, char *input_fn, char *ss_fn, char *proof_fn, const struct BucketRange range, const bool soa);
+// As above, weighting the shared secrets of node indices[i] by its Lagrange
+// coefficient, for threshold keys
+int combine_threshold_partial_decryptions_range(char *combined_fn, char **fns, const unsigned int *indices, const int ncount, const struct BucketRange range);
+int decrypt_bucket_file_with_threshold_secs_range(char *input_fn, char **node_fns, const unsigned int *indices, const int ncount, char *output_fn, const struct BucketRange range);
+int rerandomize_CipherText_file_range(char *key_fn, char *input_fn, char *output_fn, const bool blind, const struct BucketRange range);
+
+// num_threads <= 0 uses one thread per online CPU
+int worker_pool_init(struct WorkerPool *pool, const int num_threads);
+int worker_pool_run(struct WorkerPool *pool, worker_fn fn, void *arg, const unsigned int n, const unsigned int grain);
+void worker_pool_free(struct WorkerPool *pool);
+
+// num_threads <= 0 uses one thread per online CPU
+int context_init(struct MpcHllContext *ctx, const int num_threads);
+// Loading a private key also sets the matching public key
+int context_load_pubkey(struct MpcHllContext *ctx, const char *fn);
+int context_load_privkey(struct MpcHllContext *ctx, const char *fn);
+// Returns a buffer of at least size bytes owned by the context, valid until
+// the next call to context_scratch or context_free. NULL on failure
+unsigned char *context_scratch(struct MpcHllContext *ctx, const size_t size);
+void context_free(struct MpcHllContext *ctx);
+// Same semantics as encrypt_buckets, decrypt_buckets and
+// decrypt_buckets_with_sec respectively, but without the 255 delimiter
+int context_encrypt_buckets(struct MpcHllContext *ctx, unsigned char *out, const unsigned char *in, const unsigned int num_buckets);
+int context_decrypt_buckets(struct MpcHllContext *ctx, unsigned char *plain, const unsigned char *enc, const unsigned int num_buckets);
+int context_decrypt_buckets_with_sec(struct MpcHllContext *ctx, unsigned char *plain, const unsigned char *enc, const unsigned char *shared_sec, const unsigned int num_buckets);
+// Writes one SharedSecret per CipherText in enc into shared_sec
+int context_partial_decryptions(struct MpcHllContext *ctx, unsigned char *shared_sec, const unsigned char *enc, const unsigned int num_ciphertexts);
+// Same as get_partial_decryptions with the context's private key, streaming
+// the file through the context's scratch buffer
+int context_get_partial_decryptions(struct MpcHllContext *ctx, char *input_fn, char *output_fn);
+// Encrypts every sketch in manifest_fn under the public key in key_fn. Each
+// line of the manifest is an input register file followed by an output
+// file, as for encrypt_bucket_file. A single context and worker pool encrypt
+// the buckets of all the sketches together
+int encrypt_bucket_manifest(char *key_fn, char *manifest_fn, const int num_threads);
+
+// a1 and a2 are plaintext register arrays; a1[i] = max(a1[i], a2[i])
+// Lets a party union its own shards before paying for a single encryption
+int merge_registers(unsigned char *a1, const unsigned char *a2, const unsigned int num_buckets);
+// Takes the register-wise max of newline delimited register files in fns,
+// and writes it out to combined_fn in the same format
+int merge_register_files(char *combined_fn, char **fns, const int ncount);
 
 
 
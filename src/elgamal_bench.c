@@ -0,0 +1,361 @@
+#include "elgamal.h"
+#include <time.h>
+
+/* Benchmarks of the hot loops of the pipeline, against the serial loops
+ * they replaced. Run with make bench, or as
+ *   tests/elgamal_bench [num_ciphertexts] [num_threads]
+ * */
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + 1e-9*(double)t.tv_nsec;
+}
+
+static void report(const char *name, const double seconds, const unsigned int n, const double baseline) {
+  printf("%-40s %8.3f s %10.0f /s %6.2fx\n", name, seconds, (double)n/seconds, baseline/seconds);
+}
+
+// The per-element loop get_partial_decryptions used before it ran
+// partial_decryptions on a pool of threads
+static int serial_partial_decryptions(unsigned char *out, const unsigned char *in, const unsigned int n, const struct PrivateKey key) {
+  struct SharedSecret s;
+  struct CipherText x;
+  for (unsigned int i=0; i<n; i++) {
+    memcpy(x.c1, &in[2*i*crypto_core_ristretto255_BYTES], crypto_core_ristretto255_BYTES);
+    memcpy(x.c2, &in[(2*i+1)*crypto_core_ristretto255_BYTES], crypto_core_ristretto255_BYTES);
+    if (shared_secret(&s, x, key) != 0) { return -1; }
+    memcpy(&out[i*crypto_core_ristretto255_BYTES], s.val, crypto_core_ristretto255_BYTES);
+  }
+  return 0;
+}
+
+static int bench_partial_decryptions(const unsigned int n, const int num_threads) {
+  int return_val = 0;
+  struct PrivateKey key;
+  generate_key(&key);
+  unsigned char *enc = malloc((size_t)n*2*crypto_core_ristretto255_BYTES);
+  unsigned char *expected = malloc((size_t)n*crypto_core_ristretto255_BYTES);
+  unsigned char *out = malloc((size_t)n*crypto_core_ristretto255_BYTES);
+  if ((enc == NULL) || (expected == NULL) || (out == NULL)) {
+    return_val = -1;
+    goto cleanup;
+  }
+  for (unsigned int i=0; i<2*n; i++) {
+    crypto_core_ristretto255_random(&enc[(size_t)i*crypto_core_ristretto255_BYTES]);
+  }
+  printf("Partial decryption of %u ciphertexts\n", n);
+
+  double t0 = now();
+  if (serial_partial_decryptions(expected, enc, n, key) != 0) { return_val = -1; goto cleanup; }
+  double baseline = now() - t0;
+  report("serial shared_secret loop", baseline, n, baseline);
+
+  int threads[2] = {1, num_threads};
+  for (int k=0; k<2; k++) {
+    struct WorkerPool pool;
+    if (worker_pool_init(&pool, threads[k]) != 0) { return_val = -1; goto cleanup; }
+    memset(out, 0, (size_t)n*crypto_core_ristretto255_BYTES);
+    t0 = now();
+    int r = partial_decryptions(&pool, out, enc, 2*crypto_core_ristretto255_BYTES, n, &key);
+    double t = now() - t0;
+    char name[64];
+    snprintf(name, sizeof name, "partial_decryptions, %d threads", pool.num_threads+1);
+    worker_pool_free(&pool);
+    if ((r != 0) || (memcmp(out, expected, (size_t)n*crypto_core_ristretto255_BYTES) != 0)) {
+      printf("ERROR: %s does not match the serial loop\n", name);
+      return_val = -1;
+      goto cleanup;
+    }
+    report(name, t, n, baseline);
+  }
+
+  cleanup:
+  free(enc);
+  free(expected);
+  free(out);
+  return return_val;
+}
+
+// Streamed file partial decryption against reading the whole file in,
+// decrypting it and writing it all out, in phases
+static int bench_streamed_file(const unsigned int n) {
+  int return_val = 0;
+  unsigned int num_buckets = (n + BUCKET_MAX - 1) / BUCKET_MAX;
+  size_t enc_size = (size_t)num_buckets*BUCKET_MAX*2*crypto_core_ristretto255_BYTES;
+  char key_fn[] = "bench.priv";
+  char in_fn[] = "bench.bin";
+  char phased_fn[] = "bench_phased.ss";
+  char streamed_fn[] = "bench_streamed.ss";
+  struct PrivateKey key;
+  generate_key(&key);
+  unsigned char *enc = malloc(enc_size);
+  FILE *fp = NULL;
+  if ((enc == NULL) || (write_privkey_ref(&key, key_fn) != 0)) {
+    return_val = -1;
+    goto cleanup;
+  }
+  for (size_t i=0; i<enc_size/crypto_core_ristretto255_BYTES; i++) {
+    crypto_core_ristretto255_random(&enc[i*crypto_core_ristretto255_BYTES]);
+  }
+  fp = fopen(in_fn, "wb");
+  if ((fp == NULL) || (fwrite(enc, 1, enc_size, fp) != enc_size) || (fclose(fp) != 0)) {
+    return_val = -1;
+    goto cleanup;
+  }
+  printf("File partial decryption of %u buckets\n", num_buckets);
+
+  struct Arena arena;
+  arena_init(&arena, true);
+  double t0 = now();
+  int r = get_partial_decryptions_arena(&arena, key_fn, in_fn, phased_fn);
+  double baseline = now() - t0;
+  arena_free(&arena);
+  if (r != 0) { return_val = -1; goto cleanup; }
+  report("read, decrypt, then write", baseline, num_buckets*BUCKET_MAX, baseline);
+
+  // Threads first, then io_uring where the kernel has it
+  for (int ring=0; ring<2; ring++) {
+    if (stream_use_io_uring(ring == 1) != (ring == 1)) {
+      printf("io_uring is not available, skipping\n");
+      break;
+    }
+    remove(streamed_fn);
+    t0 = now();
+    r = get_partial_decryptions(key_fn, in_fn, streamed_fn);
+    double t = now() - t0;
+    if (r != 0) { return_val = -1; goto cleanup; }
+    report(ring ? "io_uring stream" : "threaded stream", t, num_buckets*BUCKET_MAX, baseline);
+
+    // Both must write the same shared secrets
+    unsigned char *a = malloc(enc_size/2);
+    unsigned char *b = malloc(enc_size/2);
+    FILE *fa = fopen(phased_fn, "rb");
+    FILE *fb = fopen(streamed_fn, "rb");
+    if ((a == NULL) || (b == NULL) || (fa == NULL) || (fb == NULL) ||
+        (fread(a, 1, enc_size/2, fa) != enc_size/2) || (fread(b, 1, enc_size/2, fb) != enc_size/2) ||
+        (memcmp(a, b, enc_size/2) != 0)) {
+      printf("ERROR: the streamed shared secrets do not match\n");
+      return_val = -1;
+    }
+    if (fa != NULL) { fclose(fa); }
+    if (fb != NULL) { fclose(fb); }
+    free(a);
+    free(b);
+  }
+  stream_use_io_uring(true);
+
+  cleanup:
+  free(enc);
+  remove(key_fn);
+  remove(in_fn);
+  remove(phased_fn);
+  remove(streamed_fn);
+  return return_val;
+}
+
+// Proving and verifying partial decryptions, against partial decryption
+// alone
+static int bench_partial_proof(const unsigned int n) {
+  int return_val = 0;
+  unsigned int num_buckets = (n + BUCKET_MAX - 1) / BUCKET_MAX;
+  unsigned int num_points = num_buckets*BUCKET_MAX;
+  size_t enc_size = (size_t)num_points*2*crypto_core_ristretto255_BYTES;
+  char priv_fn[] = "bench_proof.priv";
+  char pub_fn[] = "bench_proof.pub";
+  char in_fn[] = "bench_proof.bin";
+  char ss_fn[] = "bench_proof.ss";
+  char proof_fn[] = "bench_proof.proof";
+  unsigned char *enc = malloc(enc_size);
+  FILE *fp = NULL;
+  if ((enc == NULL) || (keygen_node(priv_fn, pub_fn) != 0)) {
+    return_val = -1;
+    goto cleanup;
+  }
+  for (size_t i=0; i<enc_size/crypto_core_ristretto255_BYTES; i++) {
+    crypto_core_ristretto255_random(&enc[i*crypto_core_ristretto255_BYTES]);
+  }
+  fp = fopen(in_fn, "wb");
+  if ((fp == NULL) || (fwrite(enc, 1, enc_size, fp) != enc_size) || (fclose(fp) != 0)) {
+    return_val = -1;
+    goto cleanup;
+  }
+  printf("Proofs of partial decryption of %u buckets\n", num_buckets);
+
+  double t0 = now();
+  if (get_partial_decryptions_range(priv_fn, in_fn, ss_fn, NULL, ALL_BUCKETS, false) != 0) { return_val = -1; goto cleanup; }
+  double baseline = now() - t0;
+  report("partial decryption, no proof", baseline, num_points, baseline);
+
+  t0 = now();
+  if (get_partial_decryptions_range(priv_fn, in_fn, ss_fn, proof_fn, ALL_BUCKETS, false) != 0) { return_val = -1; goto cleanup; }
+  report("partial decryption and proof", now() - t0, num_points, baseline);
+
+  t0 = now();
+  if (verify_partial_decryptions_range(pub_fn, in_fn, ss_fn, proof_fn, ALL_BUCKETS, false) != 0) {
+    printf("ERROR: the proof does not verify\n");
+    return_val = -1;
+    goto cleanup;
+  }
+  report("verify", now() - t0, num_points, baseline);
+
+  cleanup:
+  free(enc);
+  remove(priv_fn);
+  remove(pub_fn);
+  remove(in_fn);
+  remove(ss_fn);
+  remove(proof_fn);
+  return return_val;
+}
+
+// The unary and the bit encoding of the same registers of two sites, from
+// encryption to the combined array the key holders decrypt
+static int bench_bit_encoding(const unsigned int n) {
+  int return_val = 0;
+  const unsigned int ncount = 2;
+  unsigned int num_buckets = (n + BUCKET_MAX - 1) / BUCKET_MAX;
+  struct PrivateKey priv_key;
+  struct PublicKey pub_key;
+  generate_key(&priv_key);
+  if (priv2pub(&pub_key, priv_key) != 0) { return -1; }
+  unsigned char *registers = malloc((size_t)ncount*num_buckets);
+  struct UnrolledCipherText *unary = malloc((size_t)ncount*num_buckets*sizeof (struct UnrolledCipherText));
+  struct BitCipherText *bits = malloc((size_t)ncount*num_buckets*sizeof (struct BitCipherText));
+  struct EqualityTests *tests = malloc((size_t)ncount*num_buckets*sizeof (struct EqualityTests));
+  unsigned char *perms = malloc((size_t)ncount*num_buckets*(BUCKET_MAX+1));
+  struct UnrolledCipherText *combined = malloc((size_t)num_buckets*sizeof (struct UnrolledCipherText));
+  if ((registers == NULL) || (unary == NULL) || (bits == NULL) || (tests == NULL) || (perms == NULL) || (combined == NULL)) {
+    return_val = -1;
+    goto cleanup;
+  }
+  for (size_t i=0; i<(size_t)ncount*num_buckets; i++) {
+    registers[i] = (unsigned char)randombytes_uniform(BUCKET_MAX+1);
+  }
+  printf("Max of %u sites over %u buckets, unary against bit encoding\n", ncount, num_buckets);
+  printf("%-40s %8lu B %8lu B\n", "upload per bucket, unary and bits", (unsigned long)sizeof (struct UnrolledCipherText), (unsigned long)sizeof (struct BitCipherText));
+
+  double t0 = now();
+  for (size_t i=0; i<(size_t)ncount*num_buckets; i++) {
+    if (unroll_and_encrypt_ref(&unary[i], registers[i], &pub_key) != 0) { return_val = -1; goto cleanup; }
+  }
+  double baseline = now() - t0;
+  report("unary: encrypt at the sites", baseline, ncount*num_buckets, baseline);
+  t0 = now();
+  for (unsigned int i=1; i<ncount; i++) {
+    if (add_all_ciphertexts((unsigned char *)unary, (unsigned char *)&unary[(size_t)i*num_buckets], (int)(num_buckets*BUCKET_MAX)) != 0) { return_val = -1; goto cleanup; }
+  }
+  report("unary: combine", now() - t0, ncount*num_buckets, baseline);
+
+  t0 = now();
+  for (size_t i=0; i<(size_t)ncount*num_buckets; i++) {
+    if (encrypt_bits(&bits[i], registers[i], &pub_key) != 0) { return_val = -1; goto cleanup; }
+  }
+  report("bits: encrypt at the sites", now() - t0, ncount*num_buckets, baseline);
+  t0 = now();
+  for (size_t i=0; i<(size_t)ncount*num_buckets; i++) {
+    if (equality_tests(&tests[i], &perms[i*(BUCKET_MAX+1)], &bits[i]) != 0) { return_val = -1; goto cleanup; }
+  }
+  report("bits: aggregator tests", now() - t0, ncount*num_buckets, baseline);
+  t0 = now();
+  for (size_t i=0; i<(size_t)ncount*num_buckets; i++) {
+    if (reencode_tests(&tests[i], &tests[i], &priv_key, &pub_key) != 0) { return_val = -1; goto cleanup; }
+  }
+  report("bits: key holder reencodes", now() - t0, ncount*num_buckets, baseline);
+  t0 = now();
+  for (unsigned int b=0; b<num_buckets; b++) {
+    struct EqualityTests sums;
+    memset(&sums, 0, sizeof sums);
+    for (unsigned int i=0; i<ncount; i++) {
+      size_t k = (size_t)i*num_buckets + b;
+      if (add_indicators(&sums, &tests[k], &perms[k*(BUCKET_MAX+1)]) != 0) { return_val = -1; goto cleanup; }
+    }
+    if (indicators_to_unary(&combined[b], &sums) != 0) { return_val = -1; goto cleanup; }
+  }
+  if (blind_ciphertexts(NULL, (unsigned char *)combined, num_buckets*BUCKET_MAX, &pub_key) != 0) { return_val = -1; goto cleanup; }
+  report("bits: aggregator combines and blinds", now() - t0, ncount*num_buckets, baseline);
+
+  // Both must give the same max
+  unsigned char *a = malloc(num_buckets+1);
+  unsigned char *b = malloc(num_buckets+1);
+  if ((a == NULL) || (b == NULL) ||
+      (decrypt_buckets(a, (unsigned char *)unary, priv_key, num_buckets) < 0) ||
+      (decrypt_buckets(b, (unsigned char *)combined, priv_key, num_buckets) < 0) ||
+      (memcmp(a, b, num_buckets) != 0)) {
+    printf("ERROR: the bit encoding does not give the same max\n");
+    return_val = -1;
+  }
+  free(a);
+  free(b);
+
+  cleanup:
+  free(registers);
+  free(unary);
+  free(bits);
+  free(tests);
+  free(perms);
+  free(combined);
+  return return_val;
+}
+
+// Encrypting the same registers to several keys, one key at a time and
+// sharing the nonces
+static int bench_multi_recipient(const unsigned int n) {
+  int return_val = 0;
+  const unsigned int nkeys = 3;
+  unsigned int num_buckets = (n + BUCKET_MAX - 1) / BUCKET_MAX;
+  struct PublicKey pub_keys[3];
+  for (unsigned int k=0; k<nkeys; k++) {
+    struct PrivateKey priv_key;
+    generate_key(&priv_key);
+    if (priv2pub(&pub_keys[k], priv_key) != 0) { return -1; }
+  }
+  unsigned char *registers = malloc(num_buckets);
+  struct UnrolledCipherText *out = malloc((size_t)nkeys*num_buckets*sizeof (struct UnrolledCipherText));
+  if ((registers == NULL) || (out == NULL)) {
+    return_val = -1;
+    goto cleanup;
+  }
+  for (unsigned int i=0; i<num_buckets; i++) {
+    registers[i] = (unsigned char)randombytes_uniform(BUCKET_MAX+1);
+  }
+  printf("Encrypting %u buckets to several keys\n", num_buckets);
+  for (unsigned int m=2; m<=nkeys; m++) {
+    double t0 = now();
+    for (unsigned int k=0; k<m; k++) {
+      for (unsigned int i=0; i<num_buckets; i++) {
+        if (unroll_and_encrypt_ref(&out[(size_t)k*num_buckets + i], registers[i], &pub_keys[k]) != 0) { return_val = -1; goto cleanup; }
+      }
+    }
+    double baseline = now() - t0;
+    char name[64];
+    snprintf(name, sizeof name, "%u keys, one at a time", m);
+    report(name, baseline, m*num_buckets, baseline);
+    t0 = now();
+    for (unsigned int i=0; i<num_buckets; i++) {
+      if (unroll_and_encrypt_multi(&out[(size_t)i*m], registers[i], pub_keys, m) != 0) { return_val = -1; goto cleanup; }
+    }
+    snprintf(name, sizeof name, "%u keys, shared nonces", m);
+    report(name, now() - t0, m*num_buckets, baseline);
+  }
+
+  cleanup:
+  free(registers);
+  free(out);
+  return return_val;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned int n = (argc > 1) ? (unsigned int)strtoul(argv[1], NULL, 10) : 256*BUCKET_MAX;
+  int num_threads = (argc > 2) ? atoi(argv[2]) : 0;
+  if (sodium_init() < 0) {
+    /* Panic!  library couldn't be initialized */
+    exit(-1);
+  }
+  if (bench_partial_decryptions(n, num_threads) != 0) { return 1; }
+  if (bench_streamed_file(n) != 0) { return 1; }
+  if (bench_partial_proof(n) != 0) { return 1; }
+  if (bench_bit_encoding(n) != 0) { return 1; }
+  if (bench_multi_recipient(n) != 0) { return 1; }
+  return 0;
+}
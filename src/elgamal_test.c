@@ -18,11 +18,17 @@ int clean_suite(void);
 void test_roundtrip(void);
 void test_zero(void);
 void test_add(void);
+void test_add_in_place(void);
 void test_private_equality(void);
 void test_private_not_equality(void);
 void test_roundtrip_rolling(void);
 void test_roundtrip_array(void);
 void test_array_max(void);
+void test_merge_registers(void);
+void test_estimate_cardinality(void);
+void test_inclusion_exclusion(void);
+void test_arena(void);
+void test_rerandomize(void);
 
 int init_suite(void) {
   if (sodium_init() < 0) {
@@ -86,6 +92,38 @@ void test_add(void) {
   struct PlainText dmsg;
   CU_ASSERT(decrypt(&dmsg, emsg_sum, priv_key) == 0);
   CU_ASSERT(decode_equal(dmsg, 333)==0);
+  // Values up to 255 are looked up in a table, and larger ones computed
+  unsigned int values[4] = {0, 1, 255, 256};
+  for (int k=0; k<4; k++) {
+    encode(&msg1, values[k]);
+    CU_ASSERT(decode_ref(&msg1) == values[k] % 256);
+    CU_ASSERT(decode_equal_ref(&msg1, values[k]) == 0);
+    CU_ASSERT(decode_equal_ref(&msg1, values[k]+1) == -1);
+  }
+}
+
+void test_add_in_place(void) {
+  struct PrivateKey priv_key;
+  generate_key(&priv_key);
+  struct PublicKey pub_key;
+  CU_ASSERT(priv2pub_ref(&pub_key, &priv_key) == 0);
+
+  struct PlainText msg;
+  struct CipherText emsg[4];
+  for (unsigned int i=0; i<4; i++) {
+    CU_ASSERT(encode(&msg, 100+i) == 0);
+    CU_ASSERT(encrypt_ref(&emsg[i], &msg, &pub_key) == 0);
+  }
+  // The array kernel gives the same sums as adding one pair at a time
+  struct CipherText expected[2];
+  CU_ASSERT(add_ciphertext(&expected[0], emsg[0], emsg[2]) == 0);
+  CU_ASSERT(add_ciphertext(&expected[1], emsg[1], emsg[3]) == 0);
+  CU_ASSERT(add_all_ciphertexts((unsigned char *)&emsg[0], (unsigned char *)&emsg[2], 2) == 0);
+  CU_ASSERT(memcmp(emsg, expected, sizeof expected) == 0);
+  // Adding into one of the arguments
+  CU_ASSERT(add_ciphertext_ref(&emsg[0], &emsg[0], &emsg[1]) == 0);
+  CU_ASSERT(decrypt_ref(&msg, &emsg[0], &priv_key) == 0);
+  CU_ASSERT(decode_equal_ref(&msg, 100+102+101+103) == 0);
 }
 
 void test_private_equality(void) {
@@ -218,12 +256,91 @@ void test_array_max(void) {
   CU_ASSERT(uarr[num]==0);
 }
 
+void test_merge_registers(void) {
+  // Long enough to cover both the vectorized body and the scalar tail
+  unsigned int num = BUCKET_MAX + 7;
+  unsigned char arr[num];
+  unsigned char arr2[num];
+  unsigned char arr3[num];
+  for (unsigned int i=0; i<num; i++) {
+    arr[i] = i % (BUCKET_MAX+1);
+    arr2[i] = (i*7+5) % (BUCKET_MAX+1);
+    arr3[i] = arr[i] > arr2[i] ? arr[i] : arr2[i];
+  }
+  CU_ASSERT(merge_registers(arr, arr2, num) == 0);
+  CU_ASSERT(memcmp(arr, arr3, num) == 0);
+}
+
+void test_estimate_cardinality(void) {
+  unsigned int num = 1024;
+  unsigned char arr[num];
+  // All registers zero means nothing was inserted
+  memset(arr, 0, num);
+  CU_ASSERT(estimate_cardinality(arr, num) == 0);
+  // Half the registers set is the linear counting regime: m ln 2
+  for (unsigned int i=0; i<num; i++) {arr[i] = i % 2; }
+  CU_ASSERT(fabs(estimate_cardinality(arr, num) - num*log(2.0)) < 1e-6);
+  // Every register at 10 is roughly m * 2^10 in the raw estimator
+  memset(arr, 10, num);
+  double est = estimate_cardinality(arr, num);
+  CU_ASSERT((est > 0.7*num*1024) && (est < 0.73*num*1024));
+}
+
+void test_inclusion_exclusion(void) {
+  // A = {0,1,2}, B = {2,3} as bitmasks 0b01 and 0b10
+  uint64_t queries[2] = {3, 1};
+  uint64_t unions[2 << MAX_INTERSECTION_ARITY];
+  int num_unions = intersection_unions(unions, queries, 2);
+  // {A,B}, {B}, {A} -- the second query reuses {A}
+  CU_ASSERT(num_unions == 3);
+  double estimates[3];
+  for (int u=0; u<num_unions; u++) {
+    estimates[u] = (unions[u] == 3) ? 4 : ((unions[u] == 1) ? 3 : 2);
+  }
+  CU_ASSERT(inclusion_exclusion(3, unions, estimates, num_unions) == 1);
+  CU_ASSERT(inclusion_exclusion(1, unions, estimates, num_unions) == 3);
+}
+
+void test_arena(void) {
+  struct Arena a;
+  arena_init(&a, false);
+  for (int round=0; round<3; round++) {
+    unsigned char *x = arena_alloc(&a, 100);
+    unsigned char *y = arena_alloc(&a, 1 << 20);
+    unsigned char *z = arena_alloc(&a, 3);
+    CU_ASSERT((x != NULL) && (y != NULL) && (z != NULL));
+    CU_ASSERT(((uintptr_t)x % 64 == 0) && ((uintptr_t)y % 64 == 0) && ((uintptr_t)z % 64 == 0));
+    memset(x, 1, 100);
+    memset(y, 2, 1 << 20);
+    memset(z, 3, 3);
+    CU_ASSERT((x[99] == 1) && (y[0] == 2) && (z[2] == 3));
+    // The first run maps a block per allocation, later runs fit in one
+    if (round > 0) {
+      CU_ASSERT(a.head->next == NULL);
+    }
+    arena_reset(&a);
+  }
+  arena_free(&a);
+  CU_ASSERT(a.head == NULL);
+}
+
 /* ******************************
 *  Suite 2 - IO tests
 * ***************************** */
 int init_suite2(void);
 int clean_suite2(void);
 void test_distributed_keygen(void);
+void test_subset_union(void);
+void test_context(void);
+void test_soa_layout(void);
+void test_validate_points(void);
+void test_read_registers(void);
+void test_bucket_range(void);
+void test_stream_io_uring(void);
+void test_threshold_keygen(void);
+void test_partial_proof(void);
+void test_max_protocol(void);
+void test_multi_recipient(void);
 
 int init_suite2(void) {
   if (sodium_init() < 0) {
@@ -272,6 +389,576 @@ void test_distributed_keygen(void) {
 
 }
 
+void test_threshold_keygen(void) {
+  char tmpdir[64];
+  snprintf(tmpdir, 64, "tmp%lu-%d", (unsigned long)time(NULL), rand());
+  CU_ASSERT(mkdir(tmpdir, 0777)==0);
+  int t = 3;
+  int n = 5;
+  char priv_fns[n][128];
+  char *priv_fns_ptrs[n];
+  for (int i=0; i<n; i++) {
+    snprintf(priv_fns[i], 128, "%s/node%d.priv", tmpdir, i+1);
+    priv_fns_ptrs[i] = priv_fns[i];
+  }
+  char pub_fn[128];
+  snprintf(pub_fn, 128, "%s/combined.pub", tmpdir);
+  CU_ASSERT(threshold_keygen(t, n, pub_fn, priv_fns_ptrs, NULL) == 0);
+  struct PublicKey pub_key;
+  CU_ASSERT(read_pubkey(&pub_key, pub_fn) == 0);
+
+  // Any t shares interpolate the private key, fewer do not
+  unsigned int indices[3] = {5, 2, 4};
+  unsigned char lambdas[3*crypto_core_ristretto255_SCALARBYTES];
+  for (int count=2; count<=3; count++) {
+    CU_ASSERT(lagrange_coefficients(lambdas, indices, count) == 0);
+    struct PrivateKey key;
+    struct PrivateKey share;
+    memset(key.val, 0, sizeof key.val);
+    for (int i=0; i<count; i++) {
+      CU_ASSERT(read_privkey(&share, priv_fns[indices[i]-1]) == 0);
+      crypto_core_ristretto255_scalar_mul(share.val, share.val, &lambdas[i*crypto_core_ristretto255_SCALARBYTES]);
+      crypto_core_ristretto255_scalar_add(key.val, key.val, share.val);
+    }
+    struct PublicKey pub_key2;
+    CU_ASSERT(priv2pub(&pub_key2, key) == 0);
+    CU_ASSERT((sodium_memcmp(pub_key.val, pub_key2.val, sizeof pub_key.val) == 0) == (count == t));
+  }
+  unsigned int repeated[2] = {2, 2};
+  CU_ASSERT(lagrange_coefficients(lambdas, repeated, 2) < 0);
+
+  char *fn;
+  unsigned int index;
+  CU_ASSERT((parse_share_arg(&index, &fn, "12:node.ss") == 1) && (index == 12) && (strcmp(fn, "node.ss") == 0));
+  CU_ASSERT(parse_share_arg(&index, &fn, "node.ss") == 0);
+  CU_ASSERT(parse_share_arg(&index, &fn, "0:node.ss") == 0);
+}
+
+void test_subset_union(void) {
+  char tmpdir[64];
+  snprintf(tmpdir, 64, "tmp%lu-%d", (unsigned long)time(NULL), rand());
+  CU_ASSERT(mkdir(tmpdir, 0777)==0);
+  struct PrivateKey priv_key;
+  generate_key(&priv_key);
+  struct PublicKey pub_key;
+  CU_ASSERT(priv2pub(&pub_key, priv_key) == 0);
+
+  int ncount = 5;
+  unsigned int num = 4;
+  unsigned int uct_size = sizeof (((struct UnrolledCipherText*)0)->arr);
+  unsigned char arr[ncount][num+1];
+  char fns[ncount][128];
+  char *fns_ptrs[ncount];
+  unsigned char earr[num*uct_size];
+  for (int p=0; p<ncount; p++) {
+    for (unsigned int i=0; i<num; i++) {arr[p][i] = (unsigned char)(((unsigned int)p*7 + i*5) % (BUCKET_MAX+1)); }
+    arr[p][num] = 255;
+    CU_ASSERT(encrypt_buckets(earr, arr[p], pub_key, num) == (int)num);
+    snprintf(fns[p], 128, "%s/party%d.bin", tmpdir, p);
+    fns_ptrs[p] = fns[p];
+    FILE *fp = fopen(fns[p], "wb");
+    CU_ASSERT(fwrite(earr, 1, sizeof earr, fp) == sizeof earr);
+    fclose(fp);
+  }
+
+  struct CipherTextSumTree t;
+  CU_ASSERT(sum_tree_init(&t, fns_ptrs, ncount) == 0);
+  bool all[5] = {true, true, true, true, true};
+  bool some[5] = {true, false, true, true, false};
+  bool leave_one_out[5] = {true, true, true, false, true};
+  bool none[5] = {false, false, false, false, false};
+  bool *subsets[3] = {all, some, leave_one_out};
+  int max_pieces[3] = {1, 3, 3};
+  for (int q=0; q<3; q++) {
+    int pieces = sum_tree_subset(earr, &t, subsets[q]);
+    CU_ASSERT((pieces > 0) && (pieces <= max_pieces[q]));
+    unsigned char expected[num];
+    memset(expected, 0, num);
+    for (int p=0; p<ncount; p++) {
+      if (subsets[q][p]) { merge_registers(expected, arr[p], num); }
+    }
+    unsigned char uarr[num+1];
+    CU_ASSERT(decrypt_buckets(uarr, earr, priv_key, num) == (int)num);
+    CU_ASSERT(memcmp(uarr, expected, num) == 0);
+  }
+  CU_ASSERT(sum_tree_subset(earr, &t, none) < 0);
+  sum_tree_free(&t);
+}
+
+void test_context(void) {
+  char tmpdir[64];
+  snprintf(tmpdir, 64, "tmp%lu-%d", (unsigned long)time(NULL), rand());
+  CU_ASSERT(mkdir(tmpdir, 0777)==0);
+  char priv_fn[128];
+  char pub_fn[128];
+  snprintf(priv_fn, 128, "%s/node.priv", tmpdir);
+  snprintf(pub_fn, 128, "%s/node.pub", tmpdir);
+  CU_ASSERT(keygen_node(priv_fn, pub_fn)==0);
+
+  struct MpcHllContext ctx;
+  CU_ASSERT(context_init(&ctx, 4) == 0);
+  CU_ASSERT(context_load_privkey(&ctx, priv_fn) == 0);
+
+  unsigned int num = 100;
+  unsigned int uct_size = sizeof (((struct UnrolledCipherText*)0)->arr);
+  unsigned char arr[num+1];
+  for (unsigned int i=0; i<num; i++) {arr[i] = i % (BUCKET_MAX+1); }
+  arr[num] = 255;
+  unsigned char *earr = malloc(num*uct_size);
+  unsigned char *ss = malloc(num*uct_size/2);
+  unsigned char uarr[num+1];
+  // Reuse the same context for several rounds
+  for (int round=0; round<2; round++) {
+    CU_ASSERT(context_encrypt_buckets(&ctx, earr, arr, num) == (int)num);
+    CU_ASSERT(context_decrypt_buckets(&ctx, uarr, earr, num) == (int)num);
+    CU_ASSERT(memcmp(uarr, arr, num) == 0);
+    CU_ASSERT(decrypt_buckets(uarr, earr, ctx.priv_key, num) == (int)num);
+    CU_ASSERT(memcmp(uarr, arr, num) == 0);
+    CU_ASSERT(context_partial_decryptions(&ctx, ss, earr, num*BUCKET_MAX) == 0);
+    CU_ASSERT(context_decrypt_buckets_with_sec(&ctx, uarr, earr, ss, num) == (int)num);
+    CU_ASSERT(memcmp(uarr, arr, num) == 0);
+    CU_ASSERT(decrypt_buckets_with_sec(uarr, earr, ss, num) == (int)num);
+    CU_ASSERT(memcmp(uarr, arr, num) == 0);
+  }
+
+  // Streaming file version matches the stateless one
+  char in_fn[128];
+  char out_fn[128];
+  char out_fn2[128];
+  snprintf(in_fn, 128, "%s/array.bin", tmpdir);
+  snprintf(out_fn, 128, "%s/array.ss", tmpdir);
+  snprintf(out_fn2, 128, "%s/array_ctx.ss", tmpdir);
+  FILE *fp = fopen(in_fn, "wb");
+  CU_ASSERT(fwrite(earr, 1, num*uct_size, fp) == num*uct_size);
+  fclose(fp);
+  CU_ASSERT(get_partial_decryptions(priv_fn, in_fn, out_fn) == 0);
+  CU_ASSERT(context_get_partial_decryptions(&ctx, in_fn, out_fn2) == 0);
+  unsigned char *ss2 = malloc(num*uct_size/2);
+  CU_ASSERT(read_partial_decryption_file(ss, out_fn, (int)(num*uct_size/2)) == (int)(num*BUCKET_MAX));
+  CU_ASSERT(read_partial_decryption_file(ss2, out_fn2, (int)(num*uct_size/2)) == (int)(num*BUCKET_MAX));
+  CU_ASSERT(memcmp(ss, ss2, num*uct_size/2) == 0);
+
+  free(earr);
+  free(ss);
+  free(ss2);
+  context_free(&ctx);
+}
+
+void test_soa_layout(void) {
+  char tmpdir[64];
+  snprintf(tmpdir, 64, "tmp%lu-%d", (unsigned long)time(NULL), rand());
+  CU_ASSERT(mkdir(tmpdir, 0777)==0);
+  char priv_fn[128];
+  char pub_fn[128];
+  snprintf(priv_fn, 128, "%s/node.priv", tmpdir);
+  snprintf(pub_fn, 128, "%s/node.pub", tmpdir);
+  CU_ASSERT(keygen_node(priv_fn, pub_fn)==0);
+  struct PublicKey pub_key;
+  CU_ASSERT(read_pubkey(&pub_key, pub_fn)==0);
+
+  unsigned int num = 300;
+  unsigned int uct_size = sizeof (((struct UnrolledCipherText*)0)->arr);
+  unsigned int n = num*BUCKET_MAX;
+  unsigned char arr[num+1];
+  for (unsigned int i=0; i<num; i++) {arr[i] = (unsigned char)((i*3) % (BUCKET_MAX+1)); }
+  arr[num] = 255;
+  unsigned char *earr = malloc(num*uct_size);
+  unsigned char *earr2 = malloc(num*uct_size);
+  unsigned char *soa = malloc(num*uct_size);
+  CU_ASSERT(encrypt_buckets(earr, arr, pub_key, num) == (int)num);
+
+  // In memory round trip
+  CU_ASSERT(ciphertexts_to_soa(soa, soa + n*crypto_core_ristretto255_BYTES, earr, n) == 0);
+  CU_ASSERT(ciphertexts_from_soa(earr2, soa, soa + n*crypto_core_ristretto255_BYTES, n) == 0);
+  CU_ASSERT(memcmp(earr, earr2, num*uct_size) == 0);
+
+  // File conversion matches the in memory one, and round trips
+  char in_fn[128];
+  char soa_fn[128];
+  char aos_fn[128];
+  char ss_fn[128];
+  char out_fn[128];
+  snprintf(in_fn, 128, "%s/array.bin", tmpdir);
+  snprintf(soa_fn, 128, "%s/array_soa.bin", tmpdir);
+  snprintf(aos_fn, 128, "%s/array_aos.bin", tmpdir);
+  snprintf(ss_fn, 128, "%s/array_soa.ss", tmpdir);
+  snprintf(out_fn, 128, "%s/array_soa.txt", tmpdir);
+  FILE *fp = fopen(in_fn, "wb");
+  CU_ASSERT(fwrite(earr, 1, num*uct_size, fp) == num*uct_size);
+  fclose(fp);
+  CU_ASSERT(convert_CipherText_file_layout(in_fn, soa_fn, true) == 0);
+  CU_ASSERT(convert_CipherText_file_layout(soa_fn, aos_fn, false) == 0);
+  fp = fopen(soa_fn, "rb");
+  CU_ASSERT(fread(earr2, 1, num*uct_size, fp) == num*uct_size);
+  fclose(fp);
+  CU_ASSERT(memcmp(soa, earr2, num*uct_size) == 0);
+  fp = fopen(aos_fn, "rb");
+  CU_ASSERT(fread(earr2, 1, num*uct_size, fp) == num*uct_size);
+  fclose(fp);
+  CU_ASSERT(memcmp(earr, earr2, num*uct_size) == 0);
+
+  // Partial decryption and decryption straight from the SoA file
+  CU_ASSERT(get_partial_decryptions_soa(priv_fn, soa_fn, ss_fn) == 0);
+  unsigned char *ss = malloc(num*uct_size/2);
+  CU_ASSERT(read_partial_decryption_file(ss, ss_fn, (int)(num*uct_size/2)) == (int)n);
+  unsigned char uarr[num+1];
+  CU_ASSERT(decrypt_buckets_with_sec_soa(uarr, soa + n*crypto_core_ristretto255_BYTES, ss, num) == (int)num);
+  CU_ASSERT(memcmp(uarr, arr, num) == 0);
+  CU_ASSERT(decrypt_bucket_file_with_sec_soa(ss_fn, soa_fn, out_fn) == 0);
+
+  free(earr);
+  free(earr2);
+  free(soa);
+  free(ss);
+}
+
+void test_validate_points(void) {
+  char tmpdir[64];
+  snprintf(tmpdir, 64, "tmp%lu-%d", (unsigned long)time(NULL), rand());
+  CU_ASSERT(mkdir(tmpdir, 0777)==0);
+  struct PrivateKey priv_key;
+  generate_key(&priv_key);
+  struct PublicKey pub_key;
+  CU_ASSERT(priv2pub(&pub_key, priv_key) == 0);
+
+  unsigned int num = 40;
+  unsigned int uct_size = sizeof (((struct UnrolledCipherText*)0)->arr);
+  unsigned char arr[num+1];
+  for (unsigned int i=0; i<num; i++) {arr[i] = (unsigned char)(i % (BUCKET_MAX+1)); }
+  arr[num] = 255;
+  unsigned char *earr = malloc(num*uct_size);
+  CU_ASSERT(encrypt_buckets(earr, arr, pub_key, num) == (int)num);
+  size_t num_points = num*uct_size/crypto_core_ristretto255_BYTES;
+  CU_ASSERT(validate_points(NULL, earr, num_points, "earr", 0, 2*BUCKET_MAX) == 0);
+
+  char fn[128];
+  snprintf(fn, 128, "%s/array.bin", tmpdir);
+  FILE *fp = fopen(fn, "wb");
+  CU_ASSERT(fwrite(earr, 1, num*uct_size, fp) == num*uct_size);
+  fclose(fp);
+  CU_ASSERT(read_binary_CipherText_file(earr, fn, (int)(num*uct_size)) == (int)(num*BUCKET_MAX));
+
+  // A non-canonical encoding in the c2 of bucket 37 is caught by the reader
+  memset(&earr[37*uct_size + crypto_core_ristretto255_BYTES], 0xff, crypto_core_ristretto255_BYTES);
+  CU_ASSERT(validate_points(NULL, earr, num_points, "earr", 0, 2*BUCKET_MAX) != 0);
+  fp = fopen(fn, "wb");
+  CU_ASSERT(fwrite(earr, 1, num*uct_size, fp) == num*uct_size);
+  fclose(fp);
+  CU_ASSERT(read_binary_CipherText_file(earr, fn, (int)(num*uct_size)) < 0);
+  free(earr);
+}
+
+void test_read_registers(void) {
+  char tmpdir[64];
+  snprintf(tmpdir, 64, "tmp%lu-%d", (unsigned long)time(NULL), rand());
+  CU_ASSERT(mkdir(tmpdir, 0777)==0);
+  char fn[128];
+  snprintf(fn, 128, "%s/registers.txt", tmpdir);
+  unsigned char ans[8];
+
+  // Same results as strtoimax on each line, including the last unterminated one
+  FILE *fp = fopen(fn, "w");
+  fprintf(fp, "12\n  7\n+3\n5abc\n\nx\n-0\n%d", BUCKET_MAX);
+  fclose(fp);
+  unsigned char expected[9] = {12, 7, 3, 5, 0, 0, 0, BUCKET_MAX, 255};
+  unsigned char big[9];
+  CU_ASSERT(read_file_to_array(big, fn, 8) == 8);
+  CU_ASSERT(memcmp(big, expected, 9) == 0);
+  // One line more than buf_size is an error, and its value is not stored
+  // in the slot kept for the delimiter
+  memset(ans, 0xaa, sizeof ans);
+  CU_ASSERT(read_file_to_array(ans, fn, 7) < 0);
+  CU_ASSERT(ans[7] == 0xaa);
+
+  fp = fopen(fn, "w");
+  fputs("1\n-1\n", fp);
+  fclose(fp);
+  CU_ASSERT(read_file_to_array(big, fn, 8) < 0);
+  // Values above BUCKET_MAX are rejected, or clamped to it
+  for (int k=0; k<2; k++) {
+    fp = fopen(fn, "w");
+    fprintf(fp, "1\n%s%d\n", (k == 0) ? "" : "99999999999999999999999", BUCKET_MAX+1);
+    fclose(fp);
+    if (CLAMP_REGISTERS) {
+      CU_ASSERT(read_file_to_array(big, fn, 8) == 2);
+      CU_ASSERT(big[1] == BUCKET_MAX);
+    } else {
+      CU_ASSERT(read_file_to_array(big, fn, 8) < 0);
+    }
+  }
+  fp = fopen(fn, "w");
+  fclose(fp);
+  CU_ASSERT(read_file_to_array(big, fn, 8) == 0);
+  CU_ASSERT(big[0] == 255);
+}
+
+void test_bucket_range(void) {
+  struct BucketRange r;
+  CU_ASSERT(parse_bucket_range(&r, "16:32") == 0);
+  CU_ASSERT((r.start == 16) && (r.end == 32));
+  CU_ASSERT(parse_bucket_range(&r, "100:") == 0);
+  CU_ASSERT((r.start == 100) && (r.end == BUCKET_RANGE_END));
+  const char *bad[5] = {"", "16", ":32", "32:16", "1:2x"};
+  for (int k=0; k<5; k++) {
+    CU_ASSERT(parse_bucket_range(&r, bad[k]) < 0);
+  }
+
+  // The option and its value are taken out of argv, wherever they are
+  char *argv[6] = {"prog", "a", "--range", "0:8", "b", NULL};
+  int argc = 5;
+  CU_ASSERT(take_range_option(&r, &argc, argv) == 1);
+  CU_ASSERT((argc == 3) && (r.start == 0) && (r.end == 8));
+  CU_ASSERT((strcmp(argv[1], "a") == 0) && (strcmp(argv[2], "b") == 0) && (argv[3] == NULL));
+  CU_ASSERT(take_range_option(&r, &argc, argv) == 0);
+  CU_ASSERT((argc == 3) && (r.start == 0) && (r.end == BUCKET_RANGE_END));
+  char *missing[3] = {"prog", "-range", NULL};
+  argc = 2;
+  CU_ASSERT(take_range_option(&r, &argc, missing) < 0);
+}
+
+// Streams give the same output with io_uring and with threads, over
+// several chunks and from the middle of the files
+void test_stream_io_uring(void) {
+  char tmpdir[64];
+  snprintf(tmpdir, 64, "tmp%lu-%d", (unsigned long)time(NULL), rand());
+  CU_ASSERT(mkdir(tmpdir, 0777)==0);
+  unsigned int num = 3*STREAM_CHUNK_BUCKETS;
+  size_t bucket_bytes = BUCKET_MAX*2*crypto_core_ristretto255_BYTES;
+  struct BucketRange range = {100, num-10};
+  size_t out_bytes = (range.end - range.start)*bucket_bytes;
+  char in_fns[2][128], out_fns[2][128];
+  char *fns[2] = {in_fns[0], in_fns[1]};
+  unsigned char *buf = malloc(num*bucket_bytes);
+  unsigned char *out = malloc(2*out_bytes);
+  CU_ASSERT((buf != NULL) && (out != NULL));
+  if ((buf == NULL) || (out == NULL)) {
+    free(buf);
+    free(out);
+    return;
+  }
+  for (int k=0; k<2; k++) {
+    snprintf(in_fns[k], 128, "%s/in%d.bin", tmpdir, k);
+    snprintf(out_fns[k], 128, "%s/out%d.bin", tmpdir, k);
+    for (size_t i=0; i<num*bucket_bytes/crypto_core_ristretto255_BYTES; i++) {
+      crypto_core_ristretto255_random(&buf[i*crypto_core_ristretto255_BYTES]);
+    }
+    FILE *fp = fopen(in_fns[k], "wb");
+    CU_ASSERT((fp != NULL) && (fwrite(buf, bucket_bytes, num, fp) == num));
+    fclose(fp);
+  }
+  // The ring has to run whenever it is available, rather than quietly
+  // leave the stream to the threads
+  bool ring = stream_use_io_uring(true);
+  unsigned long runs = stream_io_uring_runs();
+  CU_ASSERT(combine_binary_CipherText_files_range(out_fns[0], fns, 2, range) == 0);
+  CU_ASSERT(stream_io_uring_runs() == runs + (ring ? 1 : 0));
+  if (!ring) {
+    printf("\n  io_uring is not available here, only the threads were tested ");
+  }
+  CU_ASSERT(stream_use_io_uring(false) == false);
+  runs = stream_io_uring_runs();
+  CU_ASSERT(combine_binary_CipherText_files_range(out_fns[1], fns, 2, range) == 0);
+  CU_ASSERT(stream_io_uring_runs() == runs);
+  stream_use_io_uring(true);
+  for (size_t k=0; k<2; k++) {
+    FILE *fp = fopen(out_fns[k], "rb");
+    CU_ASSERT((fp != NULL) && (fread(&out[k*out_bytes], 1, out_bytes, fp) == out_bytes) && (fgetc(fp) == EOF));
+    fclose(fp);
+  }
+  CU_ASSERT(memcmp(out, &out[out_bytes], out_bytes) == 0);
+  free(buf);
+  free(out);
+}
+
+void test_rerandomize(void) {
+  struct PrivateKey priv_key;
+  generate_key(&priv_key);
+  struct PublicKey pub_key;
+  CU_ASSERT(priv2pub(&pub_key, priv_key) == 0);
+
+  unsigned int num = 10;
+  unsigned int uct_size = sizeof (((struct UnrolledCipherText*)0)->arr);
+  unsigned char arr[num+1];
+  for (unsigned int i=0; i<num; i++) {arr[i] = (unsigned char)((i*3) % (BUCKET_MAX+1)); }
+  arr[num] = 255;
+  unsigned char earr[num*uct_size];
+  unsigned char earr2[num*uct_size];
+  CU_ASSERT(encrypt_buckets(earr, arr, pub_key, num) == (int)num);
+  memcpy(earr2, earr, sizeof earr);
+  CU_ASSERT(rerandomize_ciphertexts(NULL, earr2, num*BUCKET_MAX, &pub_key) == 0);
+  // Every c1 and c2 changes, but the plaintexts do not
+  for (unsigned int k=0; k<2*num*BUCKET_MAX; k++) {
+    CU_ASSERT(memcmp(&earr[k*crypto_core_ristretto255_BYTES], &earr2[k*crypto_core_ristretto255_BYTES], crypto_core_ristretto255_BYTES) != 0);
+  }
+  unsigned char uarr[num+1];
+  CU_ASSERT(decrypt_buckets(uarr, earr2, priv_key, num) == (int)num);
+  CU_ASSERT(memcmp(uarr, arr, num) == 0);
+
+  // Blinding, alone and fused with rerandomization, keeps the registers but
+  // changes the random points in the nonzero slots. Bucket 1 holds 3
+  struct PlainText before;
+  struct PlainText after;
+  const struct UnrolledCipherText *uct = (const struct UnrolledCipherText *)earr;
+  CU_ASSERT(decrypt_ref(&before, &uct[1].arr[0], &priv_key) == 0);
+  for (int fused=0; fused<2; fused++) {
+    memcpy(earr2, earr, sizeof earr);
+    CU_ASSERT(blind_ciphertexts(NULL, earr2, num*BUCKET_MAX, fused ? &pub_key : NULL) == 0);
+    CU_ASSERT(decrypt_buckets(uarr, earr2, priv_key, num) == (int)num);
+    CU_ASSERT(memcmp(uarr, arr, num) == 0);
+    uct = (const struct UnrolledCipherText *)earr2;
+    CU_ASSERT(decrypt_ref(&after, &uct[1].arr[0], &priv_key) == 0);
+    CU_ASSERT(memcmp(before.val, after.val, sizeof before.val) != 0);
+  }
+}
+
+void test_partial_proof(void) {
+  char tmpdir[64];
+  snprintf(tmpdir, 64, "tmp%lu-%d", (unsigned long)time(NULL), rand());
+  CU_ASSERT(mkdir(tmpdir, 0777)==0);
+  char priv_fn[128], pub_fn[128], other_priv_fn[128], other_pub_fn[128];
+  char input_fn[128], ss_fn[128], proof_fn[128];
+  snprintf(priv_fn, 128, "%s/node.priv", tmpdir);
+  snprintf(pub_fn, 128, "%s/node.pub", tmpdir);
+  snprintf(other_priv_fn, 128, "%s/other.priv", tmpdir);
+  snprintf(other_pub_fn, 128, "%s/other.pub", tmpdir);
+  snprintf(input_fn, 128, "%s/input.bin", tmpdir);
+  snprintf(ss_fn, 128, "%s/node.ss", tmpdir);
+  snprintf(proof_fn, 128, "%s/node.proof", tmpdir);
+  CU_ASSERT(keygen_node(priv_fn, pub_fn) == 0);
+  CU_ASSERT(keygen_node(other_priv_fn, other_pub_fn) == 0);
+  struct PublicKey pub_key;
+  CU_ASSERT(read_pubkey(&pub_key, pub_fn) == 0);
+
+  unsigned int num = 6;
+  unsigned int uct_size = sizeof (((struct UnrolledCipherText*)0)->arr);
+  unsigned char arr[num+1];
+  for (unsigned int i=0; i<num; i++) {arr[i] = (unsigned char)((i*5) % (BUCKET_MAX+1)); }
+  arr[num] = 255;
+  unsigned char earr[num*uct_size];
+  CU_ASSERT(encrypt_buckets(earr, arr, pub_key, num) == (int)num);
+  FILE *fp = fopen(input_fn, "wb");
+  CU_ASSERT((fp != NULL) && (fwrite(earr, uct_size, num, fp) == num));
+  fclose(fp);
+
+  struct BucketRange ranges[2] = {ALL_BUCKETS, {2, 5}};
+  for (int k=0; k<2; k++) {
+    CU_ASSERT(get_partial_decryptions_range(priv_fn, input_fn, ss_fn, proof_fn, ranges[k], false) == 0);
+    CU_ASSERT(verify_partial_decryptions_range(pub_fn, input_fn, ss_fn, proof_fn, ranges[k], false) == 0);
+    CU_ASSERT(verify_partial_decryptions_range(other_pub_fn, input_fn, ss_fn, proof_fn, ranges[k], false) == -3);
+  }
+  // A shared secret from another key, or for another range, does not verify
+  struct BucketRange shifted = {3, 6};
+  CU_ASSERT(verify_partial_decryptions_range(pub_fn, input_fn, ss_fn, proof_fn, shifted, false) == -3);
+  CU_ASSERT(get_partial_decryptions_range(other_priv_fn, input_fn, ss_fn, NULL, ranges[1], false) == 0);
+  CU_ASSERT(verify_partial_decryptions_range(pub_fn, input_fn, ss_fn, proof_fn, ranges[1], false) == -3);
+  // Nor does a single shared secret changed to another point, and one
+  // changed to a non canonical encoding is not even read
+  unsigned char bad[2][crypto_core_ristretto255_BYTES];
+  crypto_core_ristretto255_random(bad[0]);
+  memset(bad[1], 0xff, sizeof bad[1]);
+  bad[1][0] = 0xee;
+  bad[1][31] = 0x7f;
+  for (int k=0; k<2; k++) {
+    CU_ASSERT(get_partial_decryptions_range(priv_fn, input_fn, ss_fn, proof_fn, ALL_BUCKETS, false) == 0);
+    fp = fopen(ss_fn, "r+b");
+    CU_ASSERT((fp != NULL) && (fseek(fp, 7*crypto_core_ristretto255_BYTES, SEEK_SET) == 0) && (fwrite(bad[k], sizeof bad[k], 1, fp) == 1));
+    fclose(fp);
+    CU_ASSERT(verify_partial_decryptions_range(pub_fn, input_fn, ss_fn, proof_fn, ALL_BUCKETS, false) == ((k == 0) ? -3 : -1));
+  }
+}
+
+void test_multi_recipient(void) {
+  struct PrivateKey priv_keys[3];
+  struct PublicKey pub_keys[3];
+  for (int k=0; k<3; k++) {
+    generate_key(&priv_keys[k]);
+    CU_ASSERT(priv2pub(&pub_keys[k], priv_keys[k]) == 0);
+  }
+  struct UnrolledCipherText uct[3];
+  unsigned char values[3] = {0, 1, BUCKET_MAX};
+  for (int v=0; v<3; v++) {
+    CU_ASSERT(unroll_and_encrypt_multi(uct, values[v], pub_keys, 3) == 0);
+    for (int k=0; k<3; k++) {
+      unsigned char x;
+      CU_ASSERT((decrypt_and_reroll_ref(&x, &uct[k], &priv_keys[k]) == 0) && (x == values[v]));
+      CU_ASSERT(memcmp(uct[k].arr[BUCKET_MAX-1].c1, uct[0].arr[BUCKET_MAX-1].c1, crypto_core_ristretto255_BYTES) == 0);
+    }
+  }
+  CU_ASSERT(unroll_and_encrypt_multi(uct, BUCKET_MAX+1, pub_keys, 3) != 0);
+}
+
+void test_max_protocol(void) {
+  struct PrivateKey priv_key;
+  generate_key(&priv_key);
+  struct PublicKey pub_key;
+  CU_ASSERT(priv2pub(&pub_key, priv_key) == 0);
+
+  int ncount = 3;
+  unsigned char values[3][3] = {{0, 0, 0}, {7, BUCKET_MAX, 1}, {3, 2, 0}};
+  unsigned char expected[3] = {0, BUCKET_MAX, 3};
+  for (int k=0; k<3; k++) {
+    struct EqualityTests sums;
+    memset(&sums, 0, sizeof sums);
+    for (int i=0; i<ncount; i++) {
+      struct BitCipherText bct;
+      struct EqualityTests tests;
+      struct EqualityTests indicators;
+      unsigned char perm[BUCKET_MAX+1];
+      unsigned char x;
+      CU_ASSERT(encrypt_bits(&bct, values[k][i], &pub_key) == 0);
+      CU_ASSERT((decrypt_bits(&x, &bct, &priv_key) == 0) && (x == values[k][i]));
+      CU_ASSERT(equality_tests(&tests, perm, &bct) == 0);
+      CU_ASSERT(reencode_tests(&indicators, &tests, &priv_key, &pub_key) == 0);
+      CU_ASSERT(add_indicators(&sums, &indicators, perm) == 0);
+    }
+    struct UnrolledCipherText uct;
+    unsigned char max;
+    CU_ASSERT(indicators_to_unary(&uct, &sums) == 0);
+    CU_ASSERT(blind_ciphertexts(NULL, (unsigned char *)&uct, BUCKET_MAX, &pub_key) == 0);
+    CU_ASSERT((decrypt_and_reroll_ref(&max, &uct, &priv_key) == 0) && (max == expected[k]));
+  }
+
+  // A register above BUCKET_MAX has no test that holds
+  struct BitCipherText bct;
+  struct EqualityTests tests;
+  struct EqualityTests indicators;
+  unsigned char perm[BUCKET_MAX+1];
+  CU_ASSERT(encrypt_bits(&bct, BUCKET_MAX+1, &pub_key) < 0);
+  for (int i=0; i<BIT_WIDTH; i++) {
+    struct PlainText bit;
+    encode(&bit, 1);
+    CU_ASSERT(encrypt_ref(&bct.arr[i], &bit, &pub_key) == 0);
+  }
+  CU_ASSERT(equality_tests(&tests, perm, &bct) == 0);
+  CU_ASSERT(reencode_tests(&indicators, &tests, &priv_key, &pub_key) == -3);
+
+  // Two key holders: the tests only decrypt with the shares of both
+  struct PrivateKey priv_keys[2];
+  struct PublicKey pub_keys[2];
+  struct PublicKey combined;
+  struct PrivateKey combined_priv;
+  for (int k=0; k<2; k++) {
+    generate_key(&priv_keys[k]);
+    CU_ASSERT(priv2pub(&pub_keys[k], priv_keys[k]) == 0);
+  }
+  CU_ASSERT(crypto_core_ristretto255_add(combined.val, pub_keys[0].val, pub_keys[1].val) == 0);
+  crypto_core_ristretto255_scalar_add(combined_priv.val, priv_keys[0].val, priv_keys[1].val);
+  CU_ASSERT(encrypt_bits(&bct, 5, &combined) == 0);
+  CU_ASSERT(equality_tests(&tests, perm, &bct) == 0);
+  struct TestShares secs;
+  struct TestShares other;
+  CU_ASSERT(test_shares(&secs, &tests, &priv_keys[0]) == 0);
+  CU_ASSERT(reencode_tests_with_secs(&indicators, &tests, &secs, &combined) == -3);
+  CU_ASSERT(test_shares(&other, &tests, &priv_keys[1]) == 0);
+  CU_ASSERT(add_all_secrets((unsigned char *)&secs, (unsigned char *)&other, BUCKET_MAX+1) == 0);
+  CU_ASSERT(reencode_tests_with_secs(&indicators, &tests, &secs, &combined) == 0);
+  for (int t=0; t<=BUCKET_MAX; t++) {
+    struct PlainText m;
+    CU_ASSERT(decrypt_ref(&m, &indicators.arr[perm[t]], &combined_priv) == 0);
+    CU_ASSERT(decode_equal_ref(&m, (t == 5) ? 1 : 0) == 0);
+  }
+}
+
 /* ******************************
 * Actually run all the tests
 * ***************************** */
@@ -293,16 +980,33 @@ int main() {
   }
 
   if ( // Test Suite 1
-      (NULL == CU_add_test(pSuite1, "Testing round trip.....", test_roundtrip)),
-      (NULL == CU_add_test(pSuite1, "Testing encoding 0s.....", test_zero)),
-      (NULL == CU_add_test(pSuite1, "Testing addition.....", test_add)),
-      (NULL == CU_add_test(pSuite1, "Testing private equality.....", test_private_equality)),
-      (NULL == CU_add_test(pSuite1, "Testing private not equality.....", test_private_not_equality)),
-      (NULL == CU_add_test(pSuite1, "Testing roundtrip rolling.....", test_roundtrip_rolling)),
-      (NULL == CU_add_test(pSuite1, "Testing roundtrip array.....", test_roundtrip_array)),
-      (NULL == CU_add_test(pSuite1, "Testing array max.....", test_array_max)),
+      (NULL == CU_add_test(pSuite1, "Testing round trip.....", test_roundtrip)) ||
+      (NULL == CU_add_test(pSuite1, "Testing encoding 0s.....", test_zero)) ||
+      (NULL == CU_add_test(pSuite1, "Testing addition.....", test_add)) ||
+      (NULL == CU_add_test(pSuite1, "Testing addition in place.....", test_add_in_place)) ||
+      (NULL == CU_add_test(pSuite1, "Testing private equality.....", test_private_equality)) ||
+      (NULL == CU_add_test(pSuite1, "Testing private not equality.....", test_private_not_equality)) ||
+      (NULL == CU_add_test(pSuite1, "Testing roundtrip rolling.....", test_roundtrip_rolling)) ||
+      (NULL == CU_add_test(pSuite1, "Testing roundtrip array.....", test_roundtrip_array)) ||
+      (NULL == CU_add_test(pSuite1, "Testing array max.....", test_array_max)) ||
+      (NULL == CU_add_test(pSuite1, "Testing merge registers.....", test_merge_registers)) ||
+      (NULL == CU_add_test(pSuite1, "Testing cardinality estimate.....", test_estimate_cardinality)) ||
+      (NULL == CU_add_test(pSuite1, "Testing inclusion exclusion.....", test_inclusion_exclusion)) ||
+      (NULL == CU_add_test(pSuite1, "Testing arena.....", test_arena)) ||
+      (NULL == CU_add_test(pSuite1, "Testing rerandomize.....", test_rerandomize)) ||
       // Test Suite 2
-      (NULL == CU_add_test(pSuite2, "Testing distributed keygen.....", test_distributed_keygen))
+      (NULL == CU_add_test(pSuite2, "Testing distributed keygen.....", test_distributed_keygen)) ||
+      (NULL == CU_add_test(pSuite2, "Testing subset union.....", test_subset_union)) ||
+      (NULL == CU_add_test(pSuite2, "Testing context.....", test_context)) ||
+      (NULL == CU_add_test(pSuite2, "Testing SoA layout.....", test_soa_layout)) ||
+      (NULL == CU_add_test(pSuite2, "Testing point validation.....", test_validate_points)) ||
+      (NULL == CU_add_test(pSuite2, "Testing register parsing.....", test_read_registers)) ||
+      (NULL == CU_add_test(pSuite2, "Testing bucket ranges.....", test_bucket_range)) ||
+      (NULL == CU_add_test(pSuite2, "Testing io_uring streams.....", test_stream_io_uring)) ||
+      (NULL == CU_add_test(pSuite2, "Testing threshold keygen.....", test_threshold_keygen)) ||
+      (NULL == CU_add_test(pSuite2, "Testing partial decryption proofs.....", test_partial_proof)) ||
+      (NULL == CU_add_test(pSuite2, "Testing max protocol.....", test_max_protocol)) ||
+      (NULL == CU_add_test(pSuite2, "Testing multi-recipient encryption.....", test_multi_recipient))
       ) {
     CU_cleanup_registry();
     return CU_get_error();
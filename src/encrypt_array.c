@@ -1,14 +1,41 @@
 #include <stdio.h>
+#include <string.h>
 #include "elgamal.h"
 #include <assert.h>
 
 int main( int argc, char *argv[]) {
-  if (argc != 4) {
+  struct BucketRange range;
+  int range_given = take_range_option(&range, &argc, argv);
+  if (range_given < 0) {
+    return 1;
+  }
+  bool manifest = (argc == 4) && (strcmp(argv[1], "-manifest") == 0);
+  bool bits = (argc == 5) && (strcmp(argv[1], "-bits") == 0);
+  bool multi = (argc >= 7) && (argc % 2 == 1) && (strcmp(argv[1], "-multi") == 0);
+  if ((argc != 4) && !bits && !multi) {
     printf(
       "Usage:\n"
-      "  %s public.key input.txt output.bin\n\n"
-      "Encrypts a newline delimited list of integers in [0,%i]\n"
-      , argv[0], BUCKET_MAX);
+      "  %s [--range start:end] public.key input.txt output.bin\n"
+      "  %s -bits [--range start:end] public.key input.txt output.bits\n"
+      "  %s -manifest public.key manifest.txt\n"
+      "  %s -multi [--range start:end] input.txt public1.key output1.bin public2.key output2.bin ...\n\n"
+      "Encrypts a newline delimited list of integers in [0,%i]\n\n"
+      "With -manifest, encrypts many sketches under the same key at once.\n"
+      "Each line of manifest.txt is an input and an output file, e.g.\n"
+      "  metric1.txt metric1.bin\n"
+      "  metric2.txt metric2.bin\n\n"
+      "--range start:end only processes buckets [start, end), so that the\n"
+      "outputs for consecutive ranges can be concatenated with cat.\n\n"
+      "input.txt and output.bin may be - to read stdin or write stdout.\n\n"
+      "-bits writes each register as %d encrypted bits instead of %d unary\n"
+      "slots, which is %d times smaller and faster to encrypt. These are\n"
+      "combined with max-tests, max-shares, max-reencode and max-combine, at\n"
+      "the cost of a round trip to the key holders.\n\n"
+      "-multi encrypts the same input to up to %d keys at once, e.g. to\n"
+      "submit it to several consortia. Each output is a normal ciphertext\n"
+      "file for its key, but the outputs share their random nonces, which\n"
+      "saves computing them again for every key. Only output1.bin may be -.\n"
+      , argv[0], argv[0], argv[0], argv[0], BUCKET_MAX, BIT_WIDTH, BUCKET_MAX, BUCKET_MAX/BIT_WIDTH, MAX_RECIPIENTS);
     return 1;
   }
   if (sodium_init() < 0) {
@@ -16,7 +43,26 @@ int main( int argc, char *argv[]) {
     exit(-1);
   }
   int result;
-  result = encrypt_bucket_file(argv[1], argv[2], argv[3]);
+  if (manifest) {
+    if (range_given) {
+      error_print("ERROR: --range cannot be used with -manifest.\n");
+      return 1;
+    }
+    result = encrypt_bucket_manifest(argv[2], argv[3], 0);
+  } else if (multi) {
+    int nkeys = (argc - 3)/2;
+    char *key_fns[nkeys];
+    char *output_fns[nkeys];
+    for (int k=0; k<nkeys; k++) {
+      key_fns[k] = argv[3+2*k];
+      output_fns[k] = argv[4+2*k];
+    }
+    result = encrypt_bucket_file_multi_range(key_fns, output_fns, nkeys, argv[2], range);
+  } else if (bits) {
+    result = encrypt_bit_file_range(argv[2], argv[3], argv[4], range);
+  } else {
+    result = encrypt_bucket_file_range(argv[1], argv[2], argv[3], range);
+  }
   //result = encrypt_file("c", "b", "a");
   return result;
 }
@@ -0,0 +1,35 @@
+#include <stdio.h>
+#include <string.h>
+#include "elgamal.h"
+
+// Estimates many intersections of encrypted sketches with a single
+// round of distributed decryption, by inclusion-exclusion over unions
+
+int main( int argc, char *argv[] ) {
+  if (argc < 6) {
+    printf(
+      "Usage:\n"
+      "  %s -prepare queries.txt batch.bin [party0.bin ... partyN.bin]\n"
+      "  %s -finish queries.txt batch.bin estimates.txt [node1.ss ... nodeM.ss]\n\n"
+      "Each line of queries.txt lists the 0-based indices of the parties\n"
+      "whose intersection should be estimated, e.g. \"0 2\" for parties 0\n"
+      "and 2, or \"1\" for the cardinality of party 1 alone.\n\n"
+      "-prepare writes the combined arrays of every union needed by the\n"
+      "queries into batch.bin. Each node then runs get_partial_decryption\n"
+      "once on batch.bin, and -finish uses all of their outputs to write\n"
+      "one intersection estimate per query to estimates.txt.\n"
+      , argv[0], argv[0]);
+    return 1;
+  }
+  if (sodium_init() < 0) {
+    /* Panic!  library couldn't be initialized */
+    exit(-1);
+  }
+  if (strcmp(argv[1], "-prepare")==0) {
+    return prepare_intersection_batch(argv[2], argv[3], &argv[4], argc-4);
+  } else if (strcmp(argv[1], "-finish")==0) {
+    return finish_intersection_batch(argv[2], argv[3], argv[4], &argv[5], argc-5);
+  }
+  error_print("ERROR: unknown option: %s\n", argv[1]);
+  return -100;
+}
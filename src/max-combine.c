@@ -0,0 +1,24 @@
+#include <stdio.h>
+#include <string.h>
+#include "elgamal.h"
+
+// Last round of the max protocol, run by the aggregator
+
+int main( int argc, char *argv[] ) {
+  if (argc != 5) {
+    printf(
+      "Usage:\n"
+      "  %s combined.pub state.bin indicators.bin combined.bin\n\n"
+      "Finishes combining arrays written by encrypt_array -bits, from the\n"
+      "indicators max-reencode wrote and the state max-tests kept.\n"
+      "combined.bin holds the blinded max of every register, as a unary\n"
+      "array that decrypts like the output of combine-arrays.\n"
+      , argv[0]);
+    return 1;
+  }
+  if (sodium_init() < 0) {
+    /* Panic!  library couldn't be initialized */
+    exit(-1);
+  }
+  return max_combine_file(argv[1], argv[2], argv[3], argv[4]);
+}
@@ -0,0 +1,27 @@
+#include <stdio.h>
+#include <string.h>
+#include "elgamal.h"
+
+// End of the second round of the max protocol, run by a key holder
+
+int main( int argc, char *argv[] ) {
+  if (argc < 5) {
+    printf(
+      "Usage:\n"
+      "  %s combined.pub tests.bin indicators.bin node1.shares [node2.shares ... nodeN.shares]\n\n"
+      "Decrypts the equality tests written by max-tests with the shares\n"
+      "that max-shares wrote at every key holder, and writes a fresh\n"
+      "encryption under combined.pub of 1 in place of each test that holds\n"
+      "and of 0 in place of the others. The tests are shuffled, so this does\n"
+      "not reveal any register, as long as it is not run by the aggregator.\n\n"
+      "Fails without an output if a register of an input is not in\n"
+      "[0,%d], or if the shares are not from every key holder.\n"
+      , argv[0], BUCKET_MAX);
+    return 1;
+  }
+  if (sodium_init() < 0) {
+    /* Panic!  library couldn't be initialized */
+    exit(-1);
+  }
+  return reencode_tests_file(argv[1], argv[2], &argv[4], argc-4, argv[3]);
+}
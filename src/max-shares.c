@@ -0,0 +1,26 @@
+#include <stdio.h>
+#include <string.h>
+#include "elgamal.h"
+
+// Second round of the max protocol, run by every key holder
+
+int main( int argc, char *argv[] ) {
+  if (argc != 4) {
+    printf(
+      "Usage:\n"
+      "  %s node.priv tests.bin node.shares\n\n"
+      "Writes this key holder's shares of the equality tests written by\n"
+      "max-tests, for max-reencode. Every key holder behind the combined\n"
+      "public key has to run it.\n\n"
+      "Send node.shares to whoever runs max-reencode, and never to the\n"
+      "aggregator: with the shares of every key holder, it would learn\n"
+      "every register of every input.\n"
+      , argv[0]);
+    return 1;
+  }
+  if (sodium_init() < 0) {
+    /* Panic!  library couldn't be initialized */
+    exit(-1);
+  }
+  return max_test_shares_file(argv[1], argv[2], argv[3]);
+}
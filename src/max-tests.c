@@ -0,0 +1,27 @@
+#include <stdio.h>
+#include <string.h>
+#include "elgamal.h"
+
+// First round of the max protocol, run by the aggregator
+
+int main( int argc, char *argv[] ) {
+  if (argc < 4) {
+    printf(
+      "Usage:\n"
+      "  %s state.bin tests.bin node1.bits [node2.bits ... nodeN.bits]\n\n"
+      "Starts combining arrays written by encrypt_array -bits, which cannot\n"
+      "be added like unary arrays. Writes the shuffled and blinded equality\n"
+      "tests of every register to tests.bin, for the key holders to run\n"
+      "max-shares and max-reencode on, and the shuffles to state.bin for\n"
+      "max-combine.\n\n"
+      "Keep state.bin secret: with it, whoever runs max-reencode would learn\n"
+      "every register of every input.\n"
+      , argv[0]);
+    return 1;
+  }
+  if (sodium_init() < 0) {
+    /* Panic!  library couldn't be initialized */
+    exit(-1);
+  }
+  return max_tests_file(argv[1], argv[2], &argv[3], argc-3);
+}
@@ -0,0 +1,23 @@
+#include <stdio.h>
+#include "elgamal.h"
+
+// Merges a party's own plaintext register shards (by register-wise max)
+
+int main( int argc, char *argv[] ) {
+  if (argc < 3) {
+    printf(
+      "Usage:\n"
+      "  %s merged.txt [shard1.txt shard2.txt ... shardN.txt]\n\n"
+      "Generates a single newline delimited register file by taking the\n"
+      "register-wise max of a list of plaintext register files belonging\n"
+      "to the same party, so that only the merged file needs encrypting.\n\n"
+      "One input and the output may be - to read stdin or write stdout.\n"
+      , argv[0]);
+    return 1;
+  }
+  if (sodium_init() < 0) {
+    /* Panic!  library couldn't be initialized */
+    exit(-1);
+  }
+  return merge_register_files(argv[1], &argv[2], argc-2);
+}
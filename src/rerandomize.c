@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <string.h>
+#include "elgamal.h"
+
+// Rerandomizes an array of ElGamal CipherTexts under the combined public key
+
+int main( int argc, char *argv[] ) {
+  struct BucketRange range;
+  if (take_range_option(&range, &argc, argv) < 0) {
+    return 1;
+  }
+  bool blind = (argc == 5) && (strcmp(argv[1], "-blind") == 0);
+  if ((argc != 4) && !blind) {
+    printf(
+      "Usage:\n"
+      "  %s [-blind] [--range start:end] combined.pub input.bin output.bin\n\n"
+      "Adds a fresh encryption of zero to every ciphertext in input.bin.\n"
+      "The decrypted registers are unchanged, but output.bin can no longer\n"
+      "be linked to the arrays that were combined into input.bin.\n\n"
+      "-blind also multiplies every ciphertext by a fresh random scalar in\n"
+      "the same pass, so that decrypting parties only learn which slots\n"
+      "are zero. Blind once, before sending the array out for partial\n"
+      "decryption.\n\n"
+      "--range start:end only processes buckets [start, end), so that the\n"
+      "outputs for consecutive ranges can be concatenated with cat.\n\n"
+      "One input and the output may be - to read stdin or write stdout.\n"
+      , argv[0]);
+    return 1;
+  }
+  if (sodium_init() < 0) {
+    /* Panic!  library couldn't be initialized */
+    exit(-1);
+  }
+  int arg = blind ? 2 : 1;
+  return rerandomize_CipherText_file_range(argv[arg], argv[arg+1], argv[arg+2], blind, range);
+}
@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include "elgamal.h"
+
+// Deals threshold key shares: any t of the n nodes can decrypt together
+
+int main( int argc, char *argv[] ) {
+  if (argc != 4) {
+    printf(
+      "Usage:\n"
+      "  %s t n prefix\n\n"
+      "Generates a combined public key in prefix.pub, and n private key\n"
+      "shares in prefix1.priv ... prefixN.priv (with their public keys in\n"
+      "prefix1.pub ... prefixN.pub), such that the partial decryptions of\n"
+      "any t of the nodes are enough to decrypt.\n\n"
+      "Node i runs get_partial_decryption with prefixI.priv as usual, and\n"
+      "the partial decryptions are combined by passing them to\n"
+      "combine-secrets or decrypt_distributed as i:nodeI.ss.\n\n"
+      "Whoever runs this sees the whole private key, so it has to be\n"
+      "trusted and should delete the shares once they are handed out.\n"
+      , argv[0]);
+    return 1;
+  }
+  if (sodium_init() < 0) {
+    /* Panic!  library couldn't be initialized */
+    exit(-1);
+  }
+  int t = atoi(argv[1]);
+  int n = atoi(argv[2]);
+  if ((n < 1) || (n > 65536)) {
+    error_print("ERROR: the number of nodes must be between 1 and 65536.\n");
+    return 1;
+  }
+  size_t len = strlen(argv[3]) + 16;
+  char *pub_fn = malloc(len);
+  char **priv_fns = calloc((size_t)n, sizeof (char *));
+  char **pub_fns = calloc((size_t)n, sizeof (char *));
+  int return_val = 1;
+  if ((pub_fn == NULL) || (priv_fns == NULL) || (pub_fns == NULL)) { goto cleanup; }
+  snprintf(pub_fn, len, "%s.pub", argv[3]);
+  for (int i=0; i<n; i++) {
+    priv_fns[i] = malloc(len);
+    pub_fns[i] = malloc(len);
+    if ((priv_fns[i] == NULL) || (pub_fns[i] == NULL)) { goto cleanup; }
+    snprintf(priv_fns[i], len, "%s%d.priv", argv[3], i+1);
+    snprintf(pub_fns[i], len, "%s%d.pub", argv[3], i+1);
+  }
+  return_val = threshold_keygen(t, n, pub_fn, priv_fns, pub_fns);
+
+  cleanup:
+  for (int i=0; (priv_fns != NULL) && (pub_fns != NULL) && (i<n); i++) {
+    free(priv_fns[i]);
+    free(pub_fns[i]);
+  }
+  free(priv_fns);
+  free(pub_fns);
+  free(pub_fn);
+  return return_val;
+}
@@ -0,0 +1,131 @@
+// URING.C
+#define _GNU_SOURCE
+#include "uring.h"
+#include <stdlib.h>
+#include <string.h>
+#ifndef HAVE_IO_URING
+#define HAVE_IO_URING 0
+#endif
+#if HAVE_IO_URING
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+static void *uring_map(const int fd, const size_t bytes, const uint64_t offset) {
+  void *m = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, (off_t)offset);
+  return (m == MAP_FAILED) ? NULL : m;
+}
+
+void uring_free(struct Uring *r) {
+  if (r->sqes != NULL) { munmap(r->sqes, r->sqes_bytes); }
+  if ((r->cq_ring != NULL) && (r->cq_ring != r->sq_ring)) { munmap(r->cq_ring, r->cq_ring_bytes); }
+  if (r->sq_ring != NULL) { munmap(r->sq_ring, r->sq_ring_bytes); }
+  if (r->fd >= 0) { close(r->fd); }
+}
+
+static bool uring_supports_rw(const int fd) {
+  struct io_uring_probe *probe = calloc(1, sizeof (struct io_uring_probe) + 256*sizeof (struct io_uring_probe_op));
+  bool ok = (probe != NULL) &&
+    (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) >= 0) &&
+    (probe->ops_len > IORING_OP_WRITE) &&
+    ((probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) != 0) &&
+    ((probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED) != 0);
+  free(probe);
+  return ok;
+}
+
+int uring_init(struct Uring *r, const unsigned int entries) {
+  struct io_uring_params params;
+  memset(r, 0, sizeof *r);
+  memset(&params, 0, sizeof params);
+  r->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+  if (r->fd < 0) { return -1; }
+  r->sq_ring_bytes = params.sq_off.array + params.sq_entries*sizeof (unsigned int);
+  r->cq_ring_bytes = params.cq_off.cqes + params.cq_entries*sizeof (struct io_uring_cqe);
+  r->sqes_bytes = params.sq_entries*sizeof (struct io_uring_sqe);
+  bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single && (r->cq_ring_bytes > r->sq_ring_bytes)) { r->sq_ring_bytes = r->cq_ring_bytes; }
+  r->sq_ring = uring_map(r->fd, r->sq_ring_bytes, IORING_OFF_SQ_RING);
+  r->cq_ring = single ? r->sq_ring : uring_map(r->fd, r->cq_ring_bytes, IORING_OFF_CQ_RING);
+  r->sqes = uring_map(r->fd, r->sqes_bytes, IORING_OFF_SQES);
+  if ((r->sq_ring == NULL) || (r->cq_ring == NULL) || (r->sqes == NULL) || !uring_supports_rw(r->fd)) {
+    uring_free(r);
+    return -1;
+  }
+  unsigned char *sq = r->sq_ring;
+  unsigned char *cq = r->cq_ring;
+  r->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+  r->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+  r->sq_array = (unsigned int *)(sq + params.sq_off.array);
+  r->cq_head = (unsigned int *)(cq + params.cq_off.head);
+  r->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+  r->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  return 0;
+}
+
+static void uring_queue(struct Uring *r, const unsigned char opcode, const int fd, unsigned char *buf, const unsigned int len, const uint64_t off, const uint64_t user_data) {
+  unsigned int tail = *r->sq_tail;
+  unsigned int index = tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[index];
+  memset(sqe, 0, sizeof *sqe);
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)buf;
+  sqe->len = len;
+  sqe->off = off;
+  sqe->user_data = user_data;
+  r->sq_array[index] = index;
+  __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  r->to_submit++;
+}
+
+void uring_queue_read(struct Uring *r, const int fd, unsigned char *buf, const unsigned int len, const uint64_t off, const uint64_t user_data) {
+  uring_queue(r, IORING_OP_READ, fd, buf, len, off, user_data);
+}
+
+void uring_queue_write(struct Uring *r, const int fd, unsigned char *buf, const unsigned int len, const uint64_t off, const uint64_t user_data) {
+  uring_queue(r, IORING_OP_WRITE, fd, buf, len, off, user_data);
+}
+
+int uring_enter(struct Uring *r, const bool wait) {
+  long n;
+  do {
+    n = syscall(__NR_io_uring_enter, r->fd, r->to_submit, wait ? 1U : 0U, wait ? IORING_ENTER_GETEVENTS : 0U, NULL, (size_t)0);
+  } while ((n < 0) && (errno == EINTR));
+  if (n < 0) { return -1; }
+  r->to_submit -= (unsigned int)n;
+  return 0;
+}
+
+bool uring_reap(struct Uring *r, struct UringCompletion *c) {
+  unsigned int head = *r->cq_head;
+  if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) { return false; }
+  struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+  c->user_data = cqe->user_data;
+  c->res = cqe->res;
+  __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+#else
+int uring_init(struct Uring *r, const unsigned int entries) {
+  memset(r, 0, sizeof *r);
+  return -1;
+}
+
+void uring_free(struct Uring *r) {}
+
+void uring_queue_read(struct Uring *r, const int fd, unsigned char *buf, const unsigned int len, const uint64_t off, const uint64_t user_data) {}
+
+void uring_queue_write(struct Uring *r, const int fd, unsigned char *buf, const unsigned int len, const uint64_t off, const uint64_t user_data) {}
+
+int uring_enter(struct Uring *r, const bool wait) {
+  return -1;
+}
+
+bool uring_reap(struct Uring *r, struct UringCompletion *c) {
+  return false;
+}
+#endif
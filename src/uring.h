@@ -0,0 +1,59 @@
+#ifndef URING_H
+#define URING_H
+
+/* A minimal io_uring for plain reads and writes at file offsets, set up
+ * with the system calls of linux/io_uring.h, so there is no dependency on
+ * liburing. It is only built with HAVE_IO_URING. Without it, or on a kernel
+ * without io_uring or its plain reads and writes from Linux 5.6, uring_init
+ * fails and the callers use threads instead.
+ *
+ * Requests are queued with uring_queue_read and uring_queue_write, handed
+ * to the kernel by uring_enter, and their results collected by uring_reap,
+ * in any order, each with the user_data it was queued with.
+ * */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+struct Uring {
+  int fd;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  void *cq_ring;
+  size_t sq_ring_bytes;
+  size_t cq_ring_bytes;
+  size_t sqes_bytes;
+  // Queued but not yet submitted
+  unsigned int to_submit;
+};
+
+// res is the number of bytes read or written, or a negative errno
+struct UringCompletion {
+  uint64_t user_data;
+  int res;
+};
+
+// Sets up a ring for at least entries requests in flight. Returns 0, or -1
+// if io_uring or its reads and writes are not available
+int uring_init(struct Uring *r, const unsigned int entries);
+void uring_free(struct Uring *r);
+// Queue a request, which must fit in the ring with the others in flight
+void uring_queue_read(struct Uring *r, const int fd, unsigned char *buf, const unsigned int len, const uint64_t off, const uint64_t user_data);
+void uring_queue_write(struct Uring *r, const int fd, unsigned char *buf, const unsigned int len, const uint64_t off, const uint64_t user_data);
+// Submits everything queued, and if wait is set waits for a completion.
+// Returns 0, or -1 on error
+int uring_enter(struct Uring *r, const bool wait);
+// Takes the next completion into c. Returns false if there is none
+bool uring_reap(struct Uring *r, struct UringCompletion *c);
+
+#endif
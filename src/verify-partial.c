@@ -0,0 +1,33 @@
+#include <stdio.h>
+#include <string.h>
+#include "elgamal.h"
+
+// Checks a node's partial decryption against the proof it came with
+
+int main( int argc, char *argv[]) {
+  struct BucketRange range;
+  if (take_range_option(&range, &argc, argv) < 0) {
+    return 1;
+  }
+  bool soa = (argc == 6) && (strcmp(argv[1], "-soa") == 0);
+  if ((argc != 5) && !soa) {
+    printf(
+      "Usage:\n"
+      "  %s [-soa] [--range start:end] node.pub input.bin node.ss node.proof\n\n"
+      "Checks that node.ss is the partial decryption of input.bin by the\n"
+      "private key behind node.pub, using the proof written by\n"
+      "get_partial_decryption -proof. Returns 0 if it is, and 1 if not.\n\n"
+      "-soa and --range must match what get_partial_decryption was given.\n"
+      , argv[0]);
+    return 1;
+  }
+  if (sodium_init() < 0) {
+    /* Panic!  library couldn't be initialized */
+    exit(-1);
+  }
+  int arg = soa ? 2 : 1;
+  if (verify_partial_decryptions_range(argv[arg], argv[arg+1], argv[arg+2], argv[arg+3], range, soa) != 0) {
+    return 1;
+  }
+  return 0;
+}
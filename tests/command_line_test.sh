@@ -59,6 +59,67 @@ else
   echo +++ `date`: array_22 roundtrip failed
 fi
 
+echo +++ `date`: Combining the same arrays as a batch of subset queries
+echo "array_22_subset.bin 0 1" > array_subsets.txt
+../bin/combine-subsets array_subsets.txt array_12.bin array_21.bin
+../bin/decrypt_array command_test.priv array_22_subset.bin array_22_subset_decrypted.txt
+
+cmp -s array_22.txt array_22_subset_decrypted.txt
+if [[ $? -eq 0 ]]; then
+  echo +++ `date`: array_22 subset roundtrip successful
+else
+  echo +++ `date`: array_22 subset roundtrip failed
+fi
+
+echo
+echo ==================================================
+echo Test of merging plaintext shards before encryption
+echo +++ `date`: Merging array_12.txt and array_21.txt into array_22_merged.txt
+../bin/merge_registers array_22_merged.txt array_12.txt array_21.txt
+
+cmp -s array_22.txt array_22_merged.txt
+if [[ $? -eq 0 ]]; then
+  echo +++ `date`: array_22 merge successful
+else
+  echo +++ `date`: array_22 merge failed
+fi
+
+echo +++ `date`: Rerandomizing array_22.bin
+../bin/rerandomize command_test.pub array_22.bin array_22_rerandomized.bin
+../bin/decrypt_array command_test.priv array_22_rerandomized.bin array_22_rerandomized.txt
+
+cmp -s array_22.txt array_22_rerandomized.txt
+if [[ $? -eq 0 ]]; then
+  echo +++ `date`: array_22 rerandomized roundtrip successful
+else
+  echo +++ `date`: array_22 rerandomized roundtrip failed
+fi
+
+echo +++ `date`: Blinding and rerandomizing array_22.bin
+../bin/rerandomize -blind command_test.pub array_22.bin array_22_blinded.bin
+../bin/decrypt_array command_test.priv array_22_blinded.bin array_22_blinded.txt
+
+cmp -s array_22.txt array_22_blinded.txt
+if [[ $? -eq 0 ]]; then
+  echo +++ `date`: array_22 blinded roundtrip successful
+else
+  echo +++ `date`: array_22 blinded roundtrip failed
+fi
+
+echo +++ `date`: Encrypting array_12.txt and array_21.txt together from a manifest
+echo "array_12.txt array_12_manifest.bin" > array_manifest.txt
+echo "array_21.txt array_21_manifest.bin" >> array_manifest.txt
+../bin/encrypt_array -manifest command_test.pub array_manifest.txt
+../bin/decrypt_array command_test.priv array_12_manifest.bin array_12_manifest_decrypted.txt
+../bin/decrypt_array command_test.priv array_21_manifest.bin array_21_manifest_decrypted.txt
+
+cmp -s array_12.txt array_12_manifest_decrypted.txt && cmp -s array_21.txt array_21_manifest_decrypted.txt
+if [[ $? -eq 0 ]]; then
+  echo +++ `date`: array manifest roundtrip successful
+else
+  echo +++ `date`: array manifest roundtrip failed
+fi
+
 echo 
 echo ==================================================
 echo Test of distributed decryption
@@ -91,3 +152,127 @@ else
 fi
 
 
+
+echo +++ `date`: Decrypting straight from the shared secrets without combining
+../bin/decrypt_distributed array_counting_distributed.bin array_counting_streamed.txt array_counting_distributed.ss[0-9]
+
+cmp -s array_counting.txt array_counting_streamed.txt
+if [[ $? -eq 0 ]]; then
+  echo +++ `date`: array_counting_streamed roundtrip successful
+else
+  echo +++ `date`: array_counting_streamed roundtrip failed
+fi
+
+echo +++ `date`: Converting array_counting_distributed.bin to the SoA layout
+../bin/convert-layout -soa array_counting_distributed.bin array_counting_soa.bin
+
+echo +++ `date`: Getting shared secrets from each node using the SoA layout
+for (( i = 0; i < 10; i++ )); do
+  ../bin/get_partial_decryption -soa node$i.priv array_counting_soa.bin array_counting_soa.ss$i
+done
+../bin/combine-secrets array_counting_soa.ss_combined array_counting_soa.ss[0-9]
+../bin/decrypt_partial -soa array_counting_soa.ss_combined array_counting_soa.bin array_counting_soa.txt
+
+cmp -s array_counting.txt array_counting_soa.txt
+if [[ $? -eq 0 ]]; then
+  echo +++ `date`: array_counting_soa roundtrip successful
+else
+  echo +++ `date`: array_counting_soa roundtrip failed
+fi
+
+echo +++ `date`: Getting node0 shared secrets and decrypting in two bucket ranges
+../bin/get_partial_decryption --range 0:400 node0.priv array_counting_distributed.bin array_counting_range.ss0_a
+../bin/get_partial_decryption node0.priv array_counting_distributed.bin array_counting_range.ss0_b --range 400:
+../bin/decrypt_distributed --range 0:400 array_counting_distributed.bin array_counting_range_a.txt array_counting_distributed.ss[0-9]
+../bin/decrypt_distributed --range 400: array_counting_distributed.bin array_counting_range_b.txt array_counting_distributed.ss[0-9]
+cat array_counting_range.ss0_a array_counting_range.ss0_b > array_counting_range.ss0
+cat array_counting_range_a.txt array_counting_range_b.txt > array_counting_range.txt
+
+cmp -s array_counting_distributed.ss0 array_counting_range.ss0 && cmp -s array_counting.txt array_counting_range.txt
+if [[ $? -eq 0 ]]; then
+  echo +++ `date`: array_counting bucket range shards successful
+else
+  echo +++ `date`: array_counting bucket range shards failed
+fi
+
+echo +++ `date`: Piping array_counting_distributed.bin through stdin and stdout
+cat array_counting_distributed.bin | ../bin/get_partial_decryption node0.priv - - > array_counting_piped.ss0
+../bin/decrypt_distributed - - array_counting_distributed.ss[0-9] < array_counting_distributed.bin > array_counting_piped.txt
+
+cmp -s array_counting_distributed.ss0 array_counting_piped.ss0 && cmp -s array_counting.txt array_counting_piped.txt
+if [[ $? -eq 0 ]]; then
+  echo +++ `date`: array_counting piped successful
+else
+  echo +++ `date`: array_counting piped failed
+fi
+
+echo
+echo ==================================================
+echo Test of threshold decryption
+echo +++ `date`: Dealing 3 of 5 threshold key shares
+../bin/threshold-keygen 3 5 node-threshold
+../bin/encrypt_array node-threshold.pub array_counting.txt array_counting_threshold.bin
+for i in 2 4 5; do
+  ../bin/get_partial_decryption node-threshold$i.priv array_counting_threshold.bin array_counting_threshold.ss$i
+done
+echo +++ `date`: Combining the partial decryptions of nodes 2, 4 and 5
+../bin/combine-secrets array_counting_threshold.ss_combined 2:array_counting_threshold.ss2 4:array_counting_threshold.ss4 5:array_counting_threshold.ss5
+../bin/decrypt_partial array_counting_threshold.ss_combined array_counting_threshold.bin array_counting_threshold.txt
+../bin/decrypt_distributed array_counting_threshold.bin array_counting_threshold_streamed.txt 5:array_counting_threshold.ss5 2:array_counting_threshold.ss2 4:array_counting_threshold.ss4
+
+cmp -s array_counting.txt array_counting_threshold.txt && cmp -s array_counting.txt array_counting_threshold_streamed.txt
+if [[ $? -eq 0 ]]; then
+  echo +++ `date`: array_counting threshold roundtrip successful
+else
+  echo +++ `date`: array_counting threshold roundtrip failed
+fi
+
+echo Test of verifiable partial decryption
+../bin/get_partial_decryption -proof array_counting_threshold.proof2 node-threshold2.priv array_counting_threshold.bin array_counting_threshold.ss2
+../bin/verify-partial node-threshold2.pub array_counting_threshold.bin array_counting_threshold.ss2 array_counting_threshold.proof2
+valid=$?
+../bin/verify-partial node-threshold2.pub array_counting_threshold.bin array_counting_threshold.ss4 array_counting_threshold.proof2 2> /dev/null
+if [[ $valid -eq 0 && $? -eq 1 ]]; then
+  echo +++ `date`: partial decryption proof successful
+else
+  echo +++ `date`: partial decryption proof failed
+fi
+
+echo Test of the max protocol over bit encoded arrays
+echo +++ `date`: Encrypting array_12 and array_21 as bits to three nodes
+../bin/combine-keys node-max.pub node0.pub node1.pub node2.pub
+../bin/encrypt_array -bits node-max.pub array_12.txt array_12.bits
+../bin/encrypt_array -bits node-max.pub array_21.txt array_21.bits
+echo +++ `date`: Running the max protocol between the aggregator and the key holders
+../bin/max-tests array_22_max.state array_22_max.tests array_12.bits array_21.bits
+for (( i = 0; i < 3; i++ )); do
+  ../bin/max-shares node$i.priv array_22_max.tests array_22_max.shares$i
+done
+../bin/max-reencode node-max.pub array_22_max.tests array_22_max.partial array_22_max.shares0 array_22_max.shares1 2> /dev/null
+../bin/max-reencode node-max.pub array_22_max.tests array_22_max.indicators array_22_max.shares[0-2]
+../bin/max-combine node-max.pub array_22_max.state array_22_max.indicators array_22_max.bin
+for (( i = 0; i < 3; i++ )); do
+  ../bin/get_partial_decryption node$i.priv array_22_max.bin array_22_max.ss$i
+done
+../bin/decrypt_distributed array_22_max.bin array_22_max.txt array_22_max.ss[0-2]
+
+cmp -s array_22.txt array_22_max.txt && [[ ! -e array_22_max.partial ]]
+if [[ $? -eq 0 ]]; then
+  echo +++ `date`: array_22 max protocol roundtrip successful
+else
+  echo +++ `date`: array_22 max protocol roundtrip failed
+fi
+
+echo Test of encrypting to several keys at once
+echo +++ `date`: Encrypting array_counting to command_test.pub and a second key
+../bin/keygen command_test2.priv command_test2.pub
+../bin/encrypt_array -multi array_counting.txt command_test.pub array_counting_multi1.bin command_test2.pub array_counting_multi2.bin
+../bin/decrypt_array command_test.priv array_counting_multi1.bin array_counting_multi1.txt
+../bin/decrypt_array command_test2.priv array_counting_multi2.bin array_counting_multi2.txt
+
+cmp -s array_counting.txt array_counting_multi1.txt && cmp -s array_counting.txt array_counting_multi2.txt
+if [[ $? -eq 0 ]]; then
+  echo +++ `date`: array_counting multi-recipient roundtrip successful
+else
+  echo +++ `date`: array_counting multi-recipient roundtrip failed
+fi